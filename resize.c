@@ -22,7 +22,8 @@ static const char *msg[] = {
     "no error",
     "memory allocation failed",
     "invalid arguments were passed",
-    "underlying implementation failed"
+    "underlying implementation failed",
+    "end of data"
 };
 
 int main(int argc, const char *const *argv)
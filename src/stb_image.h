@@ -30,7 +30,7 @@
       GIF (*comp always reports as 4-channel)
       HDR (radiance rgbE format)
       PIC (Softimage PIC)
-      PNM (PPM and PGM binary only)
+      PNM (PPM, PGM and PAM binary only)
 
       Animated GIF still needs a proper API, but here's one way to do it:
           http://gist.github.com/urraka/685d9a6340b26b830d49
@@ -263,7 +263,10 @@ RECENT REVISION HISTORY:
 // code.)
 //
 // On x86, SSE2 will automatically be used when available based on a run-time
-// test; if not, the generic C versions are used as a fall-back. On ARM targets,
+// test; if not, the generic C versions are used as a fall-back. On x64 the
+// JPEG decoder also has AVX2 kernels (IDCT two blocks at a time, YCbCr->RGB
+// and 2x2 upsampling 16 pixels at a time) that are picked the same way and
+// give the same output; define STBI_NO_AVX2 to leave them out. On ARM targets,
 // the typical path is to have separate builds for NEON and non-NEON devices
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
@@ -337,7 +340,8 @@ RECENT REVISION HISTORY:
 //        STBI_NO_GIF
 //        STBI_NO_HDR
 //        STBI_NO_PIC
-//        STBI_NO_PNM   (.ppm and .pgm)
+//        STBI_NO_PNM   (.ppm, .pgm and .pam)
+//        STBI_NO_QOI
 //
 //  - You can request *only* certain decoders and suppress all other ones
 //    (this will be more forward-compatible, as addition of new decoders
@@ -351,7 +355,7 @@ RECENT REVISION HISTORY:
 //        STBI_ONLY_GIF
 //        STBI_ONLY_HDR
 //        STBI_ONLY_PIC
-//        STBI_ONLY_PNM   (.ppm and .pgm)
+//        STBI_ONLY_PNM   (.ppm, .pgm and .pam)
 //
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
@@ -547,7 +551,7 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #if defined(STBI_ONLY_JPEG) || defined(STBI_ONLY_PNG) || defined(STBI_ONLY_BMP) \
   || defined(STBI_ONLY_TGA) || defined(STBI_ONLY_GIF) || defined(STBI_ONLY_PSD) \
   || defined(STBI_ONLY_HDR) || defined(STBI_ONLY_PIC) || defined(STBI_ONLY_PNM) \
-  || defined(STBI_ONLY_ZLIB)
+  || defined(STBI_ONLY_QOI) || defined(STBI_ONLY_ZLIB)
    #ifndef STBI_ONLY_JPEG
    #define STBI_NO_JPEG
    #endif
@@ -575,6 +579,9 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
    #ifndef STBI_ONLY_PNM
    #define STBI_NO_PNM
    #endif
+   #ifndef STBI_ONLY_QOI
+   #define STBI_NO_QOI
+   #endif
 #endif
 
 #if defined(STBI_NO_PNG) && !defined(STBI_SUPPORT_ZLIB) && !defined(STBI_NO_ZLIB)
@@ -641,12 +648,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned long long stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -748,7 +757,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -759,7 +768,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -772,6 +781,34 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 jpeg kernels on x64. they are compiled for AVX2 on their own and only
+// picked when the cpu has it, so the rest of the build needs no extra flags
+#if defined(STBI_SSE2) && defined(STBI__X64_TARGET) && !defined(STBI_NO_JPEG) && !defined(STBI_NO_AVX2)
+#if defined(__GNUC__)
+#define STBI_AVX2
+#include <immintrin.h>
+#define STBI__TARGET_AVX2 __attribute__((target("avx2")))
+static int stbi__avx2_available(void)
+{
+   return __builtin_cpu_supports("avx2");
+}
+#elif defined(_MSC_VER) && _MSC_VER >= 1900
+#define STBI_AVX2
+#include <immintrin.h>
+#define STBI__TARGET_AVX2
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info, 1);
+   // the OS has to save the ymm registers too
+   if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+      return 0;
+   __cpuidex(info, 7, 0);
+   return (info[1] >> 5) & 1;
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -815,6 +852,24 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // optional caller-owned 8-bit destination for stbi__load_and_postprocess_8bit;
+   // decoders that can write rows in place do so, the rest get copied in
+   stbi_uc *out_buffer;
+   int out_stride, out_rows;
+
+   // optional caller-provided loop that runs fn(ctx, 0..n-1), possibly on
+   // several threads; the jpeg decoder spreads large images over it
+   void (*parallel_for)(void *user, int n, void (*fn)(void *ctx, int i), void *ctx);
+   void *parallel_user;
+
+   // optional region of interest for stbi__load_and_postprocess_8bit, roi_w
+   // 0 is the whole image. jpeg only decodes that part, the rest get cropped
+   int roi_x, roi_y, roi_w, roi_h;
+
+   // optional 1/8 scale preview for stbi__load_and_postprocess_8bit. jpeg
+   // builds it from the DC coefficients alone, the rest get box filtered
+   int dc_only;
 } stbi__context;
 
 
@@ -828,6 +883,10 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->out_buffer = NULL;
+   s->parallel_for = NULL;
+   s->roi_w = 0;
+   s->dc_only = 0;
 }
 
 // initialize a callback-based context
@@ -839,6 +898,10 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
+   s->out_buffer = NULL;
+   s->parallel_for = NULL;
+   s->roi_w = 0;
+   s->dc_only = 0;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
 }
@@ -881,6 +944,19 @@ static void stbi__start_file(stbi__context *s, FILE *f)
 
 #endif // !STBI_NO_STDIO
 
+// does the region lie inside an x*y image?
+static int stbi__roi_fits(stbi__context *s, int x, int y)
+{
+   return s->roi_x >= 0 && s->roi_y >= 0 && s->roi_w > 0 && s->roi_h > 0 &&
+          s->roi_x <= x - s->roi_w && s->roi_y <= y - s->roi_h;
+}
+
+// does an x*y image with 'channels' bytes per pixel fit the caller's buffer?
+static int stbi__out_buffer_fits(stbi__context *s, int x, int y, int channels)
+{
+   return channels > 0 && (size_t) x * channels <= (size_t) s->out_stride && y <= s->out_rows;
+}
+
 static void stbi__rewind(stbi__context *s)
 {
    // conceptually rewind SHOULD rewind to the beginning of the stream,
@@ -901,6 +977,8 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int dc_scaled; // the loader honoured stbi__context.dc_only
+   int roi_cropped; // the loader decoded only stbi__context.roi_*
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -961,6 +1039,12 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 static int      stbi__pnm_is16(stbi__context *s);
 #endif
 
+#ifndef STBI_NO_QOI
+static int      stbi__qoi_test(stbi__context *s);
+static void    *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static int      stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
 static
 #ifdef STBI_THREAD_LOCAL
 STBI_THREAD_LOCAL
@@ -1168,6 +1252,9 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    #ifndef STBI_NO_PNM
    if (stbi__pnm_test(s))  return stbi__pnm_load(s,x,y,comp,req_comp, ri);
    #endif
+   #ifndef STBI_NO_QOI
+   if (stbi__qoi_test(s))  return stbi__qoi_load(s,x,y,comp,req_comp, ri);
+   #endif
 
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
@@ -1217,16 +1304,15 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    return enlarged;
 }
 
-static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
+static void stbi__vertical_flip_stride(void *image, size_t bytes_per_row, int h, size_t stride)
 {
    int row;
-   size_t bytes_per_row = (size_t)w * bytes_per_pixel;
    stbi_uc temp[2048];
    stbi_uc *bytes = (stbi_uc *)image;
 
    for (row = 0; row < (h>>1); row++) {
-      stbi_uc *row0 = bytes + row*bytes_per_row;
-      stbi_uc *row1 = bytes + (h - row - 1)*bytes_per_row;
+      stbi_uc *row0 = bytes + row*stride;
+      stbi_uc *row1 = bytes + (h - row - 1)*stride;
       // swap row0 with row1
       size_t bytes_left = bytes_per_row;
       while (bytes_left) {
@@ -1241,6 +1327,12 @@ static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
    }
 }
 
+static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
+{
+   size_t bytes_per_row = (size_t)w * bytes_per_pixel;
+   stbi__vertical_flip_stride(image, bytes_per_row, h, bytes_per_row);
+}
+
 #ifndef STBI_NO_GIF
 static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int bytes_per_pixel)
 {
@@ -1255,6 +1347,30 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 }
 #endif
 
+// average every 8x8 block (fewer at the right and bottom edges) into one
+// pixel, in place: a block is never read after its output is written
+static void stbi__box_eighth(stbi_uc *image, int *x, int *y, int channels)
+{
+   int w = (*x + 7) >> 3, h = (*y + 7) >> 3;
+   int i, j, c, u, v;
+   for (j=0; j < h; ++j) {
+      int rows = *y - j*8 < 8 ? *y - j*8 : 8;
+      for (i=0; i < w; ++i) {
+         int cols = *x - i*8 < 8 ? *x - i*8 : 8;
+         int n = rows * cols;
+         for (c=0; c < channels; ++c) {
+            int sum = n / 2;
+            for (v=0; v < rows; ++v)
+               for (u=0; u < cols; ++u)
+                  sum += image[((size_t) (j*8+v) * *x + i*8+u) * channels + c];
+            image[((size_t) j * w + i) * channels + c] = (stbi_uc) (sum / n);
+         }
+      }
+   }
+   *x = w;
+   *y = h;
+}
+
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
@@ -1273,6 +1389,43 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
+   if (s->dc_only && !ri.dc_scaled)
+      stbi__box_eighth((stbi_uc *) result, x, y, req_comp ? req_comp : *comp);
+
+   if (s->roi_w && !ri.roi_cropped) {
+      // the loader decoded everything, move the region to the front
+      int j, channels = req_comp ? req_comp : *comp;
+      size_t row_bytes = (size_t) s->roi_w * channels;
+      if (!stbi__roi_fits(s, *x, *y)) {
+         STBI_FREE(result);
+         return stbi__errpuc("bad region", "Region outside the image");
+      }
+      for (j=0; j < s->roi_h; ++j)
+         memmove((stbi_uc *) result + j*row_bytes, (stbi_uc *) result + ((size_t) (s->roi_y+j) * *x + s->roi_x) * channels, row_bytes);
+      *x = s->roi_w;
+      *y = s->roi_h;
+   }
+
+   if (s->out_buffer) {
+      int channels = req_comp ? req_comp : *comp;
+      size_t row_bytes = (size_t) *x * channels;
+      if (result != s->out_buffer) {
+         // the loader had to allocate, copy into the caller's rows
+         int j, flip = stbi__vertically_flip_on_load;
+         if (!stbi__out_buffer_fits(s, *x, *y, channels)) {
+            STBI_FREE(result);
+            return stbi__errpuc("buffer too small", "Output buffer too small");
+         }
+         for (j=0; j < *y; ++j)
+            memcpy(s->out_buffer + (size_t) (flip ? *y-1-j : j) * s->out_stride, (stbi_uc *) result + j*row_bytes, row_bytes);
+         STBI_FREE(result);
+         return s->out_buffer;
+      }
+      if (stbi__vertically_flip_on_load)
+         stbi__vertical_flip_stride(result, row_bytes, *y, s->out_stride);
+      return s->out_buffer;
+   }
+
    if (stbi__vertically_flip_on_load) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
@@ -1686,7 +1839,7 @@ static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
 }
 #endif
 
-#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC)
+#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC) && defined(STBI_NO_QOI)
 // nothing
 #else
 static int stbi__get16be(stbi__context *s)
@@ -1696,7 +1849,7 @@ static int stbi__get16be(stbi__context *s)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC) && defined(STBI_NO_QOI)
 // nothing
 #else
 static stbi__uint32 stbi__get32be(stbi__context *s)
@@ -1727,7 +1880,7 @@ static stbi__uint32 stbi__get32le(stbi__context *s)
 
 #define STBI__BYTECAST(x)  ((stbi_uc) ((x) & 255))  // truncate int to byte without warnings
 
-#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM) && defined(STBI_NO_QOI)
 // nothing
 #else
 //////////////////////////////////////////////////////////////////////////////
@@ -1747,7 +1900,7 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM) && defined(STBI_NO_QOI)
 // nothing
 #else
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
@@ -1988,12 +2141,21 @@ typedef struct
    int            jfif;
    int            app14_color_transform; // Adobe APP14 tag
    int            rgb;
+   int            coeffs_only; // keep the quantized coefficients, no pixels
+   int            dc_done;     // stbi__context.dc_only: components with a DC, a bit each
 
    int scan_n, order[4];
    int restart_interval, todo;
 
+// region of interest in MCUs, with room for upsampling around it
+   int roi_mcu_x0, roi_mcu_y0, roi_mcu_x1, roi_mcu_y1;
+// the same in blocks (or MCUs if interleaved) of the current scan
+   int roi_col0, roi_col1, roi_row0, roi_row1;
+   int roi_done; // every block in the region is decoded
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block2_kernel)(stbi_uc *out0, int out_stride0, short *data0, stbi_uc *out1, int out_stride1, short *data1); // NULL if none
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -2702,6 +2864,182 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// the sse2 IDCT above with one block in each 128-bit half, so two blocks go
+// through for the price of one. every step stays inside its half, which
+// keeps the output bit-identical
+static STBI__TARGET_AVX2 void stbi__idct_avx2(stbi_uc *out0, int out_stride0, short *data0, stbi_uc *out1, int out_stride1, short *data1)
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // row k of block 0 in the low half, of block 1 in the high half
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data0 + (k)*8))), \
+                              _mm_load_si128((const __m128i *) (data1 + (k)*8)), 1)
+
+   // rows 2k and 2k+1 of each block sit in the low and high 8 bytes of each half
+   #define dct_store(v) \
+      { \
+         __m128i lo = _mm256_castsi256_si128(v), hi = _mm256_extracti128_si256(v, 1); \
+         _mm_storel_epi64((__m128i *) out0, lo); out0 += out_stride0; \
+         _mm_storel_epi64((__m128i *) out0, _mm_shuffle_epi32(lo, 0x4e)); out0 += out_stride0; \
+         _mm_storel_epi64((__m128i *) out1, hi); out1 += out_stride1; \
+         _mm_storel_epi64((__m128i *) out1, _mm_shuffle_epi32(hi, 0x4e)); out1 += out_stride1; \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack and 8bit 8x8 transpose
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // dct_store does two rows of each block
+      dct_store(p0);
+      dct_store(p2);
+      dct_store(p1);
+      dct_store(p3);
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2944,13 +3282,405 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// baseline blocks are decoded into 'data[cur]' and handed to stbi__jpeg_idct.
+// with a two block kernel, the first of a pair waits in the other buffer
+typedef struct
+{
+   STBI_SIMD_ALIGN(short, data[2][64]);
+   int cur;
+   stbi_uc *out; // where the waiting block goes, NULL if none
+   int out_stride;
+} stbi__jpeg_idct_queue;
+
+static void stbi__jpeg_idct(stbi__jpeg *z, stbi__jpeg_idct_queue *q, stbi_uc *out, int out_stride)
+{
+   if (!z->idct_block2_kernel) {
+      z->idct_block_kernel(out, out_stride, q->data[q->cur]);
+   } else if (q->out) {
+      z->idct_block2_kernel(q->out, q->out_stride, q->data[q->cur ^ 1], out, out_stride, q->data[q->cur]);
+      q->out = NULL;
+   } else {
+      q->out = out;
+      q->out_stride = out_stride;
+      q->cur ^= 1;
+   }
+}
+
+static void stbi__jpeg_idct_flush(stbi__jpeg *z, stbi__jpeg_idct_queue *q)
+{
+   if (q->out) {
+      z->idct_block_kernel(q->out, q->out_stride, q->data[q->cur ^ 1]);
+      q->out = NULL;
+   }
+}
+
+// images with fewer pixels decode on the calling thread even with a
+// parallel_for hook, starting threads would cost more than it saves
+#define STBI__JPEG_PARALLEL_MIN (1 << 18)
+#define STBI__JPEG_PARALLEL_TASKS 64
+
+// blocks (MCUs if interleaved) of the current baseline scan in the region
+static void stbi__jpeg_roi_scan(stbi__jpeg *z)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int h = (z->img_comp[n].y+7) >> 3;
+      z->roi_col0 = z->roi_mcu_x0 * z->img_comp[n].h;
+      z->roi_row0 = z->roi_mcu_y0 * z->img_comp[n].v;
+      z->roi_col1 = z->roi_mcu_x1 * z->img_comp[n].h < w ? z->roi_mcu_x1 * z->img_comp[n].h : w;
+      z->roi_row1 = z->roi_mcu_y1 * z->img_comp[n].v < h ? z->roi_mcu_y1 * z->img_comp[n].v : h;
+   } else {
+      z->roi_col0 = z->roi_mcu_x0;
+      z->roi_row0 = z->roi_mcu_y0;
+      z->roi_col1 = z->roi_mcu_x1;
+      z->roi_row1 = z->roi_mcu_y1;
+   }
+}
+
+#define STBI__JPEG_IN_ROI(z,i,j)  ((i) >= (z)->roi_col0 && (i) < (z)->roi_col1 && (j) >= (z)->roi_row0 && (j) < (z)->roi_row1)
+
+// the rest of the scan is below the region. with every component done stop
+// decoding, otherwise skip to the next scan
+static int stbi__skip_jpeg_junk_at_end(stbi__jpeg *j);
+
+// jump to the marker after the current scan, past its restart markers
+static int stbi__jpeg_skip_scan(stbi__jpeg *z)
+{
+   for (;;) {
+      if (z->marker == STBI__MARKER_none) {
+         z->marker = stbi__skip_jpeg_junk_at_end(z);
+         if (z->marker == STBI__MARKER_none) break;
+      }
+      if (!STBI__RESTART(z->marker)) break;
+      z->marker = STBI__MARKER_none;
+   }
+   return 1;
+}
+
+static int stbi__jpeg_roi_stop(stbi__jpeg *z)
+{
+   if (z->scan_n == z->s->img_n) {
+      z->roi_done = 1;
+      return 1;
+   }
+   return stbi__jpeg_skip_scan(z);
+}
+
+// number of MCUs in a baseline scan, a non-interleaved MCU is a single block
+static int stbi__jpeg_scan_mcus(stbi__jpeg *z)
+{
+   int n = z->order[0];
+   if (z->scan_n == 1)
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// decode MCUs m..m1-1 of a baseline scan, which start a restart interval
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int m, int m1)
+{
+   stbi__jpeg_idct_queue q;
+   q.cur = 0;
+   q.out = NULL;
+   stbi__jpeg_reset(z);
+   for (; m < m1; ++m) {
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int i = m % w, j = m / w;
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, q.data[q.cur], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         if (STBI__JPEG_IN_ROI(z, i, j))
+            stbi__jpeg_idct(z, &q, z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2);
+      } else {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         int k,x,y, in_roi = STBI__JPEG_IN_ROI(z, i, j);
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8;
+                  int y2 = (j*z->img_comp[n].v + y)*8;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, q.data[q.cur], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  if (in_roi)
+                     stbi__jpeg_idct(z, &q, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2);
+               }
+            }
+         }
+      }
+   }
+   stbi__jpeg_idct_flush(z, &q);
+   return 1;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **start; // first entropy-coded byte of every restart interval
+   int first, last; // intervals to decode
+   int per_task, mcus;
+   stbi_uc ok[STBI__JPEG_PARALLEL_TASKS];
+   stbi_uc *end;    // where the last interval stopped reading
+   stbi_uc marker;
+} stbi__jpeg_intervals;
+
+// each task decodes a run of intervals with its own copy of the decoder
+static void stbi__jpeg_decode_intervals(void *ctx, int t)
+{
+   stbi__jpeg_intervals *iv = (stbi__jpeg_intervals *) ctx;
+   stbi__context s = *iv->z->s;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   int k = iv->first + t * iv->per_task;
+   int k1 = k + iv->per_task < iv->last ? k + iv->per_task : iv->last;
+   int ri = iv->z->restart_interval;
+   iv->ok[t] = 0;
+   if (!z) return;
+   *z = *iv->z;
+   z->s = &s;
+   for (; k < k1; ++k) {
+      s.img_buffer = iv->start[k];
+      if (!stbi__jpeg_decode_mcus(z, k*ri, k*ri + ri < iv->mcus ? k*ri + ri : iv->mcus)) { STBI_FREE(z); return; }
+   }
+   if (k1 == iv->last) {
+      iv->end = s.img_buffer;
+      iv->marker = z->marker;
+   }
+   STBI_FREE(z);
+   iv->ok[t] = 1;
+}
+
+// restart intervals of a baseline scan don't depend on each other. when the
+// file is in memory, find the RSTn markers, then decode the intervals through
+// the parallel_for hook and/or skip the ones outside the region of interest.
+// returns -1 to leave the scan to the serial decoder
+static int stbi__jpeg_parse_intervals(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   stbi__jpeg_intervals iv;
+   stbi_uc *p = s->img_buffer, *end = s->img_buffer_end;
+   int k, intervals, tasks, per_row;
+   int threads = s->parallel_for && (stbi__uint64) s->img_x * s->img_y >= STBI__JPEG_PARALLEL_MIN;
+
+   if (z->progressive || !z->restart_interval || s->read_from_callbacks || (!threads && !s->roi_w))
+      return -1;
+   iv.mcus = stbi__jpeg_scan_mcus(z);
+   intervals = (iv.mcus + z->restart_interval - 1) / z->restart_interval;
+   if (intervals < 2) return -1;
+   per_row = z->scan_n == 1 ? (z->img_comp[z->order[0]].x+7) >> 3 : z->img_mcu_x;
+   iv.first = z->roi_row0 * per_row / z->restart_interval;
+   iv.last = (z->roi_row1 * per_row + z->restart_interval - 1) / z->restart_interval;
+   if (iv.last > intervals) iv.last = intervals;
+   iv.start = (stbi_uc **) stbi__malloc_mad2(iv.last, sizeof(stbi_uc *), 0);
+   if (!iv.start) return -1;
+
+   // every 0xff in entropy-coded data is a stuffed 0xff00, fill or a marker
+   iv.start[0] = p;
+   for (k=1; k < iv.last; ) {
+      p = (stbi_uc *) memchr(p, 0xff, end - p);
+      if (!p) break;
+      while (p+1 < end && p[1] == 0xff) ++p;
+      if (p+1 >= end) break;
+      if (p[1] != 0) {
+         if (!STBI__RESTART(p[1])) break;
+         iv.start[k++] = p+2;
+      }
+      p += 2;
+   }
+   // markers missing: let the serial decoder make the best of it
+   if (k < iv.last) { STBI_FREE(iv.start); return -1; }
+
+   iv.z = z;
+   if (threads) {
+      iv.per_task = (iv.last - iv.first + STBI__JPEG_PARALLEL_TASKS-1) / STBI__JPEG_PARALLEL_TASKS;
+      tasks = (iv.last - iv.first + iv.per_task-1) / iv.per_task;
+      s->parallel_for(s->parallel_user, tasks, stbi__jpeg_decode_intervals, &iv);
+   } else {
+      iv.per_task = iv.last - iv.first;
+      tasks = 1;
+      stbi__jpeg_decode_intervals(&iv, 0);
+   }
+   STBI_FREE(iv.start);
+   for (k=0; k < tasks; ++k)
+      if (!iv.ok[k]) return stbi__err("bad restart interval", "Corrupt JPEG");
+
+   // carry on after the scan like the serial decoder would
+   s->img_buffer = iv.end;
+   z->marker = iv.marker;
+   return s->roi_w ? stbi__jpeg_roi_stop(z) : 1;
+}
+
+// a baseline scan into img_comp[].coeff, quantized like a progressive one
+static int stbi__jpeg_decode_coeffs(stbi__jpeg *z)
+{
+   stbi__uint16 ones[64];
+   int i,j,k,x,y;
+   for (i=0; i < 64; ++i) ones[i] = 1;
+   stbi__jpeg_reset(z);
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int h = (z->img_comp[n].y+7) >> 3;
+      int ha = z->img_comp[n].ha;
+      for (j=0; j < h; ++j) {
+         for (i=0; i < w; ++i) {
+            short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, ones)) return 0;
+            if (--z->todo <= 0) {
+               if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+               if (!STBI__RESTART(z->marker)) return 1;
+               stbi__jpeg_reset(z);
+            }
+         }
+      }
+   } else {
+      for (j=0; j < z->img_mcu_y; ++j) {
+         for (i=0; i < z->img_mcu_x; ++i) {
+            for (k=0; k < z->scan_n; ++k) {
+               int n = z->order[k];
+               int ha = z->img_comp[n].ha;
+               for (y=0; y < z->img_comp[n].v; ++y) {
+                  for (x=0; x < z->img_comp[n].h; ++x) {
+                     int x2 = (i*z->img_comp[n].h + x);
+                     int y2 = (j*z->img_comp[n].v + y);
+                     short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
+                     if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, ones)) return 0;
+                  }
+               }
+            }
+            if (--z->todo <= 0) {
+               if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+               if (!STBI__RESTART(z->marker)) return 1;
+               stbi__jpeg_reset(z);
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+// a block's pixel in a 1/8 scale preview: what the idct makes of its DC alone.
+// baseline blocks still have to huffman decode their AC to get past it
+static int stbi__jpeg_decode_block_dc(stbi__jpeg *j, stbi_uc *out, stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, int dequant)
+{
+   int diff,dc,k,t;
+
+   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+   t = stbi__jpeg_huff_decode(j, hdc);
+   if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+   diff = t ? stbi__extend_receive(j, t) : 0;
+   if (!stbi__addints_valid(j->img_comp[b].dc_pred, diff)) return stbi__err("bad delta","Corrupt JPEG");
+   dc = j->img_comp[b].dc_pred + diff;
+   j->img_comp[b].dc_pred = dc;
+   if (!stbi__mul2shorts_valid(dc, 1 << j->succ_low)) return stbi__err("bad delta","Corrupt JPEG");
+   *out = stbi__clamp((((dc * (1 << j->succ_low)) * dequant + 4) >> 3) + 128);
+
+   if (!hac) return 1;
+   k = 1;
+   do {
+      int c,r,s;
+      if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      r = fac[c];
+      if (r) { // fast-AC path, the value is in the code already
+         k += ((r >> 4) & 15) + 1;
+         s = r & 15;
+         if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+      } else {
+         int rs = stbi__jpeg_huff_decode(j, hac);
+         if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         r = rs >> 4;
+         if (s == 0) {
+            if (rs != 0xf0) break; // end block
+            k += 16;
+         } else {
+            k += r + 1;
+            stbi__extend_receive(j, s);
+         }
+      }
+   } while (k < 64);
+   return 1;
+}
+
+// stbi__context.dc_only: one pixel per block into img_comp[].data. scans
+// other than baseline or first progressive DC ones are skipped, and once
+// every component has its DC the rest of the file is left unread
+static int stbi__jpeg_decode_dc(stbi__jpeg *z)
+{
+   int i,j,k,x,y;
+   if (z->progressive && (z->spec_start != 0 || z->succ_high != 0))
+      return stbi__jpeg_skip_scan(z);
+   stbi__jpeg_reset(z);
+   for (k=0; k < z->scan_n; ++k)
+      z->dc_done |= 1 << z->order[k];
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int h = (z->img_comp[n].y+7) >> 3;
+      int ha = z->img_comp[n].ha;
+      stbi__huffman *hac = z->progressive ? NULL : z->huff_ac+ha;
+      for (j=0; j < h; ++j) {
+         for (i=0; i < w; ++i) {
+            stbi_uc *out = z->img_comp[n].data + z->img_comp[n].w2*j + i;
+            if (!stbi__jpeg_decode_block_dc(z, out, z->huff_dc+z->img_comp[n].hd, hac, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq][0])) return 0;
+            if (--z->todo <= 0) {
+               if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+               if (!STBI__RESTART(z->marker)) return 1;
+               stbi__jpeg_reset(z);
+            }
+         }
+      }
+   } else {
+      for (j=0; j < z->img_mcu_y; ++j) {
+         for (i=0; i < z->img_mcu_x; ++i) {
+            for (k=0; k < z->scan_n; ++k) {
+               int n = z->order[k];
+               int ha = z->img_comp[n].ha;
+               stbi__huffman *hac = z->progressive ? NULL : z->huff_ac+ha;
+               for (y=0; y < z->img_comp[n].v; ++y) {
+                  for (x=0; x < z->img_comp[n].h; ++x) {
+                     int x2 = (i*z->img_comp[n].h + x);
+                     int y2 = (j*z->img_comp[n].v + y);
+                     stbi_uc *out = z->img_comp[n].data + z->img_comp[n].w2*y2 + x2;
+                     if (!stbi__jpeg_decode_block_dc(z, out, z->huff_dc+z->img_comp[n].hd, hac, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq][0])) return 0;
+                  }
+               }
+            }
+            if (--z->todo <= 0) {
+               if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+               if (!STBI__RESTART(z->marker)) return 1;
+               stbi__jpeg_reset(z);
+            }
+         }
+      }
+   }
+   if (z->progressive && z->dc_done == (1 << z->s->img_n) - 1)
+      z->roi_done = 1;
+   return 1;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
+   stbi__jpeg_idct_queue q;
+   int r;
+   if (z->s->dc_only)
+      return stbi__jpeg_decode_dc(z);
+   if (z->coeffs_only && !z->progressive)
+      return stbi__jpeg_decode_coeffs(z);
+   if (!z->progressive) {
+      stbi__jpeg_roi_scan(z);
+      r = stbi__jpeg_parse_intervals(z);
+      if (r >= 0) return r;
+   }
+   q.cur = 0;
+   q.out = NULL;
    stbi__jpeg_reset(z);
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2961,24 +3691,27 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (!stbi__jpeg_decode_block(z, q.data[q.cur], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               if (STBI__JPEG_IN_ROI(z, i, j))
+                  stbi__jpeg_idct(z, &q, z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                   // if it's NOT a restart, then just bail, so we get corrupt data
                   // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__jpeg_idct_flush(z, &q); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->s->roi_w && j+1 == z->roi_row1) { stbi__jpeg_idct_flush(z, &q); return stbi__jpeg_roi_stop(z); }
          }
+         stbi__jpeg_idct_flush(z, &q);
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
          for (j=0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
+               int in_roi = STBI__JPEG_IN_ROI(z, i, j);
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
                   int n = z->order[k];
@@ -2989,8 +3722,9 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                         int x2 = (i*z->img_comp[n].h + x)*8;
                         int y2 = (j*z->img_comp[n].v + y)*8;
                         int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        if (!stbi__jpeg_decode_block(z, q.data[q.cur], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        if (in_roi)
+                           stbi__jpeg_idct(z, &q, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2);
                      }
                   }
                }
@@ -2998,11 +3732,13 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                // so now count down the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__jpeg_idct_flush(z, &q); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->s->roi_w && j+1 == z->roi_row1) { stbi__jpeg_idct_flush(z, &q); return stbi__jpeg_roi_stop(z); }
          }
+         stbi__jpeg_idct_flush(z, &q);
          return 1;
       }
    } else {
@@ -3084,10 +3820,20 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            if (j / z->img_comp[n].v < z->roi_mcu_y0 || j / z->img_comp[n].v >= z->roi_mcu_y1) continue;
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8;
+               if (i / z->img_comp[n].h < z->roi_mcu_x0 || i / z->img_comp[n].h >= z->roi_mcu_x1) continue;
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->idct_block2_kernel && i+1 < w) {
+                  // the next block sits right after this one
+                  stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+                  z->idct_block2_kernel(out, z->img_comp[n].w2, data, out+8, z->img_comp[n].w2, data+64);
+                  ++i;
+               } else {
+                  z->idct_block_kernel(out, z->img_comp[n].w2, data);
+               }
             }
          }
       }
@@ -3329,15 +4075,27 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // so these muls can't overflow with 32-bit ints (which we require)
       z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
       z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // a 1/8 scale preview has a pixel per block
+      if (s->dc_only) {
+         z->img_comp[i].w2 /= 8;
+         z->img_comp[i].h2 /= 8;
+      }
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-      if (z->img_comp[i].raw_data == NULL)
-         return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      if (z->progressive) {
+      z->img_comp[i].raw_data = NULL;
+      z->img_comp[i].data = NULL;
+      if (!z->coeffs_only) {
+         z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+         if (z->img_comp[i].raw_data == NULL)
+            return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+         // align blocks for idct using mmx/sse
+         z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+         // grey where a broken file has no DC for a block
+         if (s->dc_only)
+            memset(z->img_comp[i].data, 128, (size_t) z->img_comp[i].w2 * z->img_comp[i].h2);
+      }
+      if ((z->progressive && !s->dc_only) || z->coeffs_only) {
          // w2, h2 are multiples of 8 (see above)
          z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
          z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
@@ -3345,6 +4103,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+         // padding blocks that no scan reaches are written out as well
+         if (z->coeffs_only)
+            memset(z->img_comp[i].coeff, 0, (size_t) z->img_comp[i].w2 * z->img_comp[i].h2 * sizeof(short));
       }
    }
 
@@ -3406,8 +4167,29 @@ static int stbi__skip_jpeg_junk_at_end(stbi__jpeg *j)
    return STBI__MARKER_none;
 }
 
-// decode image to YCbCr format
-static int stbi__decode_jpeg_image(stbi__jpeg *j)
+// MCUs the region of interest needs, all of them without one. upsampling
+// reads up to 2*max_factor pixels around each output pixel
+static int stbi__jpeg_setup_roi(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   int mx = 2 * z->img_h_max, my = 2 * z->img_v_max;
+   z->roi_mcu_x0 = z->roi_mcu_y0 = 0;
+   z->roi_mcu_x1 = z->img_mcu_x;
+   z->roi_mcu_y1 = z->img_mcu_y;
+   z->roi_done = 0;
+   if (!s->roi_w) return 1;
+   if (!stbi__roi_fits(s, s->img_x, s->img_y)) return stbi__err("bad region", "Region outside the image");
+   z->roi_mcu_x0 = (s->roi_x > mx ? s->roi_x - mx : 0) / z->img_mcu_w;
+   z->roi_mcu_y0 = (s->roi_y > my ? s->roi_y - my : 0) / z->img_mcu_h;
+   z->roi_mcu_x1 = (s->roi_x + s->roi_w - 1 + mx) / z->img_mcu_w + 1;
+   z->roi_mcu_y1 = (s->roi_y + s->roi_h - 1 + my) / z->img_mcu_h + 1;
+   if (z->roi_mcu_x1 > z->img_mcu_x) z->roi_mcu_x1 = z->img_mcu_x;
+   if (z->roi_mcu_y1 > z->img_mcu_y) z->roi_mcu_y1 = z->img_mcu_y;
+   return 1;
+}
+
+// everything up to the frame header, component buffers allocated
+static int stbi__decode_jpeg_start(stbi__jpeg *j)
 {
    int m;
    for (m = 0; m < 4; m++) {
@@ -3415,12 +4197,20 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       j->img_comp[m].raw_coeff = NULL;
    }
    j->restart_interval = 0;
-   if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+   return stbi__decode_jpeg_header(j, STBI__SCAN_load);
+}
+
+// the scans after stbi__decode_jpeg_start
+static int stbi__decode_jpeg_scans(stbi__jpeg *j)
+{
+   int m;
+   if (!stbi__jpeg_setup_roi(j)) return 0;
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (j->roi_done) return 1;
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3439,11 +4229,17 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          m = stbi__get_marker(j);
       }
    }
-   if (j->progressive)
+   if (j->progressive && !j->coeffs_only && !j->s->dc_only)
       stbi__jpeg_finish(j);
    return 1;
 }
 
+// decode image to YCbCr format
+static int stbi__decode_jpeg_image(stbi__jpeg *j)
+{
+   return stbi__decode_jpeg_start(j) && stbi__decode_jpeg_scans(j);
+}
+
 // static jfif-centered resampling (across block boundaries)
 
 typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
@@ -3641,6 +4437,69 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+// the sse2 loop above on 16 pixels at a time. the one pixel shifts cross the
+// two 128-bit halves, so each half is lined up with its neighbour first
+static STBI__TARGET_AVX2 stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass: 3*near + far = 4*near + (far - near)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (in_near + i)));
+      __m256i curr  = _mm256_add_epi16(_mm256_slli_epi16(nearw, 2), _mm256_sub_epi16(farw, nearw));
+
+      // current row one pixel to the right and to the left, with the
+      // neighbouring pixels from outside the group put in
+      __m256i prev = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+      __m256i next = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+      prev = _mm256_insert_epi16(prev, (short) t1, 0);
+      next = _mm256_insert_epi16(next, (short) (3*in_near[i+16] + in_far[i+16]), 15);
+
+      {
+         // horizontal pass, as in the sse2 version
+         __m256i bias = _mm256_set1_epi16(8);
+         __m256i curs = _mm256_slli_epi16(curr, 2);
+         __m256i prvd = _mm256_sub_epi16(prev, curr);
+         __m256i nxtd = _mm256_sub_epi16(next, curr);
+         __m256i curb = _mm256_add_epi16(curs, bias);
+         __m256i even = _mm256_add_epi16(prvd, curb);
+         __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+         // interleave and undo scaling; each half packs to 16 output pixels
+         __m256i de0 = _mm256_srli_epi16(_mm256_unpacklo_epi16(even, odd), 4);
+         __m256i de1 = _mm256_srli_epi16(_mm256_unpackhi_epi16(even, odd), 4);
+         _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(de0, de1));
+      }
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3815,10 +4674,86 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// the sse2 conversion above on 16 pixels at a time, for step 3 as well
+static STBI__TARGET_AVX2 void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 3 || step == 4) {
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+      // drops the alpha bytes of the 4 pixels in each half
+      __m256i rgb = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                     0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      // step 3 stores write 4 bytes past the group, which the pixels after
+      // it overwrite; keep at least 2 of those for the tail
+      int end = step == 4 ? count - 15 : count - 17;
+
+      for (; i < end; i += 16) {
+         // load, and unpack to short the same way as the sse2 version: y
+         // in the high byte over a 128 bias, cr and cb less 128 shifted left 8
+         __m128i y_bytes  = _mm_loadu_si128((const __m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadu_si128((const __m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadu_si128((const __m128i *) (pcb+i));
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_xor_si128(cr_bytes, signflip)), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_xor_si128(cb_bytes, signflip)), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte and interleave; o0 has pixels 0-3 and 8-11, o1 4-7 and 12-15
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store
+         if (step == 4) {
+            _mm256_storeu_si256((__m256i *) (out +  0), _mm256_permute2x128_si256(o0, o1, 0x20));
+            _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         } else {
+            o0 = _mm256_shuffle_epi8(o0, rgb);
+            o1 = _mm256_shuffle_epi8(o1, rgb);
+            _mm_storeu_si128((__m128i *) (out +  0), _mm256_castsi256_si128(o0));
+            _mm_storeu_si128((__m128i *) (out + 12), _mm256_castsi256_si128(o1));
+            _mm_storeu_si128((__m128i *) (out + 24), _mm256_extracti128_si256(o0, 1));
+            _mm_storeu_si128((__m128i *) (out + 36), _mm256_extracti128_si256(o1, 1));
+         }
+         out += 16*step;
+      }
+   }
+
+   stbi__YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_block2_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
@@ -3830,6 +4765,14 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block2_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3849,6 +4792,8 @@ typedef struct
    stbi_uc *line0,*line1;
    int hs,vs;   // expansion factor in each axis
    int w_lores; // horizontal pixels pre-expansion
+   int x_lores; // first pre-expansion pixel read, for a region
+   int x_skip;  // expanded pixels left of the region
    int ystep;   // how far through vertical expansion we are
    int ypos;    // which pre-expansion row we're on
 } stbi__resample;
@@ -3860,6 +4805,157 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+// step a resampler to the next output row
+static void stbi__resample_next_row(stbi__resample *r, int comp_y, int w2)
+{
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < comp_y)
+         r->line1 += w2;
+   }
+}
+
+// everything the resample and color-convert loop needs, shared by the bands
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample res_comp[4]; // state at the first row
+   stbi_uc *output, *tail;     // tail: a scratch row when output is the caller's
+   int w, h;                   // output size, the region if there is one
+   stbi_uc *bands;             // line buffers + scratch row of every band
+   int out_stride, n, decode_n, is_rgb;
+   int band_rows, band_size;
+} stbi__jpeg_rows;
+
+// resample and color-convert rows j0..j1-1. the converters store a byte past
+// each row for n==3, so given a 'scratch' row the last row (every row when
+// writing into the caller's buffer) is converted there and copied over
+static void stbi__jpeg_convert_rows(stbi__jpeg_rows *cr, stbi__resample *res_comp, stbi_uc **linebuf, stbi_uc *scratch, unsigned int j0, unsigned int j1)
+{
+   stbi__jpeg *z = cr->z;
+   int k, n = cr->n, is_rgb = cr->is_rgb;
+   unsigned int i,j, w = cr->w;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+
+   for (j=j0; j < j1; ++j) {
+      stbi_uc *row = cr->output + (size_t) cr->out_stride * j;
+      stbi_uc *out = (scratch && (cr->tail || j == j1-1)) ? scratch : row;
+      for (k=0; k < cr->decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  (y_bot ? r->line1 : r->line0) + r->x_lores,
+                                  (y_bot ? r->line0 : r->line1) + r->x_lores,
+                                  r->w_lores, r->hs) + r->x_skip;
+         stbi__resample_next_row(r, z->img_comp[k].y, z->img_comp[k].w2);
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < w; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], cr->w, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < w; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], cr->w, n);
+               for (i=0; i < w; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], cr->w, n);
+            }
+         } else
+            for (i=0; i < w; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < w; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < w; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < w; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < w; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < w; ++i) out[i] = y[i];
+            else
+               for (i=0; i < w; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+      if (scratch && (cr->tail || j == j1-1))
+         memcpy(row, scratch, n * cr->w);
+   }
+}
+
+// one band of output rows, with its resamplers moved ahead to its first row
+static void stbi__jpeg_convert_band(void *ctx, int b)
+{
+   stbi__jpeg_rows *cr = (stbi__jpeg_rows *) ctx;
+   stbi__jpeg *z = cr->z;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4], *scratch;
+   unsigned int j, j0 = b * cr->band_rows, j1 = j0 + cr->band_rows;
+   int k;
+
+   if (j1 >= (unsigned int) cr->h)
+      j1 = cr->h;
+   // the byte stored past our last row would race with the next band, and
+   // the scratch row can't be shared with the other bands
+   scratch = cr->n == 3 ? cr->bands + (size_t) cr->band_size * b + cr->decode_n * (z->s->img_x+3) : NULL;
+   for (k=0; k < cr->decode_n; ++k) {
+      res_comp[k] = cr->res_comp[k];
+      for (j=0; j < j0; ++j)
+         stbi__resample_next_row(&res_comp[k], z->img_comp[k].y, z->img_comp[k].w2);
+      linebuf[k] = cr->bands + (size_t) cr->band_size * b + k * (z->s->img_x+3);
+   }
+   stbi__jpeg_convert_rows(cr, res_comp, linebuf, scratch, j0, j1);
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3871,6 +4967,17 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // a preview has a pixel per block, so it upsamples and converts as an
+   // image of 1/8 the size
+   if (z->s->dc_only) {
+      z->s->img_x = (z->s->img_x + 7) >> 3;
+      z->s->img_y = (z->s->img_y + 7) >> 3;
+      for (n=0; n < z->s->img_n; ++n) {
+         z->img_comp[n].x = (z->img_comp[n].x + 7) >> 3;
+         z->img_comp[n].y = (z->img_comp[n].y + 7) >> 3;
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -3887,20 +4994,24 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // resample and color-convert
    {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+      int k, nbands = 0;
+      unsigned int j;
+      stbi_uc *output, *tail = NULL;
+      stbi_uc *linebuf[4];
+      stbi__jpeg_rows cr;
+      int x0 = z->s->roi_w ? z->s->roi_x : 0, y0 = z->s->roi_w ? z->s->roi_y : 0;
 
-      stbi__resample res_comp[4];
+      cr.w = z->s->roi_w ? z->s->roi_w : (int) z->s->img_x;
+      cr.h = z->s->roi_w ? z->s->roi_h : (int) z->s->img_y;
 
       for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
+         stbi__resample *r = &cr.res_comp[k];
 
          // allocate line buffer big enough for upsampling off the edges
          // with upsample factor of 4
          z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
          if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+         linebuf[k] = z->img_comp[k].linebuf;
 
          r->hs      = z->img_h_max / z->img_comp[k].h;
          r->vs      = z->img_v_max / z->img_comp[k].v;
@@ -3914,110 +5025,64 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
          else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
          else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
          else                               r->resample = stbi__resample_row_generic;
+
+         // for a region, only upsample its columns plus a neighbour on each
+         // side (the row ends are treated differently) and start at its top
+         r->x_lores = x0 / r->hs > 0 ? x0 / r->hs - 1 : 0;
+         r->x_skip  = x0 - r->x_lores * r->hs;
+         if ((x0 + cr.w - 1) / r->hs + 2 < r->w_lores)
+            r->w_lores = (x0 + cr.w - 1) / r->hs + 2;
+         r->w_lores -= r->x_lores;
+         for (j=0; j < (unsigned int) y0; ++j)
+            stbi__resample_next_row(r, z->img_comp[k].y, z->img_comp[k].w2);
       }
 
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
+      // write straight into the caller's buffer when there is one. the color
+      // converters store a 4th byte even for n==3, which would land on the
+      // caller's padding or neighbouring pixels, so then rows go through a
+      // scratch row
+      if (z->s->out_buffer && req_comp) {
+         if (!stbi__out_buffer_fits(z->s, cr.w, cr.h, n)) { stbi__cleanup_jpeg(z); return stbi__errpuc("buffer too small", "Output buffer too small"); }
+         output = z->s->out_buffer;
+         cr.out_stride = z->s->out_stride;
+         if (n == 3) {
+            tail = (stbi_uc *) stbi__malloc_mad2(n, cr.w, 1);
+            if (!tail) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
          }
+      } else {
+         // can't error after this so, this is safe
+         output = (stbi_uc *) stbi__malloc_mad3(n, cr.w, cr.h, 1);
+         if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+         cr.out_stride = n * cr.w;
+      }
+
+      cr.z = z;
+      cr.output = output;
+      cr.tail = tail;
+      cr.n = n;
+      cr.decode_n = decode_n;
+      cr.is_rgb = is_rgb;
+
+      // large images are converted in bands of rows through the parallel_for
+      // hook, each band with its own line buffers. without them, serially
+      if (z->s->parallel_for && (stbi__uint64) cr.w * cr.h >= STBI__JPEG_PARALLEL_MIN) {
+         cr.band_rows = (cr.h + STBI__JPEG_PARALLEL_TASKS-1) / STBI__JPEG_PARALLEL_TASKS;
+         if (cr.band_rows < 16) cr.band_rows = 16;
+         nbands = (cr.h + cr.band_rows-1) / cr.band_rows;
+         cr.band_size = decode_n * (z->s->img_x+3) + n * cr.w + 1;
+         cr.bands = (stbi_uc *) stbi__malloc_mad2(nbands, cr.band_size, 0);
+         if (!cr.bands) nbands = 0;
+      }
+      if (nbands > 1) {
+         z->s->parallel_for(z->s->parallel_user, nbands, stbi__jpeg_convert_band, &cr);
+      } else {
+         stbi__jpeg_convert_rows(&cr, cr.res_comp, linebuf, tail, 0, cr.h);
       }
+      if (nbands) STBI_FREE(cr.bands);
+      if (tail) STBI_FREE(tail);
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
+      *out_x = cr.w;
+      *out_y = cr.h;
       if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
       return output;
    }
@@ -4029,14 +5094,164 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
+   ri->dc_scaled = s->dc_only;
+   ri->roi_cropped = s->roi_w != 0;
    STBI_FREE(j);
    return result;
 }
 
+// decode a YCbCr jpg without upsampling or color conversion, into planes of
+// the size the components are stored at. chroma is subsampled by *hs x *vs
+// (1 or 2 each). returns -1 without decoding the scans for what planes can't
+// hold as is: grey, rgb, cmyk or other samplings
+static int stbi__jpeg_load_planes(stbi__context *s, stbi_uc *planes[3], int *x, int *y, int *hs, int *vs)
+{
+   int k, r, ok = 1;
+   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) return stbi__err("outofmem", "Out of memory");
+   memset(j, 0, sizeof(stbi__jpeg));
+   j->s = s;
+   stbi__setup_jpeg(j);
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   if (!stbi__decode_jpeg_start(j)) { stbi__cleanup_jpeg(j); STBI_FREE(j); return 0; }
+   if (s->img_n != 3 || j->rgb == 3 || (j->app14_color_transform == 0 && !j->jfif) ||
+       j->img_comp[0].h != j->img_h_max || j->img_comp[0].v != j->img_v_max ||
+       j->img_comp[1].h != j->img_comp[2].h || j->img_comp[1].v != j->img_comp[2].v ||
+       j->img_h_max % j->img_comp[1].h || j->img_h_max / j->img_comp[1].h > 2 ||
+       j->img_v_max % j->img_comp[1].v || j->img_v_max / j->img_comp[1].v > 2) {
+      stbi__cleanup_jpeg(j);
+      STBI_FREE(j);
+      return -1;
+   }
+
+   if (!stbi__decode_jpeg_scans(j)) { stbi__cleanup_jpeg(j); STBI_FREE(j); return 0; }
+   for (k=0; k < 3; ++k) {
+      int w = j->img_comp[k].x, h = j->img_comp[k].y;
+      planes[k] = ok ? (stbi_uc *) stbi__malloc_mad2(w, h, 0) : NULL;
+      if (!planes[k]) { ok = 0; continue; }
+      for (r=0; r < h; ++r)
+         memcpy(planes[k] + (size_t) r * w, j->img_comp[k].data + (size_t) r * j->img_comp[k].w2, w);
+   }
+   if (!ok) {
+      for (k=0; k < 3; ++k) STBI_FREE(planes[k]);
+      stbi__err("outofmem", "Out of memory");
+   }
+   *x = s->img_x;
+   *y = s->img_y;
+   *hs = j->img_h_max / j->img_comp[1].h;
+   *vs = j->img_v_max / j->img_comp[1].v;
+   stbi__cleanup_jpeg(j);
+   STBI_FREE(j);
+   return ok;
+}
+
+// decode the quantized coefficients of every block (img_comp[].coeff, whole
+// MCUs of them) and stop there, for lossless transforms. free the result
+// with stbi__jpeg_free_coeffs
+static stbi__jpeg *stbi__jpeg_load_coeffs(stbi__context *s)
+{
+   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) { stbi__err("outofmem", "Out of memory"); return NULL; }
+   memset(j, 0, sizeof(stbi__jpeg));
+   j->s = s;
+   stbi__setup_jpeg(j);
+   j->coeffs_only = 1;
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (!stbi__decode_jpeg_image(j)) {
+      stbi__cleanup_jpeg(j);
+      STBI_FREE(j);
+      return NULL;
+   }
+   return j;
+}
+
+static void stbi__jpeg_free_coeffs(stbi__jpeg *j)
+{
+   stbi__cleanup_jpeg(j);
+   STBI_FREE(j);
+}
+
+// a 16 or 32 bit tiff value at offset o of t[0..n), 0 past the end
+static stbi__uint32 stbi__tiff_get(const stbi_uc *t, stbi__uint32 n, stbi__uint32 o, int bytes, int big)
+{
+   stbi__uint32 v = 0;
+   int i;
+   if (o > n || n - o < (stbi__uint32) bytes) return 0;
+   for (i=0; i < bytes; ++i)
+      v |= (stbi__uint32) t[o + (big ? i : bytes-1 - i)] << (8 * (bytes-1 - i));
+   return v;
+}
+
+// offset and length of the jpeg in IFD1 of an Exif tiff, 0 without one
+static stbi__uint32 stbi__exif_thumbnail(const stbi_uc *t, stbi__uint32 n, stbi__uint32 *len)
+{
+   stbi__uint32 ifd, off = 0, i, count;
+   int big;
+   if (n < 8 || !((t[0] == 'I' && t[1] == 'I') || (t[0] == 'M' && t[1] == 'M'))) return 0;
+   big = t[0] == 'M';
+   if (stbi__tiff_get(t, n, 2, 2, big) != 42) return 0;
+   // IFD0 describes the image, the IFD after it the thumbnail
+   ifd = stbi__tiff_get(t, n, 4, 4, big);
+   count = stbi__tiff_get(t, n, ifd, 2, big);
+   if (ifd >= n || count > (n - ifd) / 12) return 0;
+   ifd = stbi__tiff_get(t, n, ifd + 2 + 12 * count, 4, big);
+   count = stbi__tiff_get(t, n, ifd, 2, big);
+   if (ifd == 0 || ifd >= n || count > (n - ifd) / 12) return 0;
+   *len = 0;
+   for (i=0; i < count; ++i) {
+      stbi__uint32 e = ifd + 2 + 12 * i;
+      int tag = stbi__tiff_get(t, n, e, 2, big);
+      stbi__uint32 v = stbi__tiff_get(t, n, e + 8, 4, big);
+      if (tag == 0x0201) off = v; // JPEGInterchangeFormat
+      if (tag == 0x0202) *len = v; // JPEGInterchangeFormatLength
+   }
+   if (off == 0 || *len < 4 || off > n || *len > n - off) return 0;
+   return off;
+}
+
+// the jpeg thumbnail of an Exif APP1 (IFD1) or JFXX APP0 segment, looked for
+// up to the frame header. returns it at the start of a new buffer, or NULL
+// (without an error) if there is none
+static stbi_uc *stbi__jpeg_thumbnail(stbi__context *s, int *len)
+{
+   if (stbi__get8(s) != 0xff || stbi__get8(s) != 0xd8) return NULL;
+   for (;;) {
+      stbi_uc *seg;
+      stbi__uint32 off = 0, n = 0;
+      int m, L;
+      if (stbi__get8(s) != 0xff) return NULL;
+      do m = stbi__get8(s); while (m == 0xff && !stbi__at_eof(s));
+      if (!((m >= 0xe0 && m <= 0xef) || m == 0xfe || m == 0xdb || m == 0xc4 || m == 0xdd))
+         return NULL; // frame header, scan or something unexpected
+      L = stbi__get16be(s) - 2;
+      if (L < 0 || stbi__at_eof(s)) return NULL;
+      if ((m != 0xe1 && m != 0xe0) || L < 10) {
+         stbi__skip(s, L);
+         continue;
+      }
+      seg = (stbi_uc *) stbi__malloc(L);
+      if (!seg) return NULL;
+      if (!stbi__getn(s, seg, L)) { STBI_FREE(seg); return NULL; }
+      if (m == 0xe1 && memcmp(seg, "Exif\0\0", 6) == 0) {
+         off = stbi__exif_thumbnail(seg + 6, L - 6, &n);
+         if (off) off += 6;
+      } else if (m == 0xe0 && memcmp(seg, "JFXX\0\x10", 6) == 0) {
+         off = 6; // extension code 0x10: thumbnail coded as jpeg
+         n = L - 6;
+      }
+      if (off && seg[off] == 0xff && seg[off+1] == 0xd8) {
+         memmove(seg, seg + off, n);
+         *len = (int) n;
+         return seg;
+      }
+      STBI_FREE(seg);
+   }
+}
+
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
@@ -4086,7 +5301,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, and most in dynamic ones
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
@@ -4176,7 +5391,8 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   int num_fake_bits; // zero bits added past the end of the input
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
@@ -4196,23 +5412,37 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return stbi__zeof(z) ? 0 : *z->zbuffer++;
 }
 
+// tops the buffer up to at least 56 bits, with a single 8 byte load away
+// from the end of the input
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      stbi__uint64 v = 0;
+      int i;
+      for (i=0; i < 8; ++i) // the compiler turns this into one load
+         v |= (stbi__uint64) z->zbuffer[i] << (8*i);
+      z->code_buffer |= v << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+      z->code_buffer &= ~(stbi__uint64) 0 >> (64 - z->num_bits); // drop the partial byte
+      return;
+   }
    do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
+      if (z->code_buffer >= ((stbi__uint64) 1 << z->num_bits)) {
         z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
         return;
       }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      if (stbi__zeof(z)) z->num_fake_bits += 8;
+      z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) z->code_buffer & ((1 << n) - 1);
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -4223,7 +5453,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) a->code_buffer & 0xffff, 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4326,8 +5556,18 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          }
          p = (stbi_uc *) (zout - dist);
          if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+            memset(zout, *p, len);
+            zout += len;
+         } else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+            // 8 bytes at a time; the last copy can spill up to 7 bytes past
+            // the match, which is inside the buffer and gets overwritten
+            char *end = zout + len;
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+            zout = end;
          } else {
             if (len) { do *zout++ = *p++; while (--len); }
          }
@@ -4393,12 +5633,19 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
       stbi__zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
    if (a->num_bits < 0) return stbi__err("zlib corrupt","Corrupt PNG");
+   // give whole bytes still in the bit buffer back to the input, except the
+   // made-up ones from past its end; reading any of those means it was cut short
+   if (a->num_fake_bits > a->num_bits) return stbi__err("zlib corrupt","Corrupt PNG");
+   a->zbuffer -= (a->num_bits - a->num_fake_bits) >> 3;
+   a->code_buffer = 0;
+   a->num_bits = 0;
+   a->num_fake_bits = 0;
    // now fill header the normal way
    while (k < 4)
       header[k++] = stbi__zget8(a);
@@ -4463,6 +5710,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->num_fake_bits = 0;
    a->code_buffer = 0;
    do {
       final = stbi__zreceive(a,1);
@@ -4646,6 +5894,147 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// Sub, Avg and Paeth on 3 and 4 byte pixels, one whole pixel per step like
+// libpng's intel/arm filter code: each pixel depends on the one to its left,
+// but its bytes are done together. 'cur', 'raw' and 'prior' point at the
+// second pixel of the row, 'n' bytes are left. 0 if the case isn't handled.
+// Pixels move as 4 bytes whenever that stays inside the row; a 3 byte pixel
+// writes a junk byte over the next one, which fixes it on the next step
+static stbi_inline stbi__uint32 stbi__png_load_px(const stbi_uc *p, int wide)
+{
+   stbi__uint32 v = 0;
+   if (wide) memcpy(&v, p, 4);
+   else      memcpy(&v, p, 3);
+   return v;
+}
+
+static stbi_inline void stbi__png_store_px(stbi_uc *p, stbi__uint32 v, int wide)
+{
+   if (wide) memcpy(p, &v, 4);
+   else      memcpy(p, &v, 3);
+}
+
+#ifdef STBI_SSE2
+static stbi_inline __m128i stbi__png_px_sse2(const stbi_uc *p, int wide)
+{
+   return _mm_cvtsi32_si128((int) stbi__png_load_px(p, wide));
+}
+
+static int stbi__png_unfilter_simd(int filter, int bpp, stbi_uc *cur, stbi_uc *raw, stbi_uc *prior, int n)
+{
+   __m128i zero = _mm_setzero_si128(), a, b, c, d;
+   int i;
+
+   if ((bpp != 3 && bpp != 4) || !stbi__sse2_available())
+      return 0;
+
+   a = stbi__png_px_sse2(cur - bpp, n >= 4 - bpp);
+   switch (filter) {
+      case STBI__F_sub:
+         for (i=0; i < n; i += bpp) {
+            int wide = i + 4 <= n;
+            a = _mm_add_epi8(stbi__png_px_sse2(raw+i, wide), a);
+            stbi__png_store_px(cur+i, (stbi__uint32) _mm_cvtsi128_si32(a), wide);
+         }
+         return 1;
+      case STBI__F_avg:
+         for (i=0; i < n; i += bpp) {
+            int wide = i + 4 <= n;
+            // (a+b)>>1 is the rounded-up average minus the bit it rounded up
+            b = stbi__png_px_sse2(prior+i, wide);
+            d = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+            a = _mm_add_epi8(stbi__png_px_sse2(raw+i, wide), d);
+            stbi__png_store_px(cur+i, (stbi__uint32) _mm_cvtsi128_si32(a), wide);
+         }
+         return 1;
+      case STBI__F_paeth:
+         // in 16 bits: pa = |b-c|, pb = |a-c|, pc = |a+b-2c|, take whichever
+         // of a, b, c has the smallest, in that order on ties
+         c = _mm_unpacklo_epi8(stbi__png_px_sse2(prior - bpp, n >= 4 - bpp), zero);
+         a = _mm_unpacklo_epi8(a, zero);
+         for (i=0; i < n; i += bpp) {
+            int wide = i + 4 <= n;
+            __m128i pa, pb, pc, smallest, pred;
+            b = _mm_unpacklo_epi8(stbi__png_px_sse2(prior+i, wide), zero);
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            d = _mm_cmpeq_epi16(pb, smallest);
+            pred = _mm_or_si128(_mm_and_si128(d, b), _mm_andnot_si128(d, c));
+            d = _mm_cmpeq_epi16(pa, smallest);
+            pred = _mm_or_si128(_mm_and_si128(d, a), _mm_andnot_si128(d, pred));
+            d = _mm_add_epi8(stbi__png_px_sse2(raw+i, wide), _mm_packus_epi16(pred, pred));
+            stbi__png_store_px(cur+i, (stbi__uint32) _mm_cvtsi128_si32(d), wide);
+            a = _mm_unpacklo_epi8(d, zero);
+            c = b;
+         }
+         return 1;
+   }
+   return 0;
+}
+#else // STBI_NEON
+static stbi_inline uint8x8_t stbi__png_px_neon(const stbi_uc *p, int wide)
+{
+   return vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(p, wide)));
+}
+
+static stbi_inline stbi__uint32 stbi__png_px_value_neon(uint8x8_t v)
+{
+   return vget_lane_u32(vreinterpret_u32_u8(v), 0);
+}
+
+static int stbi__png_unfilter_simd(int filter, int bpp, stbi_uc *cur, stbi_uc *raw, stbi_uc *prior, int n)
+{
+   uint8x8_t a, b, c;
+   int i;
+
+   if (bpp != 3 && bpp != 4)
+      return 0;
+
+   a = stbi__png_px_neon(cur - bpp, n >= 4 - bpp);
+   switch (filter) {
+      case STBI__F_sub:
+         for (i=0; i < n; i += bpp) {
+            int wide = i + 4 <= n;
+            a = vadd_u8(stbi__png_px_neon(raw+i, wide), a);
+            stbi__png_store_px(cur+i, stbi__png_px_value_neon(a), wide);
+         }
+         return 1;
+      case STBI__F_avg:
+         for (i=0; i < n; i += bpp) {
+            int wide = i + 4 <= n;
+            b = stbi__png_px_neon(prior+i, wide);
+            a = vadd_u8(stbi__png_px_neon(raw+i, wide), vhadd_u8(a, b));
+            stbi__png_store_px(cur+i, stbi__png_px_value_neon(a), wide);
+         }
+         return 1;
+      case STBI__F_paeth:
+         c = stbi__png_px_neon(prior - bpp, n >= 4 - bpp);
+         for (i=0; i < n; i += bpp) {
+            int wide = i + 4 <= n;
+            uint16x8_t pa, pb, pc, a_le;
+            b = stbi__png_px_neon(prior+i, wide);
+            pa = vabdl_u8(b, c);
+            pb = vabdl_u8(a, c);
+            pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+            a_le = vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc));
+            c = vbsl_u8(vmovn_u16(vcleq_u16(pb, pc)), b, c);
+            a = vadd_u8(stbi__png_px_neon(raw+i, wide), vbsl_u8(vmovn_u16(a_le), a, c));
+            stbi__png_store_px(cur+i, stbi__png_px_value_neon(a), wide);
+            c = b;
+         }
+         return 1;
+   }
+   return 0;
+}
+#endif
+#endif // STBI_SSE2 || STBI_NEON
+
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
@@ -4731,6 +6120,11 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          #define STBI__CASE(f) \
              case f:     \
                 for (k=0; k < nk; ++k)
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+         if (depth == 8 && stbi__png_unfilter_simd(filter, filter_bytes, cur, raw, prior, nk)) {
+            // done a pixel at a time
+         } else
+#endif
          switch (filter) {
             // "none" filter turns into a memcpy here; make that explicit.
             case STBI__F_none:         memcpy(cur, raw, nk); break;
@@ -7477,12 +8871,120 @@ static int stbi__pic_info(stbi__context *s, int *x, int *y, int *comp)
 }
 #endif
 
+// *************************************************************************************************
+// Quite OK Image loader
+//
+// https://qoiformat.org/qoi-specification.pdf
+
+#ifndef STBI_NO_QOI
+
+static int stbi__qoi_test(stbi__context *s)
+{
+   int r = stbi__get8(s) == 'q' && stbi__get8(s) == 'o' && stbi__get8(s) == 'i' && stbi__get8(s) == 'f';
+   stbi__rewind(s);
+   return r;
+}
+
+static int stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp)
+{
+   stbi__uint32 w, h;
+   int n;
+   if (!stbi__qoi_test(s)) return 0;
+   stbi__skip(s, 4);
+   w = stbi__get32be(s);
+   h = stbi__get32be(s);
+   n = stbi__get8(s);
+   stbi__get8(s); // colorspace, only informative
+   if (w == 0 || h == 0 || (n != 3 && n != 4)) { stbi__rewind(s); return 0; }
+   if (x) *x = (int) w;
+   if (y) *y = (int) h;
+   if (comp) *comp = n;
+   return 1;
+}
+
+#define STBI__QOI_HASH(p)  (((p)[0]*3 + (p)[1]*5 + (p)[2]*7 + (p)[3]*11) & 63)
+
+static void *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   stbi_uc index[64][4], px[4] = { 0, 0, 0, 255 };
+   stbi_uc *out, *o;
+   size_t i, count;
+   int n, run = 0;
+   STBI_NOTUSED(ri);
+
+   if (!stbi__qoi_info(s, (int *) &s->img_x, (int *) &s->img_y, &s->img_n))
+      return stbi__errpuc("bad QOI", "Corrupt QOI header");
+   if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+
+   // decode straight into 3 or 4 channels, convert 1 and 2 afterwards
+   n = (req_comp == 3 || req_comp == 4) ? req_comp : s->img_n;
+   if (!stbi__mad3sizes_valid(n, s->img_x, s->img_y, 0)) return stbi__errpuc("too large", "QOI too large");
+   out = (stbi_uc *) stbi__malloc_mad3(n, s->img_x, s->img_y, 0);
+   if (!out) return stbi__errpuc("outofmem", "Out of memory");
+
+   memset(index, 0, sizeof(index));
+   count = (size_t) s->img_x * s->img_y;
+   for (i=0, o=out; i < count; ++i, o += n) {
+      if (run > 0) {
+         --run;
+      } else {
+         int b = stbi__get8(s);
+         if (b == 0xfe) { // QOI_OP_RGB
+            px[0] = stbi__get8(s);
+            px[1] = stbi__get8(s);
+            px[2] = stbi__get8(s);
+         } else if (b == 0xff) { // QOI_OP_RGBA
+            px[0] = stbi__get8(s);
+            px[1] = stbi__get8(s);
+            px[2] = stbi__get8(s);
+            px[3] = stbi__get8(s);
+         } else switch (b >> 6) {
+            case 0: // QOI_OP_INDEX
+               memcpy(px, index[b], 4);
+               break;
+            case 1: // QOI_OP_DIFF
+               px[0] += ((b >> 4) & 3) - 2;
+               px[1] += ((b >> 2) & 3) - 2;
+               px[2] += ( b       & 3) - 2;
+               break;
+            case 2: { // QOI_OP_LUMA
+               int dg = (b & 63) - 32, d = stbi__get8(s);
+               px[0] += dg - 8 + ((d >> 4) & 15);
+               px[1] += dg;
+               px[2] += dg - 8 + (d & 15);
+               break;
+            }
+            default: // QOI_OP_RUN, this pixel and up to 61 more
+               run = b & 63;
+               break;
+         }
+         memcpy(index[STBI__QOI_HASH(px)], px, 4);
+      }
+      o[0] = px[0];
+      o[1] = px[1];
+      o[2] = px[2];
+      if (n == 4) o[3] = px[3];
+   }
+
+   *x = s->img_x;
+   *y = s->img_y;
+   if (comp) *comp = s->img_n;
+   if (req_comp && req_comp != n) {
+      out = stbi__convert_format(out, n, req_comp, s->img_x, s->img_y);
+      if (out == NULL) return out; // stbi__convert_format frees input on failure
+   }
+   return out;
+}
+#endif
+
 // *************************************************************************************************
 // Portable Gray Map and Portable Pixel Map loader
 // by Ken Miller
 //
 // PGM: http://netpbm.sourceforge.net/doc/pgm.html
 // PPM: http://netpbm.sourceforge.net/doc/ppm.html
+// PAM: http://netpbm.sourceforge.net/doc/pam.html (depth 1 to 4)
 //
 // Known limitations:
 //    Does not support comments in the header section
@@ -7495,7 +8997,7 @@ static int      stbi__pnm_test(stbi__context *s)
    char p, t;
    p = (char) stbi__get8(s);
    t = (char) stbi__get8(s);
-   if (p != 'P' || (t != '5' && t != '6')) {
+   if (p != 'P' || (t != '5' && t != '6' && t != '7')) {
        stbi__rewind( s );
        return 0;
    }
@@ -7521,6 +9023,24 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!stbi__mad4sizes_valid(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0))
       return stbi__errpuc("too large", "PNM too large");
 
+   // the file holds the rows as the caller wants them, read them straight
+   // into the caller's buffer
+   if (s->out_buffer && ri->bits_per_channel == 8 && (req_comp == 0 || req_comp == s->img_n) &&
+       !s->roi_w && !s->dc_only) {
+      int j, row_bytes = s->img_n * s->img_x;
+      if (!stbi__out_buffer_fits(s, s->img_x, s->img_y, s->img_n))
+         return stbi__errpuc("buffer too small", "Output buffer too small");
+      if (s->out_stride == row_bytes) {
+         if (!stbi__getn(s, s->out_buffer, row_bytes * s->img_y))
+            return stbi__errpuc("bad PNM", "PNM file truncated");
+      } else {
+         for (j=0; j < (int) s->img_y; ++j)
+            if (!stbi__getn(s, s->out_buffer + (size_t) j * s->out_stride, row_bytes))
+               return stbi__errpuc("bad PNM", "PNM file truncated");
+      }
+      return s->out_buffer;
+   }
+
    out = (stbi_uc *) stbi__malloc_mad4(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (!stbi__getn(s, out, s->img_n * s->img_x * s->img_y * (ri->bits_per_channel / 8))) {
@@ -7577,6 +9097,42 @@ static int      stbi__pnm_getinteger(stbi__context *s, char *c)
    return value;
 }
 
+// PAM header: "KEYWORD value" lines up to ENDHDR, the tuple type is ignored
+// since the depth alone tells the channels apart
+static int      stbi__pam_info(stbi__context *s, int *x, int *y, int *comp)
+{
+   char key[16], c;
+   int n, value, maxv = 0;
+
+   *x = *y = *comp = 0;
+   c = (char) stbi__get8(s);
+   for (;;) {
+      stbi__pnm_skip_whitespace(s, &c);
+      for (n = 0; !stbi__at_eof(s) && c >= 'A' && c <= 'Z'; c = (char) stbi__get8(s))
+         if (n < (int) sizeof(key) - 1) key[n++] = c;
+      key[n] = 0;
+      if (strcmp(key, "ENDHDR") == 0)
+         break; // the newline after it was just read, the pixels follow
+      if (n == 0 || stbi__at_eof(s))
+         return stbi__err("bad PAM", "Corrupt PAM header");
+      if (strcmp(key, "TUPLTYPE") == 0) {
+         while (!stbi__at_eof(s) && c != '\n')
+            c = (char) stbi__get8(s);
+         continue;
+      }
+      stbi__pnm_skip_whitespace(s, &c);
+      value = stbi__pnm_getinteger(s, &c);
+      if      (strcmp(key, "WIDTH") == 0)  *x = value;
+      else if (strcmp(key, "HEIGHT") == 0) *y = value;
+      else if (strcmp(key, "DEPTH") == 0)  *comp = value;
+      else if (strcmp(key, "MAXVAL") == 0) maxv = value;
+      else return stbi__err("bad PAM", "Unknown PAM header field");
+   }
+   if (*x == 0 || *y == 0 || *comp < 1 || *comp > 4 || maxv < 1 || maxv > 65535)
+      return stbi__err("bad PAM", "Unsupported PAM header");
+   return maxv > 255 ? 16 : 8;
+}
+
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
 {
    int maxv, dummy;
@@ -7591,10 +9147,12 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
    // Get identifier
    p = (char) stbi__get8(s);
    t = (char) stbi__get8(s);
-   if (p != 'P' || (t != '5' && t != '6')) {
+   if (p != 'P' || (t != '5' && t != '6' && t != '7')) {
        stbi__rewind(s);
        return 0;
    }
+   if (t == '7')
+      return stbi__pam_info(s, x, y, comp);
 
    *comp = (t == '6') ? 3 : 1;  // '5' is 1-component .pgm; '6' is 3-component .ppm
 
@@ -7658,6 +9216,10 @@ static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
    if (stbi__pnm_info(s, x, y, comp))  return 1;
    #endif
 
+   #ifndef STBI_NO_QOI
+   if (stbi__qoi_info(s, x, y, comp))  return 1;
+   #endif
+
    #ifndef STBI_NO_HDR
    if (stbi__hdr_info(s, x, y, comp))  return 1;
    #endif
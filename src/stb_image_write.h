@@ -26,6 +26,13 @@ BUILDING:
    You can #define STBIW_MALLOC(), STBIW_REALLOC(), and STBIW_FREE() to replace
    malloc,realloc,free.
    You can #define STBIW_MEMMOVE() to replace memmove()
+   You can #define STBIW_WRITE_BUFFER_SIZE to the number of bytes the writers
+   batch up before calling the write function (defaults to 64). Larger values
+   (e.g. 1<<20) turn BMP/TGA/JPEG/HDR output into a few large writes; the
+   buffer is heap allocated with STBIW_MALLOC() for the duration of the call.
+   The JPEG writer uses SSE2, and AVX2 when the CPU has it, on x64. The
+   output is identical to the plain C code; #define STBIW_NO_SIMD (or
+   STBIW_NO_AVX2) to compile the SIMD paths out.
    You can #define STBIW_ZLIB_COMPRESS to use a custom zlib-style compress function
    for PNG compression (instead of the builtin one), it must have the following signature:
    unsigned char * my_compress(unsigned char *data, int data_len, int *out_len, int quality);
@@ -49,10 +56,12 @@ USAGE:
      int stbi_write_tga(char const *filename, int w, int h, int comp, const void *data);
      int stbi_write_jpg(char const *filename, int w, int h, int comp, const void *data, int quality);
      int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
+     int stbi_write_qoi(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
+     int stbi_write_pnm(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes);
 
      void stbi_flip_vertically_on_write(int flag); // flag is non-zero to flip data vertically
 
-   There are also five equivalent functions that use an arbitrary write function. You are
+   There are also six equivalent functions that use an arbitrary write function. You are
    expected to open/close your file-equivalent before and after calling these:
 
      int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
@@ -60,6 +69,8 @@ USAGE:
      int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
      int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
      int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality);
+     int stbi_write_qoi_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
+     int stbi_write_pnm_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
 
    where the callback is:
       void stbi_write_func(void *context, void *data, int size);
@@ -68,8 +79,13 @@ USAGE:
       int stbi_write_tga_with_rle;             // defaults to true; set to 0 to disable RLE
       int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
+      int stbi_write_png_fast_filter;          // defaults to 0; set to 1 to only try None and Paeth per row
+      int stbi_write_jpg_optimize_huffman;     // defaults to 0; set to 1 for per-image JPEG Huffman tables
 
 
+   You can #define STBIW_THREAD_LOCAL (e.g. to _Thread_local) to give each
+   thread its own copy of these variables and of the vertical flip flag.
+
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
    functions, so the library will not use stdio.h at all. However, this will
    also disable HDR writing, because it requires stdio for formatted output.
@@ -82,7 +98,7 @@ USAGE:
    per channel, in the following order: 1=Y, 2=YA, 3=RGB, 4=RGBA. (Y is
    monochrome color.) The rectangle is 'w' pixels wide and 'h' pixels tall.
    The *data pointer points to the first byte of the top-left-most pixel.
-   For PNG, "stride_in_bytes" is the distance in bytes from the first byte of
+   For PNG, QOI and PNM, "stride_in_bytes" is the distance in bytes from the first byte of
    a row of pixels to the first byte of the next row of pixels.
 
    PNG creates output files with the same number of components as the input.
@@ -97,7 +113,15 @@ USAGE:
    at the end of the line.)
 
    PNG allows you to set the deflate compression level by setting the global
-   variable 'stbi_write_png_compression_level' (it defaults to 8).
+   variable 'stbi_write_png_compression_level' (it defaults to 8). Levels 5
+   (fastest, anything lower works the same) to 11 (smallest) set how far the
+   matcher follows its hash chains, as in zlib. Unless a filter is forced, each
+   row gets the filter whose output has the smallest sum of absolute values;
+   set 'stbi_write_png_fast_filter' to 1 to only try None and Paeth. On x64
+   the filters and Adler-32 run on SSE2 (#define STBIW_NO_SIMD to turn that
+   off), and the chunk CRCs use PCLMULQDQ when the CPU has it (or the ARMv8
+   CRC32 instructions when compiled for them); the output is the same
+   either way.
 
    HDR expects linear float data. Since the format is always 32-bit rgb(e)
    data, alpha (if provided) is discarded, and for monochrome data it is
@@ -106,9 +130,18 @@ USAGE:
    TGA supports RLE or non-RLE compressed data. To use non-RLE-compressed
    data, set the global variable 'stbi_write_tga_with_rle' to 0.
 
+   QOI (https://qoiformat.org) is lossless and encodes in a single pass, a
+   lot faster than PNG for somewhat larger files. Y is expanded to RGB and YA
+   to RGBA, since the format only has those two.
+
+   PNM stores the pixels as they are: Y is written as PGM (P5), RGB as PPM
+   (P6), YA and RGBA as PAM (P7).
+
    JPEG does ignore alpha channels in input data; quality is between 1 and 100.
    Higher quality looks better but results in a bigger image.
-   JPEG baseline (no JPEG progressive).
+   JPEG baseline (no JPEG progressive). Set 'stbi_write_jpg_optimize_huffman'
+   to 1 to build Huffman tables for each image (a few % smaller files); the
+   quantized image is kept in memory between the two passes this takes.
 
 CREDITS:
 
@@ -166,10 +199,16 @@ LICENSE
 #endif
 #endif
 
+#ifndef STBIW_THREAD_LOCAL
+#define STBIW_THREAD_LOCAL
+#endif
+
 #ifndef STB_IMAGE_WRITE_STATIC  // C++ forbids static forward declarations
-STBIWDEF int stbi_write_tga_with_rle;
-STBIWDEF int stbi_write_png_compression_level;
-STBIWDEF int stbi_write_force_png_filter;
+STBIWDEF STBIW_THREAD_LOCAL int stbi_write_tga_with_rle;
+STBIWDEF STBIW_THREAD_LOCAL int stbi_write_png_compression_level;
+STBIWDEF STBIW_THREAD_LOCAL int stbi_write_force_png_filter;
+STBIWDEF STBIW_THREAD_LOCAL int stbi_write_png_fast_filter;
+STBIWDEF STBIW_THREAD_LOCAL int stbi_write_jpg_optimize_huffman;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -178,6 +217,8 @@ STBIWDEF int stbi_write_bmp(char const *filename, int w, int h, int comp, const
 STBIWDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_qoi(char const *filename, int w, int h, int comp, const void  *data, int stride_in_bytes);
+STBIWDEF int stbi_write_pnm(char const *filename, int w, int h, int comp, const void  *data, int stride_in_bytes);
 
 #ifdef STBIW_WINDOWS_UTF8
 STBIWDEF int stbiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
@@ -191,6 +232,8 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_qoi_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
+STBIWDEF int stbi_write_pnm_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
 
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
@@ -245,19 +288,85 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #define STBIW_ASSERT(x) assert(x)
 #endif
 
+#ifndef STBIW_WRITE_BUFFER_SIZE
+#define STBIW_WRITE_BUFFER_SIZE 64
+#endif
+
+// SIMD: SSE2 is always there on x64, AVX2 is picked at run time. the kernels
+// do the same float operations in the same order as the C versions, so the
+// output doesn't depend on which one ran. define STBIW_NO_SIMD to use only C.
+#if !defined(STBIW_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define STBIW_SSE2
+#include <emmintrin.h>
+
+#if defined(__GNUC__) && !defined(STBIW_NO_AVX2)
+#define STBIW_AVX2
+#include <immintrin.h>
+#define STBIW__TARGET_AVX2 __attribute__((target("avx2")))
+static int stbiw__avx2_available(void)
+{
+   return __builtin_cpu_supports("avx2");
+}
+#elif defined(_MSC_VER) && _MSC_VER >= 1900 && !defined(STBIW_NO_AVX2)
+#define STBIW_AVX2
+#include <intrin.h>
+#define STBIW__TARGET_AVX2
+static int stbiw__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info, 1);
+   // the OS has to save the ymm registers too
+   if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+      return 0;
+   __cpuidex(info, 7, 0);
+   return (info[1] >> 5) & 1;
+}
+#endif
+
+// carry-less multiply for the png crc, also picked at run time
+#if defined(__GNUC__) && !defined(STBIW_NO_PCLMUL)
+#define STBIW_PCLMUL
+#include <wmmintrin.h>
+#define STBIW__TARGET_PCLMUL __attribute__((target("pclmul")))
+static int stbiw__pclmul_available(void)
+{
+   return __builtin_cpu_supports("pclmul");
+}
+#elif defined(_MSC_VER) && !defined(STBIW_NO_PCLMUL)
+#define STBIW_PCLMUL
+#include <intrin.h>
+#define STBIW__TARGET_PCLMUL
+static int stbiw__pclmul_available(void)
+{
+   int info[4];
+   __cpuid(info, 1);
+   return (info[2] >> 1) & 1;
+}
+#endif
+#endif
+
+#if !defined(STBIW_NO_SIMD) && defined(__ARM_FEATURE_CRC32)
+#define STBIW_ARM_CRC32
+#include <arm_acle.h>
+#endif
+
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
 #ifdef STB_IMAGE_WRITE_STATIC
-static int stbi_write_png_compression_level = 8;
-static int stbi_write_tga_with_rle = 1;
-static int stbi_write_force_png_filter = -1;
+static STBIW_THREAD_LOCAL int stbi_write_png_compression_level = 8;
+static STBIW_THREAD_LOCAL int stbi_write_tga_with_rle = 1;
+static STBIW_THREAD_LOCAL int stbi_write_force_png_filter = -1;
+static STBIW_THREAD_LOCAL int stbi_write_png_fast_filter = 0;
+static STBIW_THREAD_LOCAL int stbi_write_jpg_optimize_huffman = 0;
 #else
-int stbi_write_png_compression_level = 8;
-int stbi_write_tga_with_rle = 1;
-int stbi_write_force_png_filter = -1;
+STBIW_THREAD_LOCAL int stbi_write_png_compression_level = 8;
+STBIW_THREAD_LOCAL int stbi_write_tga_with_rle = 1;
+STBIW_THREAD_LOCAL int stbi_write_force_png_filter = -1;
+STBIW_THREAD_LOCAL int stbi_write_png_fast_filter = 0;
+STBIW_THREAD_LOCAL int stbi_write_jpg_optimize_huffman = 0;
 #endif
 
-static int stbi__flip_vertically_on_write = 0;
+static STBIW_THREAD_LOCAL int stbi__flip_vertically_on_write = 0;
 
 STBIWDEF void stbi_flip_vertically_on_write(int flag)
 {
@@ -268,8 +377,10 @@ typedef struct
 {
    stbi_write_func *func;
    void *context;
-   unsigned char buffer[64];
+   unsigned char *buffer;
+   int buf_size;
    int buf_used;
+   unsigned char small_buffer[64];
 } stbi__write_context;
 
 // initialize a callback-based context
@@ -277,6 +388,49 @@ static void stbi__start_write_callbacks(stbi__write_context *s, stbi_write_func
 {
    s->func    = c;
    s->context = context;
+   s->buf_used = 0;
+   s->buffer  = NULL;
+   if (STBIW_WRITE_BUFFER_SIZE > (int) sizeof(s->small_buffer))
+      s->buffer = (unsigned char *) STBIW_MALLOC(STBIW_WRITE_BUFFER_SIZE);
+   if (s->buffer) {
+      s->buf_size = STBIW_WRITE_BUFFER_SIZE;
+   } else {
+      // fall back to the inline buffer if the big one could not be allocated
+      s->buffer   = s->small_buffer;
+      s->buf_size = sizeof(s->small_buffer);
+   }
+}
+
+static void stbiw__write_flush(stbi__write_context *s)
+{
+   if (s->buf_used) {
+      s->func(s->context, s->buffer, s->buf_used);
+      s->buf_used = 0;
+   }
+}
+
+// flush pending output and release the buffer
+static void stbi__end_write_callbacks(stbi__write_context *s)
+{
+   stbiw__write_flush(s);
+   if (s->buffer != s->small_buffer)
+      STBIW_FREE(s->buffer);
+   s->buffer = NULL;
+}
+
+// buffered write; anything larger than the buffer goes straight through
+static void stbiw__write(stbi__write_context *s, const void *data, int len)
+{
+   if (len <= 0)
+      return;
+   if (s->buf_used + len > s->buf_size)
+      stbiw__write_flush(s);
+   if (len >= s->buf_size) {
+      s->func(s->context, (void *) data, len);
+      return;
+   }
+   memcpy(s->buffer + s->buf_used, data, len);
+   s->buf_used += len;
 }
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -338,6 +492,7 @@ static int stbi__start_write_file(stbi__write_context *s, const char *filename)
 
 static void stbi__end_write_file(stbi__write_context *s)
 {
+   stbi__end_write_callbacks(s);
    fclose((FILE *)s->context);
 }
 
@@ -352,13 +507,13 @@ static void stbiw__writefv(stbi__write_context *s, const char *fmt, va_list v)
       switch (*fmt++) {
          case ' ': break;
          case '1': { unsigned char x = STBIW_UCHAR(va_arg(v, int));
-                     s->func(s->context,&x,1);
+                     stbiw__write(s,&x,1);
                      break; }
          case '2': { int x = va_arg(v,int);
                      unsigned char b[2];
                      b[0] = STBIW_UCHAR(x);
                      b[1] = STBIW_UCHAR(x>>8);
-                     s->func(s->context,b,2);
+                     stbiw__write(s,b,2);
                      break; }
          case '4': { stbiw_uint32 x = va_arg(v,int);
                      unsigned char b[4];
@@ -366,7 +521,7 @@ static void stbiw__writefv(stbi__write_context *s, const char *fmt, va_list v)
                      b[1]=STBIW_UCHAR(x>>8);
                      b[2]=STBIW_UCHAR(x>>16);
                      b[3]=STBIW_UCHAR(x>>24);
-                     s->func(s->context,b,4);
+                     stbiw__write(s,b,4);
                      break; }
          default:
             STBIW_ASSERT(0);
@@ -383,30 +538,22 @@ static void stbiw__writef(stbi__write_context *s, const char *fmt, ...)
    va_end(v);
 }
 
-static void stbiw__write_flush(stbi__write_context *s)
+static void stbiw__write1(stbi__write_context *s, unsigned char a)
 {
-   if (s->buf_used) {
-      s->func(s->context, &s->buffer, s->buf_used);
-      s->buf_used = 0;
-   }
+   if (s->buf_used + 1 > s->buf_size)
+      stbiw__write_flush(s);
+   s->buffer[s->buf_used++] = a;
 }
 
 static void stbiw__putc(stbi__write_context *s, unsigned char c)
 {
-   s->func(s->context, &c, 1);
-}
-
-static void stbiw__write1(stbi__write_context *s, unsigned char a)
-{
-   if ((size_t)s->buf_used + 1 > sizeof(s->buffer))
-      stbiw__write_flush(s);
-   s->buffer[s->buf_used++] = a;
+   stbiw__write1(s, c);
 }
 
 static void stbiw__write3(stbi__write_context *s, unsigned char a, unsigned char b, unsigned char c)
 {
    int n;
-   if ((size_t)s->buf_used + 3 > sizeof(s->buffer))
+   if (s->buf_used + 3 > s->buf_size)
       stbiw__write_flush(s);
    n = s->buf_used;
    s->buf_used = n+3;
@@ -448,10 +595,74 @@ static void stbiw__write_pixel(stbi__write_context *s, int rgb_dir, int comp, in
       stbiw__write1(s, d[comp - 1]);
 }
 
+// convert 'n' pixels into the output layout; returns bytes written to 'o'
+static int stbiw__convert_pixels(unsigned char *o, const unsigned char *d, int n, int rgb_dir, int comp, int write_alpha, int expand_mono)
+{
+   unsigned char *start = o;
+   int i, k;
+
+   // common layouts get a tight loop of their own
+   if (!write_alpha && comp == 1 && !expand_mono) {
+      memcpy(o, d, n);
+      return n;
+   }
+   if (!write_alpha && comp == 1) {
+      for (i=0; i < n; ++i, o += 3)
+         o[0] = o[1] = o[2] = d[i];
+      return n*3;
+   }
+   if (!write_alpha && comp == 3) {
+      for (i=0; i < n; ++i, o += 3, d += 3) {
+         o[0] = d[1 - rgb_dir];
+         o[1] = d[1];
+         o[2] = d[1 + rgb_dir];
+      }
+      return n*3;
+   }
+   if (write_alpha > 0 && comp == 4) {
+      for (i=0; i < n; ++i, o += 4, d += 4) {
+         o[0] = d[1 - rgb_dir];
+         o[1] = d[1];
+         o[2] = d[1 + rgb_dir];
+         o[3] = d[3];
+      }
+      return n*4;
+   }
+
+   // everything else mirrors stbiw__write_pixel
+   for (i=0; i < n; ++i, d += comp) {
+      if (write_alpha < 0)
+         *o++ = d[comp - 1];
+      switch (comp) {
+         case 2:
+         case 1:
+            *o++ = d[0];
+            if (expand_mono) { *o++ = d[0]; *o++ = d[0]; }
+            break;
+         case 4:
+            if (!write_alpha) {
+               unsigned char bg[3] = { 255, 0, 255}, px[3];
+               for (k = 0; k < 3; ++k)
+                  px[k] = bg[k] + ((d[k] - bg[k]) * d[3]) / 255;
+               *o++ = px[1 - rgb_dir]; *o++ = px[1]; *o++ = px[1 + rgb_dir];
+               break;
+            }
+            /* FALLTHROUGH */
+         case 3:
+            *o++ = d[1 - rgb_dir]; *o++ = d[1]; *o++ = d[1 + rgb_dir];
+            break;
+      }
+      if (write_alpha > 0)
+         *o++ = d[comp - 1];
+   }
+   return (int) (o - start);
+}
+
 static void stbiw__write_pixels(stbi__write_context *s, int rgb_dir, int vdir, int x, int y, int comp, void *data, int write_alpha, int scanline_pad, int expand_mono)
 {
    stbiw_uint32 zero = 0;
-   int i,j, j_end;
+   int i,j, j_end, n;
+   int out_bpp = ((comp >= 3 || expand_mono) ? 3 : 1) + (write_alpha != 0);
 
    if (y <= 0)
       return;
@@ -465,13 +676,19 @@ static void stbiw__write_pixels(stbi__write_context *s, int rgb_dir, int vdir, i
       j_end =  y; j = 0;
    }
 
+   // rows are converted straight into the output buffer in as few pieces as it allows
    for (; j != j_end; j += vdir) {
-      for (i=0; i < x; ++i) {
-         unsigned char *d = (unsigned char *) data + (j*x+i)*comp;
-         stbiw__write_pixel(s, rgb_dir, comp, write_alpha, expand_mono, d);
+      unsigned char *row = (unsigned char *) data + j*x*comp;
+      for (i=0; i < x; i += n) {
+         n = (s->buf_size - s->buf_used) / out_bpp;
+         if (n == 0) {
+            stbiw__write_flush(s);
+            n = s->buf_size / out_bpp;
+         }
+         if (n > x - i) n = x - i;
+         s->buf_used += stbiw__convert_pixels(s->buffer + s->buf_used, row + i*comp, n, rgb_dir, comp, write_alpha, expand_mono);
       }
-      stbiw__write_flush(s);
-      s->func(s->context, &zero, scanline_pad);
+      stbiw__write(s, &zero, scanline_pad);
    }
 }
 
@@ -512,8 +729,11 @@ static int stbi_write_bmp_core(stbi__write_context *s, int x, int y, int comp, c
 STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data)
 {
    stbi__write_context s = { 0 };
+   int r;
    stbi__start_write_callbacks(&s, func, context);
-   return stbi_write_bmp_core(&s, x, y, comp, data);
+   r = stbi_write_bmp_core(&s, x, y, comp, data);
+   stbi__end_write_callbacks(&s);
+   return r;
 }
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -611,8 +831,11 @@ static int stbi_write_tga_core(stbi__write_context *s, int x, int y, int comp, v
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data)
 {
    stbi__write_context s = { 0 };
+   int r;
    stbi__start_write_callbacks(&s, func, context);
-   return stbi_write_tga_core(&s, x, y, comp, (void *) data);
+   r = stbi_write_tga_core(&s, x, y, comp, (void *) data);
+   stbi__end_write_callbacks(&s);
+   return r;
 }
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -628,6 +851,175 @@ STBIWDEF int stbi_write_tga(char const *filename, int x, int y, int comp, const
 }
 #endif
 
+// *************************************************************************************************
+// QOI writer
+// https://qoiformat.org/qoi-specification.pdf
+
+#define STBIW__QOI_HASH(r,g,b,a)  (((r)*3 + (g)*5 + (b)*7 + (a)*11) & 63)
+
+static int stbi_write_qoi_core(stbi__write_context *s, int x, int y, int comp, const unsigned char *data, int stride)
+{
+   unsigned char index[64][4];
+   unsigned char px[4] = { 0, 0, 0, 255 }, prev[4] = { 0, 0, 0, 255 };
+   int has_alpha = (comp == 2 || comp == 4);
+   int i, j, run = 0;
+
+   if (x <= 0 || y <= 0 || comp < 1 || comp > 4 || data == NULL)
+      return 0;
+   if (stride == 0)
+      stride = x * comp;
+   memset(index, 0, sizeof(index));
+
+   stbiw__writef(s, "1111", 'q', 'o', 'i', 'f');
+   stbiw__write1(s, STBIW_UCHAR(x >> 24)); stbiw__write3(s, STBIW_UCHAR(x >> 16), STBIW_UCHAR(x >> 8), STBIW_UCHAR(x));
+   stbiw__write1(s, STBIW_UCHAR(y >> 24)); stbiw__write3(s, STBIW_UCHAR(y >> 16), STBIW_UCHAR(y >> 8), STBIW_UCHAR(y));
+   stbiw__write1(s, has_alpha ? 4 : 3);
+   stbiw__write1(s, 0); // sRGB with linear alpha
+
+   for (j = 0; j < y; ++j) {
+      const unsigned char *row = data + (size_t) stride * (stbi__flip_vertically_on_write ? y-1-j : j);
+      for (i = 0; i < x; ++i) {
+         const unsigned char *p = row + i*comp;
+         int h;
+         if (comp < 3) {
+            px[0] = px[1] = px[2] = p[0];
+            if (comp == 2) px[3] = p[1];
+         } else {
+            px[0] = p[0]; px[1] = p[1]; px[2] = p[2];
+            if (comp == 4) px[3] = p[3];
+         }
+
+         if (memcmp(px, prev, 4) == 0) {
+            if (++run == 62) {
+               stbiw__write1(s, 0xc0 | (run - 1)); // QOI_OP_RUN
+               run = 0;
+            }
+            continue;
+         }
+         if (run) {
+            stbiw__write1(s, 0xc0 | (run - 1));
+            run = 0;
+         }
+
+         h = STBIW__QOI_HASH(px[0], px[1], px[2], px[3]);
+         if (memcmp(index[h], px, 4) == 0) {
+            stbiw__write1(s, h); // QOI_OP_INDEX
+         } else {
+            memcpy(index[h], px, 4);
+            if (px[3] == prev[3]) {
+               signed char dr = (signed char) (px[0] - prev[0]);
+               signed char dg = (signed char) (px[1] - prev[1]);
+               signed char db = (signed char) (px[2] - prev[2]);
+               signed char dr_dg = (signed char) (dr - dg);
+               signed char db_dg = (signed char) (db - dg);
+               if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                  stbiw__write1(s, 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)); // QOI_OP_DIFF
+               } else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+                  stbiw__write1(s, 0x80 | (dg + 32)); // QOI_OP_LUMA
+                  stbiw__write1(s, (dr_dg + 8) << 4 | (db_dg + 8));
+               } else {
+                  stbiw__write1(s, 0xfe); // QOI_OP_RGB
+                  stbiw__write3(s, px[0], px[1], px[2]);
+               }
+            } else {
+               stbiw__write1(s, 0xff); // QOI_OP_RGBA
+               stbiw__write3(s, px[0], px[1], px[2]);
+               stbiw__write1(s, px[3]);
+            }
+         }
+         memcpy(prev, px, 4);
+      }
+   }
+   if (run)
+      stbiw__write1(s, 0xc0 | (run - 1));
+
+   // end marker
+   for (i = 0; i < 7; ++i)
+      stbiw__write1(s, 0);
+   stbiw__write1(s, 1);
+   return 1;
+}
+
+STBIWDEF int stbi_write_qoi_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_in_bytes)
+{
+   stbi__write_context s = { 0 };
+   int r;
+   stbi__start_write_callbacks(&s, func, context);
+   r = stbi_write_qoi_core(&s, x, y, comp, (const unsigned char *) data, stride_in_bytes);
+   stbi__end_write_callbacks(&s);
+   return r;
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_qoi(char const *filename, int x, int y, int comp, const void *data, int stride_in_bytes)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_qoi_core(&s, x, y, comp, (const unsigned char *) data, stride_in_bytes);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
+// *************************************************************************************************
+// PNM writer
+// PGM/PPM for 1 and 3 components, PAM for the ones with alpha
+
+#define STBIW__PNM_HEADER_MAX 128
+
+// header text for a w*h image, returns its length (0 if comp is not 1..4)
+static int stbiw__pnm_header(char *buffer, int x, int y, int comp)
+{
+   static const char *tupltype[] = { "GRAYSCALE_ALPHA", "RGB_ALPHA" };
+   if (comp == 1 || comp == 3)
+      return sprintf(buffer, "P%c\n%d %d\n255\n", comp == 1 ? '5' : '6', x, y);
+   if (comp == 2 || comp == 4)
+      return sprintf(buffer, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                     x, y, comp, tupltype[comp / 4]);
+   return 0;
+}
+
+static int stbi_write_pnm_core(stbi__write_context *s, int x, int y, int comp, const unsigned char *data, int stride)
+{
+   char header[STBIW__PNM_HEADER_MAX];
+   int j, len = stbiw__pnm_header(header, x, y, comp);
+
+   if (len == 0 || x <= 0 || y <= 0 || x > 0x7fffffff / comp)
+      return 0;
+   if (stride == 0)
+      stride = x * comp;
+
+   stbiw__write(s, header, len);
+   for (j = 0; j < y; ++j)
+      stbiw__write(s, data + (size_t) (stbi__flip_vertically_on_write ? y - 1 - j : j) * stride, x * comp);
+   return 1;
+}
+
+STBIWDEF int stbi_write_pnm_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_in_bytes)
+{
+   stbi__write_context s = { 0 };
+   int r;
+   stbi__start_write_callbacks(&s, func, context);
+   r = stbi_write_pnm_core(&s, x, y, comp, (const unsigned char *) data, stride_in_bytes);
+   stbi__end_write_callbacks(&s);
+   return r;
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_pnm(char const *filename, int x, int y, int comp, const void *data, int stride_in_bytes)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_pnm_core(&s, x, y, comp, (const unsigned char *) data, stride_in_bytes);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
 // *************************************************************************************************
 // Radiance RGBE HDR writer
 // by Baldur Karlsson
@@ -657,16 +1049,16 @@ static void stbiw__write_run_data(stbi__write_context *s, int length, unsigned c
 {
    unsigned char lengthbyte = STBIW_UCHAR(length+128);
    STBIW_ASSERT(length+128 <= 255);
-   s->func(s->context, &lengthbyte, 1);
-   s->func(s->context, &databyte, 1);
+   stbiw__write(s, &lengthbyte, 1);
+   stbiw__write(s, &databyte, 1);
 }
 
 static void stbiw__write_dump_data(stbi__write_context *s, int length, unsigned char *data)
 {
    unsigned char lengthbyte = STBIW_UCHAR(length);
    STBIW_ASSERT(length <= 128); // inconsistent with spec but consistent with official code
-   s->func(s->context, &lengthbyte, 1);
-   s->func(s->context, data, length);
+   stbiw__write(s, &lengthbyte, 1);
+   stbiw__write(s, data, length);
 }
 
 static void stbiw__write_hdr_scanline(stbi__write_context *s, int width, int ncomp, unsigned char *scratch, float *scanline)
@@ -693,7 +1085,7 @@ static void stbiw__write_hdr_scanline(stbi__write_context *s, int width, int nco
                     break;
          }
          stbiw__linear_to_rgbe(rgbe, linear);
-         s->func(s->context, rgbe, 4);
+         stbiw__write(s, rgbe, 4);
       }
    } else {
       int c,r;
@@ -716,7 +1108,7 @@ static void stbiw__write_hdr_scanline(stbi__write_context *s, int width, int nco
          scratch[x + width*3] = rgbe[3];
       }
 
-      s->func(s->context, scanlineheader, 4);
+      stbiw__write(s, scanlineheader, 4);
 
       /* RLE each component separately */
       for (c=0; c < 4; c++) {
@@ -768,14 +1160,14 @@ static int stbi_write_hdr_core(stbi__write_context *s, int x, int y, int comp, f
       int i, len;
       char buffer[128];
       char header[] = "#?RADIANCE\n# Written by stb_image_write.h\nFORMAT=32-bit_rle_rgbe\n";
-      s->func(s->context, header, sizeof(header)-1);
+      stbiw__write(s, header, sizeof(header)-1);
 
 #ifdef __STDC_LIB_EXT1__
       len = sprintf_s(buffer, sizeof(buffer), "EXPOSURE=          1.0000000000000\n\n-Y %d +X %d\n", y, x);
 #else
       len = sprintf(buffer, "EXPOSURE=          1.0000000000000\n\n-Y %d +X %d\n", y, x);
 #endif
-      s->func(s->context, buffer, len);
+      stbiw__write(s, buffer, len);
 
       for(i=0; i < y; i++)
          stbiw__write_hdr_scanline(s, x, comp, scratch, data + comp*x*(stbi__flip_vertically_on_write ? y-1-i : i));
@@ -787,8 +1179,11 @@ static int stbi_write_hdr_core(stbi__write_context *s, int x, int y, int comp, f
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const float *data)
 {
    stbi__write_context s = { 0 };
+   int r;
    stbi__start_write_callbacks(&s, func, context);
-   return stbi_write_hdr_core(&s, x, y, comp, (float *) data);
+   r = stbi_write_hdr_core(&s, x, y, comp, (float *) data);
+   stbi__end_write_callbacks(&s);
+   return r;
 }
 
 STBIWDEF int stbi_write_hdr(char const *filename, int x, int y, int comp, const float *data)
@@ -836,16 +1231,6 @@ static void *stbiw__sbgrowf(void **arr, int increment, int itemsize)
    return *arr;
 }
 
-static unsigned char *stbiw__zlib_flushf(unsigned char *data, unsigned int *bitbuffer, int *bitcount)
-{
-   while (*bitcount >= 8) {
-      stbiw__sbpush(data, STBIW_UCHAR(*bitbuffer));
-      *bitbuffer >>= 8;
-      *bitcount -= 8;
-   }
-   return data;
-}
-
 static int stbiw__zlib_bitrev(int code, int codebits)
 {
    int res=0;
@@ -856,10 +1241,27 @@ static int stbiw__zlib_bitrev(int code, int codebits)
    return res;
 }
 
+// hash chains in the style of zlib: head[] holds the latest position of each
+// 3-byte hash, prev[] (indexed by position mod the window) links to the one
+// before it with the same hash, so older candidates are simply overwritten
+#define stbiw__ZHASH_BITS 15
+#define stbiw__ZHASH      (1 << stbiw__ZHASH_BITS)
+#define stbiw__ZWINDOW    32768
+
 static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
+   int i=0;
+   if (limit > 258) limit = 258;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   // 8 bytes at a time, the first differing one is the lowest set byte of the xor
+   for (; i+8 <= limit; i += 8) {
+      unsigned long long x, y;
+      memcpy(&x, a+i, 8);
+      memcpy(&y, b+i, 8);
+      if (x != y) return i + (__builtin_ctzll(x ^ y) >> 3);
+   }
+#endif
+   for (; i < limit; ++i)
       if (a[i] != b[i]) break;
    return i;
 }
@@ -867,95 +1269,132 @@ static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int l
 static unsigned int stbiw__zhash(unsigned char *data)
 {
    stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
-   hash ^= hash << 3;
-   hash += hash >> 5;
-   hash ^= hash << 4;
-   hash += hash >> 17;
-   hash ^= hash << 25;
-   hash += hash >> 6;
-   return hash;
-}
-
-#define stbiw__zlib_flush() (out = stbiw__zlib_flushf(out, &bitbuf, &bitcount))
-#define stbiw__zlib_add(code,codebits) \
-      (bitbuf |= (code) << bitcount, bitcount += (codebits), stbiw__zlib_flush())
-#define stbiw__zlib_huffa(b,c)  stbiw__zlib_add(stbiw__zlib_bitrev(b,c),c)
-// default huffman tables
-#define stbiw__zlib_huff1(n)  stbiw__zlib_huffa(0x30 + (n), 8)
-#define stbiw__zlib_huff2(n)  stbiw__zlib_huffa(0x190 + (n)-144, 9)
-#define stbiw__zlib_huff3(n)  stbiw__zlib_huffa(0 + (n)-256,7)
-#define stbiw__zlib_huff4(n)  stbiw__zlib_huffa(0xc0 + (n)-280,8)
-#define stbiw__zlib_huff(n)  ((n) <= 143 ? stbiw__zlib_huff1(n) : (n) <= 255 ? stbiw__zlib_huff2(n) : (n) <= 279 ? stbiw__zlib_huff3(n) : stbiw__zlib_huff4(n))
-#define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
-
-#define stbiw__ZHASH   16384
+   return (hash * 2654435761u) >> (32 - stbiw__ZHASH_BITS);
+}
 
-#endif // STBIW_ZLIB_COMPRESS
+// bits are written out two bytes at a time into room made by stbiw__zlib_reserve,
+// so the buffer holds up to 15 bits between codes of up to 13
+#define stbiw__zlib_reserve()  stbiw__sbmaybegrow(out, 16)
+#define stbiw__zlib_add(code,codebits) do { \
+      bitbuf |= (unsigned int) (code) << bitcount; \
+      bitcount += (codebits); \
+      if (bitcount >= 16) { \
+         out[stbiw__sbn(out)++] = STBIW_UCHAR(bitbuf); \
+         out[stbiw__sbn(out)++] = STBIW_UCHAR(bitbuf >> 8); \
+         bitbuf >>= 16; \
+         bitcount -= 16; \
+      } \
+   } while (0)
+// default huffman tables, with the codes bit-reversed up front into 'huff'
+#define stbiw__zlib_hufflen(n) ((n) <= 143 ? 8 : (n) <= 255 ? 9 : (n) <= 279 ? 7 : 8)
+#define stbiw__zlib_huffcode(n) ((n) <= 143 ? 0x30 + (n) : (n) <= 255 ? 0x190 + (n)-144 : (n) <= 279 ? 0 + (n)-256 : 0xc0 + (n)-280)
+#define stbiw__zlib_huff(n)  stbiw__zlib_add(huff[n], stbiw__zlib_hufflen(n))
+#define stbiw__zlib_huffb(n) stbiw__zlib_add(huff[n], (n) <= 143 ? 8 : 9)
+
+// how hard to look per compression level (zlib's configuration table): stop at
+// a 'nice' match, follow at most 'chain' links (a quarter of them when the
+// previous match is 'good' already) and skip lazy matching past 'lazy'
+typedef struct
+{
+   unsigned short good, lazy, nice, chain;
+} stbiw__zlib_config;
+
+static const stbiw__zlib_config stbiw__zlib_levels[] = {
+   {  4,   4,  16,    4 }, // 5 and below
+   {  4,   8,  32,    8 }, // 6
+   {  8,  16,  64,   12 }, // 7
+   {  8,  16, 128,   16 }, // 8 (default)
+   {  8,  32, 128,   64 }, // 9
+   { 32, 128, 258,  256 }, // 10
+   { 32, 258, 258, 1024 }, // 11 and above
+};
+
+// length of the longest match for data[i..end) longer than 'best' among the
+// chain starting at 'cand', 0 if there is none; its distance goes to *dist
+static int stbiw__zlib_longest_match(unsigned char *data, int i, int end, int cand, const int *prev, int chain, int nice, int best, int *dist)
+{
+   unsigned char *cur = data + i;
+   int maxlen = end - i < 258 ? end - i : 258, found = 0;
+   if (nice > maxlen) nice = maxlen;
+   if (best >= maxlen) return 0;
+   while (cand > i - stbiw__ZWINDOW && chain-- > 0) {
+      unsigned char *m = data + cand;
+      // cheap reject: a longer match has to agree on byte 'best' too
+      if (m[best] == cur[best] && m[0] == cur[0] && m[1] == cur[1]) {
+         int len = stbiw__zlib_countm(m, cur, maxlen);
+         if (len > best) {
+            best = found = len;
+            *dist = i - cand;
+            if (len >= nice) break;
+         }
+      }
+      cand = prev[cand & (stbiw__ZWINDOW-1)];
+   }
+   return found;
+}
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// deflate data[start..end) as fixed huffman (or stored) blocks appended to the
+// stretchy buffer 'out'. data[0..start) is a preset dictionary that matches may
+// reach back into. the last block is final if 'final' is set; otherwise an empty
+// stored block follows (a zlib "sync flush"), so the output ends on a byte
+// boundary and the next piece of the stream can be appended to it. returns the
+// grown buffer, or NULL (with 'out' freed) if out of memory
+static unsigned char *stbiw__zlib_deflate_block(unsigned char *out, unsigned char *data, int start, int end, int quality, int final)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
-   if (hash_table == NULL)
+   int i,j, bitcount=0, base=stbiw__sbcount(out), len=end-start;
+   int match_len=0, match_dist=0, pending=0, h;
+   unsigned short huff[288];
+   const stbiw__zlib_config *cfg;
+   int *head = (int *) STBIW_MALLOC((stbiw__ZHASH + stbiw__ZWINDOW) * sizeof(int));
+   int *prev = head + stbiw__ZHASH;
+   if (head == NULL) {
+      (void) stbiw__sbfree(out);
       return NULL;
+   }
    if (quality < 5) quality = 5;
+   if (quality > 11) quality = 11;
+   cfg = &stbiw__zlib_levels[quality-5];
+   for (i=0; i < 288; ++i)
+      huff[i] = (unsigned short) stbiw__zlib_bitrev(stbiw__zlib_huffcode(i), stbiw__zlib_hufflen(i));
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_reserve();
+   stbiw__zlib_add(final ? 1 : 0,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
+   // no position is within the window of any real one
    for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
-
-   i=0;
-   while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) { best=d; bestloc=hlist[j]; }
-         }
-      }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
-      }
-      stbiw__sbpush(hash_table[h],data+i);
-
-      if (bestloc) {
-         // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
-         for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
-               }
-            }
-         }
+      head[i] = -stbiw__ZWINDOW;
+
+   #define stbiw__zlib_insert(p) \
+      (h = stbiw__zhash(data+(p)), prev[(p) & (stbiw__ZWINDOW-1)] = head[h], head[h] = (p))
+
+   // seed the hash chains with the dictionary that is still inside the window
+   for (i = start > stbiw__ZWINDOW-1 ? start-(stbiw__ZWINDOW-1) : 0; i < start && i+3 <= end; ++i)
+      stbiw__zlib_insert(i);
+
+   // lazy matching as zlib does it: a match found at i-1 is only emitted if
+   // the one at i isn't longer, otherwise data[i-1] goes out as a literal
+   i=start;
+   while (i < end) {
+      int cur_len = 0, cur_dist = 0;
+      stbiw__zlib_reserve();
+      if (i+3 <= end) {
+         int cand;
+         stbiw__zlib_insert(i);
+         cand = prev[i & (stbiw__ZWINDOW-1)];
+         if (match_len < cfg->lazy)
+            cur_len = stbiw__zlib_longest_match(data, i, end, cand, prev,
+                         match_len >= cfg->good ? cfg->chain >> 2 : cfg->chain,
+                         cfg->nice, match_len > 2 ? match_len : 2, &cur_dist);
       }
 
-      if (bestloc) {
-         int d = (int) (data+i - bestloc); // distance back
+      if (match_len >= 3 && cur_len <= match_len) {
+         int best = match_len, d = match_dist; // match starting at i-1
          STBIW_ASSERT(d <= 32767 && best <= 258);
          for (j=0; best > lengthc[j+1]-1; ++j);
          stbiw__zlib_huff(j+257);
@@ -963,31 +1402,49 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
          for (j=0; d > distc[j+1]-1; ++j);
          stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
          if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
-         i += best;
+         // i is in the chains already, add the rest of the match
+         for (j = i+1; j < i-1+best && j+3 <= end; ++j)
+            stbiw__zlib_insert(j);
+         i += best-1;
+         match_len = pending = 0;
       } else {
-         stbiw__zlib_huffb(data[i]);
+         if (pending)
+            stbiw__zlib_huffb(data[i-1]);
+         pending = 1;
+         match_len = cur_len;
+         match_dist = cur_dist;
          ++i;
       }
    }
-   // write out final bytes
-   for (;i < data_len; ++i)
-      stbiw__zlib_huffb(data[i]);
+   #undef stbiw__zlib_insert
+   stbiw__zlib_reserve();
+   if (pending)
+      stbiw__zlib_huffb(data[i-1]);
    stbiw__zlib_huff(256); // end of block
+   if (!final) {
+      stbiw__zlib_add(0,1);  // BFINAL = 0
+      stbiw__zlib_add(0,2);  // BTYPE = 0 -- empty stored block
+   }
    // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbiw__zlib_add(0,1);
+   for (; bitcount > 0; bitcount -= 8, bitbuf >>= 8)
+      out[stbiw__sbn(out)++] = STBIW_UCHAR(bitbuf);
+   if (!final) {
+      stbiw__sbpush(out, 0x00); // LEN = 0
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff); // NLEN
+      stbiw__sbpush(out, 0xff);
+   }
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
-   STBIW_FREE(hash_table);
-
-   // store uncompressed instead if compression was worse
-   if (stbiw__sbn(out) > data_len + 2 + ((data_len+32766)/32767)*5) {
-      stbiw__sbn(out) = 2;  // truncate to DEFLATE 32K window and FLEVEL = 1
-      for (j = 0; j < data_len;) {
-         int blocklen = data_len - j;
+   STBIW_FREE(head);
+
+   // store uncompressed instead if compression was worse (but keep the empty
+   // fixed block for no data, there'd be no stored block to carry BFINAL)
+   if (len > 0 && stbiw__sbn(out) - base > len + ((len+32766)/32767)*5) {
+      stbiw__sbn(out) = base;
+      for (j = start; j < end;) {
+         int blocklen = end - j;
          if (blocklen > 32767) blocklen = 32767;
-         stbiw__sbpush(out, data_len - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
+         stbiw__sbpush(out, final && end - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
          stbiw__sbpush(out, STBIW_UCHAR(blocklen)); // LEN
          stbiw__sbpush(out, STBIW_UCHAR(blocklen >> 8));
          stbiw__sbpush(out, STBIW_UCHAR(~blocklen)); // NLEN
@@ -997,23 +1454,70 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
          j += blocklen;
       }
    }
+   return out;
+}
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+   unsigned int s1=1, s2=0;
+   int i, j=0, blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      i = 0;
+#ifdef STBIW_SSE2
+      // 16 bytes a step: s1 grows by their sum, s2 by 16 times the s1 they
+      // start from plus the bytes weighted 16..1. 5552 bytes keep the sums
+      // below 2^32, same as the plain loop
+      {
+         const __m128i zero = _mm_setzero_si128();
+         const __m128i w_lo = _mm_setr_epi16(16,15,14,13,12,11,10,9);
+         const __m128i w_hi = _mm_setr_epi16(8,7,6,5,4,3,2,1);
+         __m128i v1 = zero, v2 = zero, v1_sum = zero;
+         unsigned int r[4];
+         for (; i + 16 <= blocklen; i += 16) {
+            __m128i b = _mm_loadu_si128((const __m128i *) (data + j + i));
+            v1_sum = _mm_add_epi32(v1_sum, v1);
+            v1 = _mm_add_epi32(v1, _mm_sad_epu8(b, zero));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_unpacklo_epi8(b, zero), w_lo));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_unpackhi_epi8(b, zero), w_hi));
+         }
+         v2 = _mm_add_epi32(v2, _mm_slli_epi32(v1_sum, 4));
+         _mm_storeu_si128((__m128i *) r, v2);
+         s2 += s1 * (unsigned int) i + r[0] + r[1] + r[2] + r[3];
+         _mm_storeu_si128((__m128i *) r, v1);
+         s1 += r[0] + r[2];
       }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+#endif
+      for (; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
    }
+   return (s2 << 16) | s1;
+}
+
+
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned char *out = NULL;
+   unsigned int adler;
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   out = stbiw__zlib_deflate_block(out, data, 0, data_len, quality, 1);
+   if (out == NULL)
+      return NULL;
+
+   adler = stbiw__adler32(data, data_len);
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(adler));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
@@ -1021,6 +1525,57 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 #endif // STBIW_ZLIB_COMPRESS
 }
 
+#if defined(STBIW_PCLMUL) && !defined(STBIW_CRC32)
+// folds 64 bytes a step with carry-less multiplies, then reduces to 32 bits
+// ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+// Instruction", Intel 2009). takes and returns the inverted crc like the
+// table loop; 'len' is a multiple of 16, at least 64
+static STBIW__TARGET_PCLMUL unsigned int stbiw__crc32_pclmul(const unsigned char *buf, int len, unsigned int crc)
+{
+   const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+   const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+   const __m128i k5   = _mm_set_epi64x(0, 0x0163cd6124);
+   const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+   const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+   __m128i x0, x1, x2, x3, x4, t;
+
+   x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (buf +  0)), _mm_cvtsi32_si128((int) crc));
+   x2 = _mm_loadu_si128((const __m128i *) (buf + 16));
+   x3 = _mm_loadu_si128((const __m128i *) (buf + 32));
+   x4 = _mm_loadu_si128((const __m128i *) (buf + 48));
+   buf += 64;
+   len -= 64;
+
+   #define stbiw__crc_fold(x, k, next) \
+      (t = _mm_clmulepi64_si128(x, k, 0x00), \
+       _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), t), next))
+   for (; len >= 64; buf += 64, len -= 64) {
+      x1 = stbiw__crc_fold(x1, k1k2, _mm_loadu_si128((const __m128i *) (buf +  0)));
+      x2 = stbiw__crc_fold(x2, k1k2, _mm_loadu_si128((const __m128i *) (buf + 16)));
+      x3 = stbiw__crc_fold(x3, k1k2, _mm_loadu_si128((const __m128i *) (buf + 32)));
+      x4 = stbiw__crc_fold(x4, k1k2, _mm_loadu_si128((const __m128i *) (buf + 48)));
+   }
+   x1 = stbiw__crc_fold(x1, k3k4, x2);
+   x1 = stbiw__crc_fold(x1, k3k4, x3);
+   x1 = stbiw__crc_fold(x1, k3k4, x4);
+   for (; len >= 16; buf += 16, len -= 16)
+      x1 = stbiw__crc_fold(x1, k3k4, _mm_loadu_si128((const __m128i *) buf));
+   #undef stbiw__crc_fold
+
+   // 128 -> 64 bits
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5, 0x00), x2);
+
+   // Barrett reduction to 32 bits
+   x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+   x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), poly, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+   x0 = _mm_srli_si128(x1, 4);
+   return (unsigned int) _mm_cvtsi128_si32(x0);
+}
+#endif
+
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
 #ifdef STBIW_CRC32
@@ -1063,8 +1618,37 @@ static unsigned int stbiw__crc32(unsigned char *buffer, int len)
    };
 
    unsigned int crc = ~0u;
-   int i;
-   for (i=0; i < len; ++i)
+   int i = 0;
+
+#if defined(STBIW_PCLMUL)
+   if (len >= 64 && stbiw__pclmul_available()) {
+      i = len & ~15;
+      crc = stbiw__crc32_pclmul(buffer, i, crc);
+   }
+#elif defined(STBIW_ARM_CRC32)
+   for (; i + 8 <= len; i += 8) {
+      unsigned long long v;
+      memcpy(&v, buffer + i, 8);
+      crc = __crc32d(crc, v);
+   }
+#endif
+
+   // slicing-by-8 for long runs. the tables for bytes followed by 1..7 zero
+   // bytes take ~2k steps to build, so only do it when that pays off
+   if (len - i >= 4096) {
+      unsigned int t[8][256];
+      int k, n;
+      memcpy(t[0], crc_table, sizeof(crc_table));
+      for (k=1; k < 8; ++k)
+         for (n=0; n < 256; ++n)
+            t[k][n] = (t[k-1][n] >> 8) ^ crc_table[t[k-1][n] & 0xff];
+      for (; i + 8 <= len; i += 8) {
+         unsigned int a = crc ^ (buffer[i] | (buffer[i+1] << 8) | (buffer[i+2] << 16) | ((unsigned int) buffer[i+3] << 24));
+         crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+               t[3][buffer[i+4]] ^ t[2][buffer[i+5]] ^ t[1][buffer[i+6]] ^ t[0][buffer[i+7]];
+      }
+   }
+   for (; i < len; ++i)
       crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
    return ~crc;
 #endif
@@ -1125,64 +1709,164 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+#ifdef STBIW_SSE2
+// one byte of filter 'type' with a, b, c the bytes left, above and above left
+static unsigned char stbiw__png_filter_byte(int type, int x, int a, int b, int c)
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
+   switch (type) {
+      case 1: return STBIW_UCHAR(x - a);
+      case 2: return STBIW_UCHAR(x - b);
+      case 3: return STBIW_UCHAR(x - ((a + b) >> 1));
+      case 4: return STBIW_UCHAR(x - stbiw__paeth(a, b, c));
+   }
+   return STBIW_UCHAR(x);
+}
 
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+static __m128i stbiw__png_select_sse2(__m128i mask, __m128i yes, __m128i no)
+{
+   return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+}
 
-   if (force_filter >= 5) {
-      force_filter = -1;
+// stbiw__paeth on 8 lanes of 16 bits
+static __m128i stbiw__png_paeth8_sse2(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c), pc = _mm_add_epi16(pa, pb);
+   __m128i not_a, not_b;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   not_b = _mm_cmpgt_epi16(pb, pc);
+   return stbiw__png_select_sse2(not_a, stbiw__png_select_sse2(not_b, c, b), a);
+}
+
+// the five filters of 16 bytes x with a, b, c as above
+static void stbiw__png_filters_sse2(__m128i x, __m128i a, __m128i b, __m128i c, __m128i f[5])
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+   __m128i paeth = _mm_packus_epi16(
+      stbiw__png_paeth8_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+      stbiw__png_paeth8_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+   f[0] = x;
+   f[1] = _mm_sub_epi8(x, a);
+   f[2] = _mm_sub_epi8(x, b);
+   f[3] = _mm_sub_epi8(x, avg);
+   f[4] = _mm_sub_epi8(x, paeth);
+}
+
+// filter a row of 'len' bytes into out[1..] and its type into out[0]; the type
+// is picked exactly like the C code does. 'up' is the row above, NULL for the first
+static void stbiw__png_filter_row_sse2(const unsigned char *z, const unsigned char *up, int len, int n, int force_filter, int fast, unsigned char *out)
+{
+   __m128i zero = _mm_setzero_si128(), f[5];
+   int i, t, type = force_filter;
+   #define stbiw__png_abc(i) \
+      int a = (i) >= n ? z[(i)-n] : 0, b = up ? up[i] : 0, c = up && (i) >= n ? up[(i)-n] : 0
+   #define stbiw__png_load_abc(i) \
+      x = _mm_loadu_si128((const __m128i *) (z+(i))); \
+      a = _mm_loadu_si128((const __m128i *) (z+(i)-n)); \
+      b = up ? _mm_loadu_si128((const __m128i *) (up+(i))) : zero; \
+      c = up ? _mm_loadu_si128((const __m128i *) (up+(i)-n)) : zero
+
+   if (type < 0) {
+      // sums of absolute values: |v| of a signed byte is min(v, -v) unsigned
+      __m128i acc[5];
+      int est[5] = { 0,0,0,0,0 }, step = fast ? 4 : 1;
+      for (t=0; t < 5; ++t)
+         acc[t] = zero;
+      for (i=0; i < n && i < len; ++i) {
+         stbiw__png_abc(i);
+         for (t=0; t < 5; t += step)
+            est[t] += abs((signed char) stbiw__png_filter_byte(t, z[i], a, b, c));
+      }
+      for (; i+16 <= len; i += 16) {
+         __m128i x, a, b, c;
+         stbiw__png_load_abc(i);
+         stbiw__png_filters_sse2(x, a, b, c, f);
+         for (t=0; t < 5; t += step)
+            acc[t] = _mm_add_epi64(acc[t], _mm_sad_epu8(_mm_min_epu8(f[t], _mm_sub_epi8(zero, f[t])), zero));
+      }
+      for (; i < len; ++i) {
+         stbiw__png_abc(i);
+         for (t=0; t < 5; t += step)
+            est[t] += abs((signed char) stbiw__png_filter_byte(t, z[i], a, b, c));
+      }
+      type = 0;
+      for (t=0; t < 5; t += step) {
+         est[t] += _mm_cvtsi128_si32(acc[t]) + _mm_cvtsi128_si32(_mm_srli_si128(acc[t], 8));
+         if (est[t] < est[type]) type = t;
+      }
    }
 
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
-      int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
-      } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
-            if (est < best_filter_val) {
-               best_filter_val = est;
-               best_filter = filter_type;
-            }
+   out[0] = (unsigned char) type;
+   for (i=0; i < n && i < len; ++i) {
+      stbiw__png_abc(i);
+      out[1+i] = stbiw__png_filter_byte(type, z[i], a, b, c);
+   }
+   for (; i+16 <= len; i += 16) {
+      __m128i x, a, b, c;
+      stbiw__png_load_abc(i);
+      stbiw__png_filters_sse2(x, a, b, c, f);
+      _mm_storeu_si128((__m128i *) (out+1+i), f[type]);
+   }
+   for (; i < len; ++i) {
+      stbiw__png_abc(i);
+      out[1+i] = stbiw__png_filter_byte(type, z[i], a, b, c);
+   }
+   #undef stbiw__png_abc
+   #undef stbiw__png_load_abc
+}
+#endif // STBIW_SSE2
+
+// filter row j of the image into 'out': the filter type byte, then x*n bytes.
+// 'fast' only tries None and Paeth
+static void stbiw__png_filter_row(unsigned char *pixels, int stride_bytes, int x, int y, int j, int n, int force_filter, int fast, signed char *line_buffer, unsigned char *out)
+{
+   int filter_type;
+#ifdef STBIW_SSE2
+   {
+      int row = stbi__flip_vertically_on_write ? y-1-j : j;
+      int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+      unsigned char *z = pixels + stride_bytes * row;
+      stbiw__png_filter_row_sse2(z, j ? z - signed_stride : NULL, x*n, n, force_filter, fast, out);
+      return;
+   }
+#endif
+   if (force_filter > -1) {
+      filter_type = force_filter;
+      stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, force_filter, line_buffer);
+   } else { // Estimate the best filter by running through all of them:
+      int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+      for (filter_type = 0; filter_type < 5; filter_type += fast ? 4 : 1) {
+         stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, filter_type, line_buffer);
+
+         // Estimate the entropy of the line using this filter; the less, the better.
+         est = 0;
+         for (i = 0; i < x*n; ++i) {
+            est += abs((signed char) line_buffer[i]);
          }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
+         if (est < best_filter_val) {
+            best_filter_val = est;
+            best_filter = filter_type;
          }
       }
-      // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+      if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
+         stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, best_filter, line_buffer);
+         filter_type = best_filter;
+      }
    }
-   STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
-   STBIW_FREE(filt);
-   if (!zlib) return 0;
-
-   // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
-   *out_len = 8 + 12+13 + 12+zlen + 12;
+   // when we get here, filter_type contains the filter type, and line_buffer contains the data
+   out[0] = (unsigned char) filter_type;
+   STBIW_MEMMOVE(out+1, line_buffer, x*n);
+}
 
-   o=out;
+// PNG signature and IHDR chunk, 8+12+13 bytes
+static unsigned char *stbiw__png_write_ihdr(unsigned char *o, int x, int y, int n)
+{
+   static const int ctype[5] = { -1, 0, 4, 2, 6 };
+   static const unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
    STBIW_MEMMOVE(o,sig,8); o+= 8;
    stbiw__wp32(o, 13); // header length
    stbiw__wptag(o, "IHDR");
@@ -1194,6 +1878,47 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    *o++ = 0;
    *o++ = 0;
    stbiw__wpcrc(&o,13);
+   return o;
+}
+
+// IEND chunk, 12 bytes
+static unsigned char *stbiw__png_write_iend(unsigned char *o)
+{
+   stbiw__wp32(o,0);
+   stbiw__wptag(o, "IEND");
+   stbiw__wpcrc(&o,0);
+   return o;
+}
+
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   int force_filter = stbi_write_force_png_filter;
+   unsigned char *out,*o, *filt, *zlib;
+   signed char *line_buffer;
+   int j,zlen;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
+   for (j=0; j < y; ++j)
+      stbiw__png_filter_row((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, stbi_write_png_fast_filter, line_buffer, filt+j*(x*n+1));
+   STBIW_FREE(line_buffer);
+   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
+   STBIW_FREE(filt);
+   if (!zlib) return 0;
+
+   // each tag requires 12 bytes of overhead
+   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
+   if (!out) return 0;
+   *out_len = 8 + 12+13 + 12+zlen + 12;
+
+   o = stbiw__png_write_ihdr(out, x, y, n);
 
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
@@ -1202,9 +1927,7 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    STBIW_FREE(zlib);
    stbiw__wpcrc(&o, zlen);
 
-   stbiw__wp32(o,0);
-   stbiw__wptag(o, "IEND");
-   stbiw__wpcrc(&o,0);
+   o = stbiw__png_write_iend(o);
 
    STBIW_ASSERT(o == out + *out_len);
 
@@ -1250,8 +1973,9 @@ STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x,
 static const unsigned char stbiw__jpg_ZigZag[] = { 0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,9,11,18,
       24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63 };
 
-static void stbiw__jpg_writeBits(stbi__write_context *s, int *bitBufP, int *bitCntP, const unsigned short *bs) {
-   int bitBuf = *bitBufP, bitCnt = *bitCntP;
+static void stbiw__jpg_writeBits(stbi__write_context *s, unsigned int *bitBufP, int *bitCntP, const unsigned short *bs) {
+   unsigned int bitBuf = *bitBufP;
+   int bitCnt = *bitCntP;
    bitCnt += bs[1];
    bitBuf |= bs[0] << (24 - bitCnt);
    while(bitCnt >= 8) {
@@ -1318,18 +2042,20 @@ static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float
 static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
    int tmp1 = val < 0 ? -val : val;
    val = val < 0 ? val-1 : val;
+#ifdef __GNUC__
+   bits[1] = (unsigned short) (32 - __builtin_clz((unsigned int) tmp1 | 1));
+#else
    bits[1] = 1;
    while(tmp1 >>= 1) {
       ++bits[1];
    }
+#endif
    bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
-   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-   int dataOff, i, j, n, diff, end0pos, x, y;
-   int DU[64];
+// forward DCT of the 8x8 block at CDU (clobbered), quantized into DU in zigzag order
+static void stbiw__jpg_fdct_quant(float *CDU, int du_stride, const float *fdtbl, short *DU) {
+   int dataOff, i, j, n, x, y;
 
    // DCT rows
    for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
@@ -1348,9 +2074,382 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
          v = CDU[i]*fdtbl[j];
          // DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
          // ceilf() and floorf() are C99, not C89, but I /think/ they're not needed here anyway?
-         DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+         DU[stbiw__jpg_ZigZag[j]] = (short)(v < 0 ? v - 0.5f : v + 0.5f);
+      }
+   }
+}
+
+// RGB(A)/Y(A) to level shifted YCbCr for n consecutive pixels
+static void stbiw__jpg_rgb_to_ycc(float *Y, float *U, float *V, const unsigned char *p, int n, int comp) {
+   // comp == 2 is grey+alpha (alpha is ignored)
+   int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
+   int i;
+   for(i = 0; i < n; ++i, p += comp) {
+      float r = p[0], g = p[ofsG], b = p[ofsB];
+      Y[i]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
+      U[i]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
+      V[i]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+   }
+}
+
+// average 2x2 pixels of a 16x16 block
+static void stbiw__jpg_subsample(float *out, const float *in) {
+   int yy, xx, pos;
+   for(yy = 0, pos = 0; yy < 8; ++yy) {
+      for(xx = 0; xx < 8; ++xx, ++pos) {
+         int j = yy*32+xx*2;
+         out[pos] = (in[j+0] + in[j+1] + in[j+16] + in[j+17]) * 0.25f;
+      }
+   }
+}
+
+#ifdef STBIW_SSE2
+// stbiw__jpg_DCT on 4 lanes at once
+static void stbiw__jpg_DCT_sse2(__m128 *d) {
+   __m128 z1, z2, z3, z4, z5, z11, z13;
+   __m128 tmp0 = _mm_add_ps(d[0], d[7]);
+   __m128 tmp7 = _mm_sub_ps(d[0], d[7]);
+   __m128 tmp1 = _mm_add_ps(d[1], d[6]);
+   __m128 tmp6 = _mm_sub_ps(d[1], d[6]);
+   __m128 tmp2 = _mm_add_ps(d[2], d[5]);
+   __m128 tmp5 = _mm_sub_ps(d[2], d[5]);
+   __m128 tmp3 = _mm_add_ps(d[3], d[4]);
+   __m128 tmp4 = _mm_sub_ps(d[3], d[4]);
+
+   // Even part
+   __m128 tmp10 = _mm_add_ps(tmp0, tmp3);
+   __m128 tmp13 = _mm_sub_ps(tmp0, tmp3);
+   __m128 tmp11 = _mm_add_ps(tmp1, tmp2);
+   __m128 tmp12 = _mm_sub_ps(tmp1, tmp2);
+
+   d[0] = _mm_add_ps(tmp10, tmp11);
+   d[4] = _mm_sub_ps(tmp10, tmp11);
+
+   z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), _mm_set1_ps(0.707106781f));
+   d[2] = _mm_add_ps(tmp13, z1);
+   d[6] = _mm_sub_ps(tmp13, z1);
+
+   // Odd part
+   tmp10 = _mm_add_ps(tmp4, tmp5);
+   tmp11 = _mm_add_ps(tmp5, tmp6);
+   tmp12 = _mm_add_ps(tmp6, tmp7);
+
+   z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), _mm_set1_ps(0.382683433f));
+   z2 = _mm_add_ps(_mm_mul_ps(tmp10, _mm_set1_ps(0.541196100f)), z5);
+   z4 = _mm_add_ps(_mm_mul_ps(tmp12, _mm_set1_ps(1.306562965f)), z5);
+   z3 = _mm_mul_ps(tmp11, _mm_set1_ps(0.707106781f));
+
+   z11 = _mm_add_ps(tmp7, z3);
+   z13 = _mm_sub_ps(tmp7, z3);
+
+   d[5] = _mm_add_ps(z13, z2);
+   d[3] = _mm_sub_ps(z13, z2);
+   d[1] = _mm_add_ps(z11, z4);
+   d[7] = _mm_sub_ps(z11, z4);
+}
+
+// round half away from zero and truncate, like the C version
+static __m128i stbiw__jpg_quant_sse2(__m128 v, const float *fdtbl) {
+   __m128 half;
+   v = _mm_mul_ps(v, _mm_loadu_ps(fdtbl));
+   half = _mm_or_ps(_mm_and_ps(v, _mm_set1_ps(-0.0f)), _mm_set1_ps(0.5f));
+   return _mm_cvttps_epi32(_mm_add_ps(v, half));
+}
+
+static void stbiw__jpg_fdct_quant_sse2(float *CDU, int du_stride, const float *fdtbl, short *DU) {
+   // l/r: left and right 4 columns of each row. t: one column of 4 rows
+   __m128 l[8], r[8], t[8];
+   int q[64];
+   int i;
+
+   for(i = 0; i < 8; ++i) {
+      l[i] = _mm_loadu_ps(CDU + i*du_stride);
+      r[i] = _mm_loadu_ps(CDU + i*du_stride + 4);
+   }
+
+   // DCT rows, 4 rows at a time
+   for(i = 0; i < 8; i += 4) {
+      t[0] = l[i]; t[1] = l[i+1]; t[2] = l[i+2]; t[3] = l[i+3];
+      t[4] = r[i]; t[5] = r[i+1]; t[6] = r[i+2]; t[7] = r[i+3];
+      _MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+      _MM_TRANSPOSE4_PS(t[4], t[5], t[6], t[7]);
+      stbiw__jpg_DCT_sse2(t);
+      _MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+      _MM_TRANSPOSE4_PS(t[4], t[5], t[6], t[7]);
+      l[i] = t[0]; l[i+1] = t[1]; l[i+2] = t[2]; l[i+3] = t[3];
+      r[i] = t[4]; r[i+1] = t[5]; r[i+2] = t[6]; r[i+3] = t[7];
+   }
+
+   // DCT columns
+   stbiw__jpg_DCT_sse2(l);
+   stbiw__jpg_DCT_sse2(r);
+
+   // Quantize/descale
+   for(i = 0; i < 8; ++i) {
+      _mm_storeu_si128((__m128i *) (q + i*8), stbiw__jpg_quant_sse2(l[i], fdtbl + i*8));
+      _mm_storeu_si128((__m128i *) (q + i*8 + 4), stbiw__jpg_quant_sse2(r[i], fdtbl + i*8 + 4));
+   }
+   // zigzag
+   for(i = 0; i < 64; ++i)
+      DU[stbiw__jpg_ZigZag[i]] = (short) q[i];
+}
+
+static void stbiw__jpg_ycc_sse2(float *Y, float *U, float *V, __m128 r, __m128 g, __m128 b) {
+   _mm_storeu_ps(Y, _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.29900f), r), _mm_mul_ps(_mm_set1_ps(0.58700f), g)),
+                                          _mm_mul_ps(_mm_set1_ps(0.11400f), b)), _mm_set1_ps(128)));
+   _mm_storeu_ps(U, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(-0.16874f), r), _mm_mul_ps(_mm_set1_ps(0.33126f), g)),
+                               _mm_mul_ps(_mm_set1_ps(0.50000f), b)));
+   _mm_storeu_ps(V, _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(0.50000f), r), _mm_mul_ps(_mm_set1_ps(0.41869f), g)),
+                               _mm_mul_ps(_mm_set1_ps(0.08131f), b)));
+}
+
+static void stbiw__jpg_rgb_to_ycc_sse2(float *Y, float *U, float *V, const unsigned char *p, int n, int comp) {
+   int i = 0;
+   if (comp == 4) {
+      __m128i mask = _mm_set1_epi32(0xff);
+      for(; i+4 <= n; i += 4, p += 16) {
+         __m128i px = _mm_loadu_si128((const __m128i *) p);
+         __m128 r = _mm_cvtepi32_ps(_mm_and_si128(px, mask));
+         __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask));
+         __m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask));
+         stbiw__jpg_ycc_sse2(Y+i, U+i, V+i, r, g, b);
+      }
+   } else if (comp == 3) {
+      for(; i+4 <= n; i += 4, p += 12) {
+         __m128 r = _mm_cvtepi32_ps(_mm_setr_epi32(p[0], p[3], p[6], p[9]));
+         __m128 g = _mm_cvtepi32_ps(_mm_setr_epi32(p[1], p[4], p[7], p[10]));
+         __m128 b = _mm_cvtepi32_ps(_mm_setr_epi32(p[2], p[5], p[8], p[11]));
+         stbiw__jpg_ycc_sse2(Y+i, U+i, V+i, r, g, b);
+      }
+   }
+   stbiw__jpg_rgb_to_ycc(Y+i, U+i, V+i, p, n-i, comp);
+}
+
+static void stbiw__jpg_subsample_sse2(float *out, const float *in) {
+   int yy, xx;
+   for(yy = 0; yy < 8; ++yy) {
+      for(xx = 0; xx < 8; xx += 4) {
+         const float *j = in + yy*32 + xx*2;
+         __m128 a0 = _mm_loadu_ps(j), a1 = _mm_loadu_ps(j+4);
+         __m128 b0 = _mm_loadu_ps(j+16), b1 = _mm_loadu_ps(j+20);
+         __m128 v = _mm_add_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3,1,3,1)));
+         v = _mm_add_ps(v, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2,0,2,0)));
+         v = _mm_add_ps(v, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3,1,3,1)));
+         _mm_storeu_ps(out + yy*8 + xx, _mm_mul_ps(v, _mm_set1_ps(0.25f)));
+      }
+   }
+}
+#endif // STBIW_SSE2
+
+#ifdef STBIW_AVX2
+STBIW__TARGET_AVX2 static void stbiw__jpg_DCT_avx2(__m256 *d) {
+   __m256 z1, z2, z3, z4, z5, z11, z13;
+   __m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+   __m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+   __m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+   __m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+   __m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+   __m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+   __m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+   __m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+   // Even part
+   __m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+   __m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+   __m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+   __m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+   d[0] = _mm256_add_ps(tmp10, tmp11);
+   d[4] = _mm256_sub_ps(tmp10, tmp11);
+
+   z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), _mm256_set1_ps(0.707106781f));
+   d[2] = _mm256_add_ps(tmp13, z1);
+   d[6] = _mm256_sub_ps(tmp13, z1);
+
+   // Odd part
+   tmp10 = _mm256_add_ps(tmp4, tmp5);
+   tmp11 = _mm256_add_ps(tmp5, tmp6);
+   tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+   z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), _mm256_set1_ps(0.382683433f));
+   z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, _mm256_set1_ps(0.541196100f)), z5);
+   z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, _mm256_set1_ps(1.306562965f)), z5);
+   z3 = _mm256_mul_ps(tmp11, _mm256_set1_ps(0.707106781f));
+
+   z11 = _mm256_add_ps(tmp7, z3);
+   z13 = _mm256_sub_ps(tmp7, z3);
+
+   d[5] = _mm256_add_ps(z13, z2);
+   d[3] = _mm256_sub_ps(z13, z2);
+   d[1] = _mm256_add_ps(z11, z4);
+   d[7] = _mm256_sub_ps(z11, z4);
+}
+
+STBIW__TARGET_AVX2 static void stbiw__jpg_transpose_avx2(__m256 *d) {
+   __m256 t0 = _mm256_unpacklo_ps(d[0], d[1]), t1 = _mm256_unpackhi_ps(d[0], d[1]);
+   __m256 t2 = _mm256_unpacklo_ps(d[2], d[3]), t3 = _mm256_unpackhi_ps(d[2], d[3]);
+   __m256 t4 = _mm256_unpacklo_ps(d[4], d[5]), t5 = _mm256_unpackhi_ps(d[4], d[5]);
+   __m256 t6 = _mm256_unpacklo_ps(d[6], d[7]), t7 = _mm256_unpackhi_ps(d[6], d[7]);
+   __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2));
+   __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2));
+   __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1,0,1,0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3,2,3,2));
+   __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1,0,1,0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3,2,3,2));
+   d[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+   d[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+   d[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+   d[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+   d[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+   d[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+   d[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+   d[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+STBIW__TARGET_AVX2 static void stbiw__jpg_fdct_quant_avx2(float *CDU, int du_stride, const float *fdtbl, short *DU) {
+   __m256 d[8];
+   int q[64];
+   int i;
+
+   for(i = 0; i < 8; ++i)
+      d[i] = _mm256_loadu_ps(CDU + i*du_stride);
+
+   // DCT rows, then columns
+   stbiw__jpg_transpose_avx2(d);
+   stbiw__jpg_DCT_avx2(d);
+   stbiw__jpg_transpose_avx2(d);
+   stbiw__jpg_DCT_avx2(d);
+
+   // Quantize/descale
+   for(i = 0; i < 8; ++i) {
+      __m256 v = _mm256_mul_ps(d[i], _mm256_loadu_ps(fdtbl + i*8));
+      __m256 half = _mm256_or_ps(_mm256_and_ps(v, _mm256_set1_ps(-0.0f)), _mm256_set1_ps(0.5f));
+      _mm256_storeu_si256((__m256i *) (q + i*8), _mm256_cvttps_epi32(_mm256_add_ps(v, half)));
+   }
+   // zigzag
+   for(i = 0; i < 64; ++i)
+      DU[stbiw__jpg_ZigZag[i]] = (short) q[i];
+}
+
+STBIW__TARGET_AVX2 static void stbiw__jpg_rgb_to_ycc_avx2(float *Y, float *U, float *V, const unsigned char *p, int n, int comp) {
+   int i = 0;
+   if (comp == 3 || comp == 4) {
+      // gathers r, g and b of 8 pixels into the low 8 bytes, from 16+8 input bytes for comp 3
+      const __m128i shuf_lo_r = comp == 4 ? _mm_setr_epi8(0,4,8,12,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1) : _mm_setr_epi8(0,3,6,9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i shuf_lo_g = comp == 4 ? _mm_setr_epi8(1,5,9,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1) : _mm_setr_epi8(1,4,7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i shuf_lo_b = comp == 4 ? _mm_setr_epi8(2,6,10,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1) : _mm_setr_epi8(2,5,8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i shuf_hi_r = comp == 4 ? _mm_setr_epi8(-1,-1,-1,-1,0,4,8,12,-1,-1,-1,-1,-1,-1,-1,-1) : _mm_setr_epi8(-1,-1,-1,-1,-1,-1,2,5,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i shuf_hi_g = comp == 4 ? _mm_setr_epi8(-1,-1,-1,-1,1,5,9,13,-1,-1,-1,-1,-1,-1,-1,-1) : _mm_setr_epi8(-1,-1,-1,-1,-1,0,3,6,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i shuf_hi_b = comp == 4 ? _mm_setr_epi8(-1,-1,-1,-1,2,6,10,14,-1,-1,-1,-1,-1,-1,-1,-1) : _mm_setr_epi8(-1,-1,-1,-1,-1,1,4,7,-1,-1,-1,-1,-1,-1,-1,-1);
+      for(; i+8 <= n; i += 8, p += 8*comp) {
+         __m128i lo = _mm_loadu_si128((const __m128i *) p);
+         __m128i hi = comp == 4 ? _mm_loadu_si128((const __m128i *) (p+16)) : _mm_loadl_epi64((const __m128i *) (p+16));
+         __m256 r = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(lo, shuf_lo_r), _mm_shuffle_epi8(hi, shuf_hi_r))));
+         __m256 g = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(lo, shuf_lo_g), _mm_shuffle_epi8(hi, shuf_hi_g))));
+         __m256 b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(lo, shuf_lo_b), _mm_shuffle_epi8(hi, shuf_hi_b))));
+         _mm256_storeu_ps(Y+i, _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.29900f), r), _mm256_mul_ps(_mm256_set1_ps(0.58700f), g)),
+                                                           _mm256_mul_ps(_mm256_set1_ps(0.11400f), b)), _mm256_set1_ps(128)));
+         _mm256_storeu_ps(U+i, _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(-0.16874f), r), _mm256_mul_ps(_mm256_set1_ps(0.33126f), g)),
+                                             _mm256_mul_ps(_mm256_set1_ps(0.50000f), b)));
+         _mm256_storeu_ps(V+i, _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(0.50000f), r), _mm256_mul_ps(_mm256_set1_ps(0.41869f), g)),
+                                             _mm256_mul_ps(_mm256_set1_ps(0.08131f), b)));
       }
    }
+   stbiw__jpg_rgb_to_ycc(Y+i, U+i, V+i, p, n-i, comp);
+}
+#endif // STBIW_AVX2
+
+typedef struct
+{
+   void (*fdct_quant)(float *CDU, int du_stride, const float *fdtbl, short *DU);
+   void (*rgb_to_ycc)(float *Y, float *U, float *V, const unsigned char *p, int n, int comp);
+   void (*subsample)(float *out, const float *in);
+} stbiw__jpg_kernels;
+
+static void stbiw__jpg_setup_kernels(stbiw__jpg_kernels *k) {
+   k->fdct_quant = stbiw__jpg_fdct_quant;
+   k->rgb_to_ycc = stbiw__jpg_rgb_to_ycc;
+   k->subsample = stbiw__jpg_subsample;
+#ifdef STBIW_SSE2
+   k->fdct_quant = stbiw__jpg_fdct_quant_sse2;
+   k->rgb_to_ycc = stbiw__jpg_rgb_to_ycc_sse2;
+   k->subsample = stbiw__jpg_subsample_sse2;
+#endif
+#ifdef STBIW_AVX2
+   if (stbiw__avx2_available()) {
+      k->fdct_quant = stbiw__jpg_fdct_quant_avx2;
+      k->rgb_to_ycc = stbiw__jpg_rgb_to_ycc_avx2;
+   }
+#endif
+}
+
+// Annex K tables, used unless the image gets tables of its own
+static const unsigned char stbiw__jpg_std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const unsigned char stbiw__jpg_std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char stbiw__jpg_std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+static const unsigned char stbiw__jpg_std_ac_luminance_values[] = {
+   0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+   0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+   0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+   0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+   0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+   0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+   0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+static const unsigned char stbiw__jpg_std_dc_chrominance_nrcodes[] = {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static const unsigned char stbiw__jpg_std_dc_chrominance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char stbiw__jpg_std_ac_chrominance_nrcodes[] = {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static const unsigned char stbiw__jpg_std_ac_chrominance_values[] = {
+   0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+   0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+   0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+   0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+   0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+   0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+   0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+static const unsigned short stbiw__jpg_YDC_HT[256][2] = { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9}};
+static const unsigned short stbiw__jpg_UVDC_HT[256][2] = { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9},{1022,10},{2046,11}};
+static const unsigned short stbiw__jpg_YAC_HT[256][2] = {
+   {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},{65410,16},{65411,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {12,4},{27,5},{121,7},{502,9},{2038,11},{65412,16},{65413,16},{65414,16},{65415,16},{65416,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {28,5},{249,8},{1015,10},{4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},{65422,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {58,6},{503,9},{4085,12},{65423,16},{65424,16},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {59,6},{1016,10},{65430,16},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {122,7},{2039,11},{65438,16},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {123,7},{4086,12},{65446,16},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {250,8},{4087,12},{65454,16},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {504,9},{32704,15},{65462,16},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {505,9},{65470,16},{65471,16},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {506,9},{65479,16},{65480,16},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1017,10},{65488,16},{65489,16},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1018,10},{65497,16},{65498,16},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2040,11},{65506,16},{65507,16},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {65515,16},{65516,16},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
+};
+static const unsigned short stbiw__jpg_UVAC_HT[256][2] = {
+   {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
+};
+
+// encode one quantized block, returns its DC for the next prediction
+static int stbiw__jpg_encode_block(stbi__write_context *s, unsigned int *bitBuf, int *bitCnt, const short *DU, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
+   int i, diff, end0pos;
 
    // Encode DC
    diff = DU[0] - DC;
@@ -1395,71 +2494,172 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
    return DU[0];
 }
 
-static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+// count the symbols stbiw__jpg_encode_block would write
+static int stbiw__jpg_count_block(const short *DU, int DC, unsigned int freqDC[256], unsigned int freqAC[256]) {
+   int i, diff, end0pos;
+   unsigned short bits[2];
+
+   diff = DU[0] - DC;
+   if (diff == 0) {
+      ++freqDC[0];
+   } else {
+      stbiw__jpg_calcBits(diff, bits);
+      ++freqDC[bits[1]];
+   }
+   end0pos = 63;
+   for(; (end0pos>0)&&(DU[end0pos]==0); --end0pos) {
+   }
+   if(end0pos == 0) {
+      ++freqAC[0x00];
+      return DU[0];
+   }
+   for(i = 1; i <= end0pos; ++i) {
+      int startpos = i;
+      int nrzeroes;
+      for (; DU[i]==0 && i<=end0pos; ++i) {
+      }
+      nrzeroes = i-startpos;
+      freqAC[0xF0] += nrzeroes>>4;
+      nrzeroes &= 15;
+      stbiw__jpg_calcBits(DU[i], bits);
+      ++freqAC[(nrzeroes<<4)+bits[1]];
+   }
+   if(end0pos != 63) {
+      ++freqAC[0x00];
+   }
+   return DU[0];
+}
+
+// a huffman table as written to DHT (nrcodes[1..16], values) plus its codes
+typedef struct
+{
+   unsigned char nrcodes[17];
+   unsigned char values[256];
+   int nvalues;
+   unsigned short codes[256][2];
+} stbiw__jpg_huff;
+
+// optimal code lengths limited to 16 bits, as in Annex K.2 / K.3 (and libjpeg)
+static void stbiw__jpg_build_huff(stbiw__jpg_huff *h, const unsigned int freq_in[256]) {
+   unsigned int freq[257];
+   int codesize[257], others[257], bits[33];
+   int i, j, k, c1, c2, code;
+
+   memset(bits, 0, sizeof(bits));
+   for(i = 0; i < 256; ++i) {
+      freq[i] = freq_in[i];
+      codesize[i] = 0;
+      others[i] = -1;
+   }
+   // reserve one code so that no real one is all 1 bits
+   freq[256] = 1;
+   codesize[256] = 0;
+   others[256] = -1;
+
+   for(;;) {
+      // the two least frequent symbols, ties go to the larger symbol
+      c1 = c2 = -1;
+      for(i = 0; i <= 256; ++i) {
+         if(freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+            c1 = i;
+      }
+      for(i = 0; i <= 256; ++i) {
+         if(freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+            c2 = i;
+      }
+      if(c2 < 0)
+         break;
+
+      // merge c2 into c1 and lengthen the codes of both subtrees
+      freq[c1] += freq[c2];
+      freq[c2] = 0;
+      ++codesize[c1];
+      while(others[c1] >= 0) {
+         c1 = others[c1];
+         ++codesize[c1];
+      }
+      others[c1] = c2;
+      ++codesize[c2];
+      while(others[c2] >= 0) {
+         c2 = others[c2];
+         ++codesize[c2];
+      }
+   }
+
+   for(i = 0; i <= 256; ++i) {
+      if(codesize[i])
+         ++bits[codesize[i]];
+   }
+
+   // move codes longer than 16 bits up the tree
+   for(i = 32; i > 16; --i) {
+      while(bits[i] > 0) {
+         j = i - 2;
+         while(bits[j] == 0)
+            --j;
+         bits[i] -= 2;
+         bits[i-1] += 1;
+         bits[j+1] += 2;
+         bits[j] -= 1;
+      }
+   }
+   // drop the reserved code
+   for(i = 16; bits[i] == 0; --i) {
+   }
+   --bits[i];
+
+   h->nrcodes[0] = 0;
+   for(i = 1; i <= 16; ++i)
+      h->nrcodes[i] = (unsigned char) bits[i];
+
+   // symbols by code length, then by value
+   h->nvalues = 0;
+   for(i = 1; i <= 32; ++i) {
+      for(k = 0; k < 256; ++k) {
+         if(codesize[k] == i)
+            h->values[h->nvalues++] = (unsigned char) k;
+      }
+   }
+
+   // canonical codes, Annex C
+   memset(h->codes, 0, sizeof(h->codes));
+   for(i = 1, k = 0, code = 0; i <= 16; ++i, code <<= 1) {
+      for(j = 0; j < h->nrcodes[i]; ++j, ++k, ++code) {
+         h->codes[h->values[k]][0] = (unsigned short) code;
+         h->codes[h->values[k]][1] = (unsigned short) i;
+      }
+   }
+}
+
+// Y DC, Y AC, UV DC, UV AC
+typedef struct
+{
+   const unsigned char *nrcodes;
+   const unsigned char *values;
+   int nvalues;
+   const unsigned short (*codes)[2];
+} stbiw__jpg_table;
+
+typedef struct
+{
+   int width, height, comp, stride, flip;
+   // chroma subsampling, also the luma sampling factors: 2x2 or 1x1 for rgb,
+   // any of 1 or 2 for planes
+   int hs, vs;
+   const unsigned char *data;
+   // planar YCbCr input (planes[0] == data), chroma planes are the luma size
+   // divided by chroma_x, chroma_y (1 or 2) rounded up
+   const unsigned char *planes[3];
+   int plane_stride[3], chroma_x, chroma_y;
+   unsigned char YTable[64], UVTable[64];
+   float fdtbl_Y[64], fdtbl_UV[64];
+   stbiw__jpg_kernels k;
+   stbiw__jpg_table ht[4];
+   stbiw__jpg_huff huff[4];
+} stbiw__jpg;
+
+static int stbiw__jpg_init(stbiw__jpg *j, int width, int height, int comp, const void* data, int stride, int quality) {
    // Constants that don't pollute global namespace
-   static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
-   static const unsigned char std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
-   static const unsigned char std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
-   static const unsigned char std_ac_luminance_values[] = {
-      0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
-      0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
-      0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
-      0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
-      0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
-      0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
-      0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-   };
-   static const unsigned char std_dc_chrominance_nrcodes[] = {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
-   static const unsigned char std_dc_chrominance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
-   static const unsigned char std_ac_chrominance_nrcodes[] = {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
-   static const unsigned char std_ac_chrominance_values[] = {
-      0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
-      0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
-      0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
-      0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
-      0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
-      0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
-      0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-   };
-   // Huffman tables
-   static const unsigned short YDC_HT[256][2] = { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9}};
-   static const unsigned short UVDC_HT[256][2] = { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9},{1022,10},{2046,11}};
-   static const unsigned short YAC_HT[256][2] = {
-      {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},{65410,16},{65411,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {12,4},{27,5},{121,7},{502,9},{2038,11},{65412,16},{65413,16},{65414,16},{65415,16},{65416,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {28,5},{249,8},{1015,10},{4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},{65422,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {58,6},{503,9},{4085,12},{65423,16},{65424,16},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {59,6},{1016,10},{65430,16},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {122,7},{2039,11},{65438,16},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {123,7},{4086,12},{65446,16},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {250,8},{4087,12},{65454,16},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {504,9},{32704,15},{65462,16},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {505,9},{65470,16},{65471,16},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {506,9},{65479,16},{65480,16},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1017,10},{65488,16},{65489,16},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1018,10},{65497,16},{65498,16},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2040,11},{65506,16},{65507,16},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {65515,16},{65516,16},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
-   };
-   static const unsigned short UVAC_HT[256][2] = {
-      {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
-   };
    static const int YQT[] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
                              37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
    static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
@@ -1467,134 +2667,478 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
    static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
                                  1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
 
-   int row, col, i, k, subsample;
-   float fdtbl_Y[64], fdtbl_UV[64];
-   unsigned char YTable[64], UVTable[64];
+   int row, col, i, k;
 
    if(!data || !width || !height || comp > 4 || comp < 1) {
       return 0;
    }
 
+   j->width = width;
+   j->height = height;
+   j->comp = comp;
+   j->stride = stride ? stride : width*comp;
+   j->flip = stbi__flip_vertically_on_write;
+   j->data = (const unsigned char *) data;
+   j->planes[0] = j->planes[1] = j->planes[2] = NULL;
+
    quality = quality ? quality : 90;
-   subsample = quality <= 90 ? 1 : 0;
+   j->hs = j->vs = quality <= 90 ? 2 : 1;
    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
 
    for(i = 0; i < 64; ++i) {
       int uvti, yti = (YQT[i]*quality+50)/100;
-      YTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (yti < 1 ? 1 : yti > 255 ? 255 : yti);
+      j->YTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (yti < 1 ? 1 : yti > 255 ? 255 : yti);
       uvti = (UVQT[i]*quality+50)/100;
-      UVTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+      j->UVTable[stbiw__jpg_ZigZag[i]] = (unsigned char) (uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
    }
 
    for(row = 0, k = 0; row < 8; ++row) {
       for(col = 0; col < 8; ++col, ++k) {
-         fdtbl_Y[k]  = 1 / (YTable [stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
-         fdtbl_UV[k] = 1 / (UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+         j->fdtbl_Y[k]  = 1 / (j->YTable [stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+         j->fdtbl_UV[k] = 1 / (j->UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
       }
    }
 
-   // Write Headers
+   j->ht[0].nrcodes = stbiw__jpg_std_dc_luminance_nrcodes;
+   j->ht[0].values = stbiw__jpg_std_dc_luminance_values;
+   j->ht[0].nvalues = sizeof(stbiw__jpg_std_dc_luminance_values);
+   j->ht[0].codes = stbiw__jpg_YDC_HT;
+   j->ht[1].nrcodes = stbiw__jpg_std_ac_luminance_nrcodes;
+   j->ht[1].values = stbiw__jpg_std_ac_luminance_values;
+   j->ht[1].nvalues = sizeof(stbiw__jpg_std_ac_luminance_values);
+   j->ht[1].codes = stbiw__jpg_YAC_HT;
+   j->ht[2].nrcodes = stbiw__jpg_std_dc_chrominance_nrcodes;
+   j->ht[2].values = stbiw__jpg_std_dc_chrominance_values;
+   j->ht[2].nvalues = sizeof(stbiw__jpg_std_dc_chrominance_values);
+   j->ht[2].codes = stbiw__jpg_UVDC_HT;
+   j->ht[3].nrcodes = stbiw__jpg_std_ac_chrominance_nrcodes;
+   j->ht[3].values = stbiw__jpg_std_ac_chrominance_values;
+   j->ht[3].nvalues = sizeof(stbiw__jpg_std_ac_chrominance_values);
+   j->ht[3].codes = stbiw__jpg_UVAC_HT;
+
+   stbiw__jpg_setup_kernels(&j->k);
+   return 1;
+}
+
+// stbiw__jpg_init for planar YCbCr. subsampled chroma is written as it is,
+// full resolution chroma is subsampled by quality like rgb
+static int stbiw__jpg_init_ycbcr(stbiw__jpg *j, int width, int height, const unsigned char *planes[3], const int strides[3], int chroma_x, int chroma_y, int quality) {
+   int i;
+   if(!planes[1] || !planes[2] || chroma_x < 1 || chroma_x > 2 || chroma_y < 1 || chroma_y > 2 ||
+      !stbiw__jpg_init(j, width, height, 3, planes[0], strides[0], quality)) {
+      return 0;
+   }
+   for(i = 0; i < 3; ++i) {
+      j->planes[i] = planes[i];
+      j->plane_stride[i] = strides[i] ? strides[i] : i ? (width + chroma_x - 1) / chroma_x : width;
+   }
+   j->chroma_x = chroma_x;
+   j->chroma_y = chroma_y;
+   if(chroma_x > 1 || chroma_y > 1) {
+      j->hs = chroma_x;
+      j->vs = chroma_y;
+   }
+   return 1;
+}
+
+// pixel rows per MCU row
+static int stbiw__jpg_mcu_size(const stbiw__jpg *j) {
+   return 8 * j->vs;
+}
+
+// pixel columns per MCU
+static int stbiw__jpg_mcu_width(const stbiw__jpg *j) {
+   return 8 * j->hs;
+}
+
+// blocks per MCU: hs*vs Y + U + V
+static int stbiw__jpg_mcu_blocks(const stbiw__jpg *j) {
+   return j->hs * j->vs + 2;
+}
+
+// number of blocks in MCU rows [mcu_y0, mcu_y1)
+static size_t stbiw__jpg_count_mcu_blocks(const stbiw__jpg *j, int mcu_y0, int mcu_y1) {
+   int mcu = stbiw__jpg_mcu_size(j), mcu_w = stbiw__jpg_mcu_width(j);
+   int mcu_rows = (j->height + mcu - 1) / mcu;
+   if (mcu_y1 > mcu_rows) mcu_y1 = mcu_rows;
+   if (mcu_y0 >= mcu_y1) return 0;
+   return (size_t) (mcu_y1 - mcu_y0) * ((j->width + mcu_w - 1) / mcu_w) * stbiw__jpg_mcu_blocks(j);
+}
+
+// replace the Annex K tables with ones built from symbol counts
+static void stbiw__jpg_optimize_tables(stbiw__jpg *j, unsigned int freq[4][256]) {
+   int i;
+   for(i = 0; i < 4; ++i) {
+      stbiw__jpg_build_huff(&j->huff[i], freq[i]);
+      j->ht[i].nrcodes = j->huff[i].nrcodes;
+      j->ht[i].values = j->huff[i].values;
+      j->ht[i].nvalues = j->huff[i].nvalues;
+      j->ht[i].codes = (const unsigned short (*)[2]) j->huff[i].codes;
+   }
+}
+
+// SOI up to and including SOS, with a DRI segment if restart_interval (in MCUs) isn't 0
+static void stbiw__jpg_write_headers(stbi__write_context *s, const stbiw__jpg *j, int restart_interval) {
+   static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
+   static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+   static const unsigned char htinfo[] = { 0x00, 0x10, 0x01, 0x11 }; // HTYDCinfo, HTYACinfo, HTUDCinfo, HTUACinfo
+   int i, dht_len = 2 + 4*17;
+   for(i = 0; i < 4; ++i)
+      dht_len += j->ht[i].nvalues;
    {
-      static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
-      static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
-      const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),
-                                      3,1,(unsigned char)(subsample?0x22:0x11),0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
-      s->func(s->context, (void*)head0, sizeof(head0));
-      s->func(s->context, (void*)YTable, sizeof(YTable));
+      const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(j->height>>8),STBIW_UCHAR(j->height),(unsigned char)(j->width>>8),STBIW_UCHAR(j->width),
+                                      3,1,(unsigned char)(j->hs<<4|j->vs),0,2,0x11,1,3,0x11,1,0xFF,0xC4,(unsigned char)(dht_len>>8),STBIW_UCHAR(dht_len) };
+      stbiw__write(s, head0, sizeof(head0));
+      stbiw__write(s, j->YTable, sizeof(j->YTable));
       stbiw__putc(s, 1);
-      s->func(s->context, UVTable, sizeof(UVTable));
-      s->func(s->context, (void*)head1, sizeof(head1));
-      s->func(s->context, (void*)(std_dc_luminance_nrcodes+1), sizeof(std_dc_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_luminance_values, sizeof(std_dc_luminance_values));
-      stbiw__putc(s, 0x10); // HTYACinfo
-      s->func(s->context, (void*)(std_ac_luminance_nrcodes+1), sizeof(std_ac_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_luminance_values, sizeof(std_ac_luminance_values));
-      stbiw__putc(s, 1); // HTUDCinfo
-      s->func(s->context, (void*)(std_dc_chrominance_nrcodes+1), sizeof(std_dc_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
-      stbiw__putc(s, 0x11); // HTUACinfo
-      s->func(s->context, (void*)(std_ac_chrominance_nrcodes+1), sizeof(std_ac_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
-      s->func(s->context, (void*)head2, sizeof(head2));
-   }
-
-   // Encode 8x8 macroblocks
-   {
-      static const unsigned short fillBits[] = {0x7F, 7};
-      int DCY=0, DCU=0, DCV=0;
-      int bitBuf=0, bitCnt=0;
-      // comp == 2 is grey+alpha (alpha is ignored)
-      int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
-      const unsigned char *dataR = (const unsigned char *)data;
-      const unsigned char *dataG = dataR + ofsG;
-      const unsigned char *dataB = dataR + ofsB;
-      int x, y, pos;
-      if(subsample) {
-         for(y = 0; y < height; y += 16) {
-            for(x = 0; x < width; x += 16) {
-               float Y[256], U[256], V[256];
-               for(row = y, pos = 0; row < y+16; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+16; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
-               }
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+0,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+8,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+128, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+136, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-
-               // subsample U,V
-               {
-                  float subU[64], subV[64];
-                  int yy, xx;
-                  for(yy = 0, pos = 0; yy < 8; ++yy) {
-                     for(xx = 0; xx < 8; ++xx, ++pos) {
-                        int j = yy*32+xx*2;
-                        subU[pos] = (U[j+0] + U[j+1] + U[j+16] + U[j+17]) * 0.25f;
-                        subV[pos] = (V[j+0] + V[j+1] + V[j+16] + V[j+17]) * 0.25f;
-                     }
-                  }
-                  DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subU, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-                  DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subV, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
-               }
+      stbiw__write(s, j->UVTable, sizeof(j->UVTable));
+      stbiw__write(s, head1, sizeof(head1));
+   }
+   for(i = 0; i < 4; ++i) {
+      stbiw__putc(s, htinfo[i]);
+      stbiw__write(s, j->ht[i].nrcodes+1, 16);
+      stbiw__write(s, j->ht[i].values, j->ht[i].nvalues);
+   }
+   if(restart_interval) {
+      const unsigned char dri[] = { 0xFF,0xDD,0,4,(unsigned char)(restart_interval>>8),STBIW_UCHAR(restart_interval) };
+      stbiw__write(s, dri, sizeof(dri));
+   }
+   stbiw__write(s, head2, sizeof(head2));
+}
+
+// w x h level shifted samples of plane `i` at (x, y) of the plane. samples
+// past the edge repeat the last row / column
+static void stbiw__jpg_load_plane(const stbiw__jpg *j, int i, int x, int y, int w, int h, float *out) {
+   int pw = i ? (j->width + j->chroma_x - 1) / j->chroma_x : j->width;
+   int ph = i ? (j->height + j->chroma_y - 1) / j->chroma_y : j->height;
+   int row, col;
+
+   for(row = y; row < y+h; ++row, out += w) {
+      int r = row < ph ? row : ph - 1;
+      const unsigned char *p = j->planes[i] + (size_t)(j->flip ? ph-1-r : r)*j->plane_stride[i];
+      for(col = x; col < x+w; ++col)
+         out[col-x] = p[col < pw ? col : pw - 1] - 128.0f;
+   }
+}
+
+// color convert, DCT and quantize the MCU at pixel (x, y) into stbiw__jpg_mcu_blocks() blocks
+static void stbiw__jpg_transform_mcu(const stbiw__jpg *j, int x, int y, short *DU) {
+   int width = j->width, height = j->height, comp = j->comp;
+   int mcu = stbiw__jpg_mcu_size(j), mcu_w = stbiw__jpg_mcu_width(j);
+   const stbiw__jpg_kernels *k = &j->k;
+   float Y[256], U[256], V[256], subU[64], subV[64];
+   float *u = U, *v = V;
+   int row, col, pos, b;
+
+   if(j->planes[0]) {
+      stbiw__jpg_load_plane(j, 0, x, y, mcu_w, mcu, Y);
+      if(j->hs == j->chroma_x && j->vs == j->chroma_y) {
+         // chroma planes already are the 8x8 chroma blocks of the MCU
+         stbiw__jpg_load_plane(j, 1, x/j->hs, y/j->vs, 8, 8, U);
+         stbiw__jpg_load_plane(j, 2, x/j->hs, y/j->vs, 8, 8, V);
+      } else {
+         stbiw__jpg_load_plane(j, 1, x, y, 16, 16, U);
+         stbiw__jpg_load_plane(j, 2, x, y, 16, 16, V);
+         k->subsample(subU, U);
+         k->subsample(subV, V);
+         u = subU;
+         v = subV;
+      }
+   } else {
+      for(row = y, pos = 0; row < y+mcu; ++row, pos += mcu) {
+         // row >= height => use last input row
+         int clamped_row = (row < height) ? row : height - 1;
+         const unsigned char *p = j->data + (size_t)(j->flip ? (height-1-clamped_row) : clamped_row)*j->stride;
+         if(x+mcu <= width) {
+            k->rgb_to_ycc(Y+pos, U+pos, V+pos, p + x*comp, mcu, comp);
+         } else {
+            for(col = x; col < x+mcu; ++col) {
+               // if col >= width => use pixel from last input column
+               stbiw__jpg_rgb_to_ycc(Y+pos+col-x, U+pos+col-x, V+pos+col-x, p + ((col < width) ? col : (width-1))*comp, 1, comp);
             }
          }
-      } else {
-         for(y = 0; y < height; y += 8) {
-            for(x = 0; x < width; x += 8) {
-               float Y[64], U[64], V[64];
-               for(row = y, pos = 0; row < y+8; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+8; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
-               }
+      }
+      if(j->hs > 1) {
+         // subsample U,V
+         k->subsample(subU, U);
+         k->subsample(subV, V);
+         u = subU;
+         v = subV;
+      }
+   }
 
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y,  DCY, YDC_HT, YAC_HT);
-               DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, U, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-               DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, V, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
-            }
+   for(b = 0; b < j->hs * j->vs; ++b)
+      k->fdct_quant(Y + (b / j->hs)*8*mcu_w + (b % j->hs)*8, mcu_w, j->fdtbl_Y, DU + b*64);
+   k->fdct_quant(u, 8, j->fdtbl_UV, DU + b*64);
+   k->fdct_quant(v, 8, j->fdtbl_UV, DU + b*64+64);
+}
+
+// entropy code whole MCUs worth of blocks. DC prediction starts from 0 and
+// the last byte is padded, so a call is one restart interval
+static void stbiw__jpg_write_blocks(stbi__write_context *s, const stbiw__jpg *j, const short *DU, size_t nblocks) {
+   static const unsigned short fillBits[] = {0x7F, 7};
+   int DC[3] = { 0, 0, 0 };
+   unsigned int bitBuf=0;
+   int bitCnt=0;
+   int b, n = stbiw__jpg_mcu_blocks(j);
+   size_t i;
+
+   for(i = 0; i < nblocks; i += n) {
+      for(b = 0; b < n; ++b, DU += 64) {
+         // the last two blocks of an MCU are U and V
+         int c = b < n-2 ? 0 : b - (n-3);
+         DC[c] = stbiw__jpg_encode_block(s, &bitBuf, &bitCnt, DU, DC[c], j->ht[c ? 2 : 0].codes, j->ht[c ? 3 : 1].codes);
+      }
+   }
+
+   // Do the bit alignment of the EOI (or RSTn) marker
+   stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+}
+
+// symbol counts of one restart interval for stbiw__jpg_optimize_tables
+static void stbiw__jpg_count_blocks(const stbiw__jpg *j, const short *DU, size_t nblocks, unsigned int freq[4][256]) {
+   int DC[3] = { 0, 0, 0 };
+   int b, n = stbiw__jpg_mcu_blocks(j);
+   size_t i;
+
+   for(i = 0; i < nblocks; i += n) {
+      for(b = 0; b < n; ++b, DU += 64) {
+         int c = b < n-2 ? 0 : b - (n-3);
+         DC[c] = stbiw__jpg_count_block(DU, DC[c], freq[c ? 2 : 0], freq[c ? 3 : 1]);
+      }
+   }
+}
+
+// quantized blocks of MCU rows [mcu_y0, mcu_y1), stbiw__jpg_count_mcu_blocks() of them
+static void stbiw__jpg_transform_mcu_rows(const stbiw__jpg *j, int mcu_y0, int mcu_y1, short *DU) {
+   int mcu = stbiw__jpg_mcu_size(j), mcu_w = stbiw__jpg_mcu_width(j), n = stbiw__jpg_mcu_blocks(j);
+   int x, y;
+   for(y = mcu_y0*mcu; y < j->height && y < mcu_y1*mcu; y += mcu) {
+      for(x = 0; x < j->width; x += mcu_w, DU += n*64) {
+         stbiw__jpg_transform_mcu(j, x, y, DU);
+      }
+   }
+}
+
+// single pass version of transform + write for MCU rows [mcu_y0, mcu_y1)
+static void stbiw__jpg_write_mcu_rows(stbi__write_context *s, const stbiw__jpg *j, int mcu_y0, int mcu_y1) {
+   static const unsigned short fillBits[] = {0x7F, 7};
+   int DC[3] = { 0, 0, 0 };
+   unsigned int bitBuf=0;
+   int bitCnt=0;
+   int mcu = stbiw__jpg_mcu_size(j), mcu_w = stbiw__jpg_mcu_width(j), n = stbiw__jpg_mcu_blocks(j);
+   int x, y, b;
+   short DU[6*64];
+
+   for(y = mcu_y0*mcu; y < j->height && y < mcu_y1*mcu; y += mcu) {
+      for(x = 0; x < j->width; x += mcu_w) {
+         stbiw__jpg_transform_mcu(j, x, y, DU);
+         for(b = 0; b < n; ++b) {
+            int c = b < n-2 ? 0 : b - (n-3);
+            DC[c] = stbiw__jpg_encode_block(s, &bitBuf, &bitCnt, DU + b*64, DC[c], j->ht[c ? 2 : 0].codes, j->ht[c ? 3 : 1].codes);
          }
       }
+   }
+
+   // Do the bit alignment of the EOI (or RSTn) marker
+   stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+}
 
-      // Do the bit alignment of the EOI marker
+// a jpg as quantized DCT coefficients, for lossless transforms. each
+// component has whole MCUs of 8x8 blocks in natural order, coeff_w per row.
+// a single component is not interleaved, so it has to be h = v = 1
+typedef struct
+{
+   int width, height, ncomp;
+   int jfif;  // write a JFIF APP0
+   int adobe; // Adobe APP14 color transform, -1 for none
+   int id[4], h[4], v[4], tq[4];
+   const short *coeff[4];
+   int coeff_w[4];
+   unsigned short quant[4][64]; // natural order
+} stbiw__jpg_coeffs;
+
+// the blocks of every MCU in scan order, through count_block (freq != NULL) or encode_block
+static void stbiw__jpg_coeff_blocks(stbi__write_context *s, const stbiw__jpg_coeffs *c, int mcu_x, int mcu_y,
+                                    unsigned int freq[4][256], stbiw__jpg_huff huff[4]) {
+   static const unsigned short fillBits[] = {0x7F, 7};
+   unsigned int bitBuf=0;
+   int bitCnt=0;
+   int DC[4] = { 0, 0, 0, 0 };
+   short DU[64];
+   int i, j, k, x, y, n;
+
+   for(j = 0; j < mcu_y; ++j) {
+      for(i = 0; i < mcu_x; ++i) {
+         for(n = 0; n < c->ncomp; ++n) {
+            int t = n ? 2 : 0;
+            for(y = 0; y < c->v[n]; ++y) {
+               for(x = 0; x < c->h[n]; ++x) {
+                  const short *b = c->coeff[n] + 64 * ((size_t)(j*c->v[n] + y) * c->coeff_w[n] + i*c->h[n] + x);
+                  for(k = 0; k < 64; ++k)
+                     DU[stbiw__jpg_ZigZag[k]] = b[k];
+                  if(freq)
+                     DC[n] = stbiw__jpg_count_block(DU, DC[n], freq[t], freq[t+1]);
+                  else
+                     DC[n] = stbiw__jpg_encode_block(s, &bitBuf, &bitCnt, DU, DC[n], (const unsigned short (*)[2]) huff[t].codes,
+                                                     (const unsigned short (*)[2]) huff[t+1].codes);
+               }
+            }
+         }
+      }
+   }
+   if(!freq)
       stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+}
+
+// one baseline scan with huffman tables built for it (a second table set
+// for all components after the first), the original quantization tables
+static int stbiw__jpg_write_coeffs(stbi__write_context *s, const stbiw__jpg_coeffs *c) {
+   static const unsigned char jfif[] = { 0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0 };
+   static const unsigned char adobe[] = { 0xFF,0xEE,0,0xE,'A','d','o','b','e',0,100,0,0,0,0 };
+   unsigned int freq[4][256];
+   stbiw__jpg_huff *huff;
+   int h_max = 1, v_max = 1, mcu_x, mcu_y, tables, wide = 0, used = 0;
+   int i, k;
+
+   if(c->ncomp < 1 || c->ncomp > 4 || c->width < 1 || c->height < 1 || c->width > 65535 || c->height > 65535 ||
+      (c->ncomp == 1 && (c->h[0] != 1 || c->v[0] != 1)))
+      return 0;
+   for(i = 0; i < c->ncomp; ++i) {
+      h_max = c->h[i] > h_max ? c->h[i] : h_max;
+      v_max = c->v[i] > v_max ? c->v[i] : v_max;
+      used |= 1 << c->tq[i];
+   }
+   mcu_x = (c->width + 8*h_max - 1) / (8*h_max);
+   mcu_y = (c->height + 8*v_max - 1) / (8*v_max);
+   tables = c->ncomp > 1 ? 4 : 2;
+
+   huff = (stbiw__jpg_huff *) STBIW_MALLOC(4 * sizeof(stbiw__jpg_huff));
+   if(!huff)
+      return 0;
+   memset(freq, 0, sizeof(freq));
+   stbiw__jpg_coeff_blocks(s, c, mcu_x, mcu_y, freq, huff);
+   for(i = 0; i < tables; ++i)
+      stbiw__jpg_build_huff(&huff[i], freq[i]);
+
+   stbiw__putc(s, 0xFF);
+   stbiw__putc(s, 0xD8);
+   if(c->jfif)
+      stbiw__write(s, jfif, sizeof(jfif));
+   if(c->adobe >= 0) {
+      stbiw__write(s, adobe, sizeof(adobe));
+      stbiw__putc(s, (unsigned char) c->adobe);
+   }
+
+   // DQT, 16 bit entries only when needed (which makes it an extended jpg)
+   for(i = 0; i < 4; ++i) {
+      unsigned char zz[128];
+      int sixteen = 0;
+      if(!(used & (1 << i)))
+         continue;
+      for(k = 0; k < 64; ++k)
+         sixteen |= c->quant[i][k] > 255;
+      for(k = 0; k < 64; ++k) {
+         int z = stbiw__jpg_ZigZag[k];
+         if(sixteen) {
+            zz[2*z] = (unsigned char) (c->quant[i][k] >> 8);
+            zz[2*z+1] = STBIW_UCHAR(c->quant[i][k]);
+         } else {
+            zz[z] = STBIW_UCHAR(c->quant[i][k]);
+         }
+      }
+      wide |= sixteen;
+      stbiw__putc(s, 0xFF);
+      stbiw__putc(s, 0xDB);
+      stbiw__putc(s, 0);
+      stbiw__putc(s, (unsigned char) (3 + 64 * (1 + sixteen)));
+      stbiw__putc(s, (unsigned char) (sixteen << 4 | i));
+      stbiw__write(s, zz, 64 * (1 + sixteen));
+   }
+
+   // SOF0 (SOF1 with 16 bit tables)
+   stbiw__putc(s, 0xFF);
+   stbiw__putc(s, wide ? 0xC1 : 0xC0);
+   stbiw__putc(s, 0);
+   stbiw__putc(s, (unsigned char) (8 + 3*c->ncomp));
+   stbiw__putc(s, 8);
+   stbiw__putc(s, (unsigned char) (c->height >> 8));
+   stbiw__putc(s, STBIW_UCHAR(c->height));
+   stbiw__putc(s, (unsigned char) (c->width >> 8));
+   stbiw__putc(s, STBIW_UCHAR(c->width));
+   stbiw__putc(s, (unsigned char) c->ncomp);
+   for(i = 0; i < c->ncomp; ++i) {
+      stbiw__putc(s, (unsigned char) c->id[i]);
+      stbiw__putc(s, (unsigned char) (c->h[i] << 4 | c->v[i]));
+      stbiw__putc(s, (unsigned char) c->tq[i]);
+   }
+
+   // DHT: Y DC, Y AC, then the same for the other components
+   for(i = 0; i < tables; ++i) {
+      int len = 2 + 17 + huff[i].nvalues;
+      stbiw__putc(s, 0xFF);
+      stbiw__putc(s, 0xC4);
+      stbiw__putc(s, (unsigned char) (len >> 8));
+      stbiw__putc(s, STBIW_UCHAR(len));
+      stbiw__putc(s, (unsigned char) ((i & 1) << 4 | i >> 1));
+      stbiw__write(s, huff[i].nrcodes+1, 16);
+      stbiw__write(s, huff[i].values, huff[i].nvalues);
+   }
+
+   // SOS
+   stbiw__putc(s, 0xFF);
+   stbiw__putc(s, 0xDA);
+   stbiw__putc(s, 0);
+   stbiw__putc(s, (unsigned char) (6 + 2*c->ncomp));
+   stbiw__putc(s, (unsigned char) c->ncomp);
+   for(i = 0; i < c->ncomp; ++i) {
+      stbiw__putc(s, (unsigned char) c->id[i]);
+      stbiw__putc(s, i ? 0x11 : 0x00);
+   }
+   stbiw__putc(s, 0);
+   stbiw__putc(s, 0x3F);
+   stbiw__putc(s, 0);
+
+   stbiw__jpg_coeff_blocks(s, c, mcu_x, mcu_y, NULL, huff);
+
+   // EOI
+   stbiw__putc(s, 0xFF);
+   stbiw__putc(s, 0xD9);
+   STBIW_FREE(huff);
+   return 1;
+}
+
+static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+   stbiw__jpg j;
+   int mcu, mcu_rows;
+   short *DU = NULL;
+
+   if(!stbiw__jpg_init(&j, width, height, comp, data, 0, quality)) {
+      return 0;
+   }
+   mcu = stbiw__jpg_mcu_size(&j);
+   mcu_rows = (height + mcu - 1) / mcu;
+
+   // two passes: keep every quantized block, count symbols, build tables, then write
+   if(stbi_write_jpg_optimize_huffman) {
+      size_t nblocks = stbiw__jpg_count_mcu_blocks(&j, 0, mcu_rows);
+      DU = (short *) STBIW_MALLOC(nblocks * 64 * sizeof(short));
+      if(DU) {
+         unsigned int freq[4][256];
+         memset(freq, 0, sizeof(freq));
+         stbiw__jpg_transform_mcu_rows(&j, 0, mcu_rows, DU);
+         stbiw__jpg_count_blocks(&j, DU, nblocks, freq);
+         stbiw__jpg_optimize_tables(&j, freq);
+         stbiw__jpg_write_headers(s, &j, 0);
+         stbiw__jpg_write_blocks(s, &j, DU, nblocks);
+         STBIW_FREE(DU);
+      }
+   }
+   // single pass with the standard tables (also if the blocks didn't fit in memory)
+   if(!DU) {
+      stbiw__jpg_write_headers(s, &j, 0);
+      stbiw__jpg_write_mcu_rows(s, &j, 0, mcu_rows);
    }
 
    // EOI
@@ -1607,8 +3151,11 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
 {
    stbi__write_context s = { 0 };
+   int r;
    stbi__start_write_callbacks(&s, func, context);
-   return stbi_write_jpg_core(&s, x, y, comp, (void *) data, quality);
+   r = stbi_write_jpg_core(&s, x, y, comp, (void *) data, quality);
+   stbi__end_write_callbacks(&s);
+   return r;
 }
 
 
@@ -16,6 +16,8 @@ typedef struct {
 typedef struct {
   int width, height, channels;
   u8 *pixels;
+  // bytes from the start of one row to the next, 0 means width * channels
+  size_t stride;
 } tim_img;
 
 typedef enum {
@@ -26,20 +28,372 @@ typedef enum {
   // invalid arguments (possibly null) were passed to function
   TIM_ERR_ARG,
   // the underlying library failed with arbitrary error
-  TIM_ERR_INTERNAL
+  TIM_ERR_INTERNAL,
+  // nothing left to read (e.g. after the last frame of an animation)
+  TIM_ERR_END
 } tim_err;
 
 typedef enum { TIM_FILTER_GRAYSCALE } tim_filter;
 
+typedef enum {
+  // guess from the file extension, falls back to jpg
+  TIM_FORMAT_AUTO,
+  TIM_FORMAT_JPG,
+  TIM_FORMAT_PNG,
+  TIM_FORMAT_BMP,
+  TIM_FORMAT_TGA,
+  // lossless and single pass, a lot faster than png for passing images around
+  TIM_FORMAT_QOI,
+  // uncompressed pgm, ppm or pam by channel count, what netpbm tools read
+  TIM_FORMAT_PNM
+} tim_format;
+
+typedef enum {
+  // let the encoder try every filter on each row
+  TIM_PNG_FILTER_AUTO,
+  TIM_PNG_FILTER_NONE,
+  TIM_PNG_FILTER_SUB,
+  TIM_PNG_FILTER_UP,
+  TIM_PNG_FILTER_AVG,
+  TIM_PNG_FILTER_PAETH,
+  // only try none and paeth on each row, a lot cheaper than auto
+  TIM_PNG_FILTER_FAST
+} tim_png_filter;
+
+// planar YCbCr, full range BT.601 as in jpg. cb and cr are the size of y
+// divided by chroma_x and chroma_y (1 or 2), rounded up
+typedef struct {
+  tim_img y, cb, cr;
+  int chroma_x, chroma_y;
+} tim_ycbcr;
+
+// decode settings, a zeroed struct (or NULL) gives the defaults
+typedef struct {
+  // channels to decode into (1..4), 0 keeps whatever the file has
+  int channels;
+  // store the bottom row first
+  int flip_vertically;
+  // threads for decoding large images, 0 is one per cpu. jpgs convert their
+  // colors in bands of rows, in memory ones with restart markers also
+  // decode their intervals in parallel
+  int threads;
+} tim_read_opts;
+
+// encode settings, a zeroed struct (or NULL) gives the defaults
+typedef struct {
+  // TIM_FORMAT_AUTO guesses from the file name (jpg for memory writes)
+  tim_format format;
+  // jpg quality 1..100, 0 means 100
+  int quality;
+  // build huffman tables for the image instead of the standard ones, jpgs
+  // get a few percent smaller for a second pass over the quantized image
+  int jpg_optimize_huffman;
+  // png deflate effort 5 (fastest) to 11 (smallest), 0 means stb's default (8)
+  int png_compression_level;
+  tim_png_filter png_filter;
+  // write uncompressed tga instead of rle
+  int tga_raw;
+  // write the bottom row first
+  int flip_vertically;
+  // threads for encoding large images, 0 is one per cpu. when that is more
+  // than 1, large jpgs get restart markers so that their stripes encode in
+  // parallel
+  int threads;
+} tim_write_opts;
+
+// lossless jpg transforms, see tim_file_transform()
+typedef enum {
+  TIM_TRANSFORM_NONE,
+  // mirror left to right
+  TIM_TRANSFORM_FLIP_H,
+  // mirror top to bottom
+  TIM_TRANSFORM_FLIP_V,
+  // clockwise
+  TIM_TRANSFORM_ROT_90,
+  TIM_TRANSFORM_ROT_180,
+  TIM_TRANSFORM_ROT_270,
+  // mirror across the top left to bottom right diagonal
+  TIM_TRANSFORM_TRANSPOSE,
+  // mirror across the top right to bottom left diagonal
+  TIM_TRANSFORM_TRANSVERSE
+} tim_transform;
+
+// lossless transform settings, a zeroed struct (or NULL) copies the image
+typedef struct {
+  tim_transform transform;
+  // keep crop_w x crop_h pixels at (crop_x, crop_y) of the transformed image,
+  // 0 keeps all of it. the corner moves up and left onto the MCU grid (8 or
+  // 16 pixels) and the size grows by as much
+  int crop_x, crop_y, crop_w, crop_h;
+} tim_transform_opts;
+
+// every function below is safe to call from several threads at once as long
+// as they don't share a tim_img. nothing is configured through globals.
+
 /** init a new empty 8bpc image */
 tim_err tim_init(tim_img *im, size_t width, size_t height, size_t channels);
 
 /** read image from file */
 tim_err tim_file_read(tim_img *im, const char *file);
 
-/** write image to a file */
+/** read image from file with explicit settings (NULL for defaults) */
+tim_err tim_file_read_ex(tim_img *im, const char *file,
+                         const tim_read_opts *opts);
+
+/** decode an image file that is already in memory */
+tim_err tim_mem_read(tim_img *im, const u8 *data, size_t len);
+
+/** decode an in-memory image file with explicit settings */
+tim_err tim_mem_read_ex(tim_img *im, const u8 *data, size_t len,
+                        const tim_read_opts *opts);
+
+/** get the size and channel count of an image file without decoding it */
+tim_err tim_file_info(const char *file, int *width, int *height,
+                      int *channels);
+
+/**
+ * decode straight into a buffer owned by the caller (pooled, huge pages,
+ * gpu staging...). `im` describes the buffer: pixels, stride, channels to
+ * decode into and the capacity in width/height. on success width and height
+ * hold the decoded size. `opts->channels` is ignored. never tim_free() it.
+ */
+tim_err tim_file_read_into(tim_img *im, const char *file,
+                           const tim_read_opts *opts);
+
+/** tim_file_read_into for a file that is already in memory */
+tim_err tim_mem_read_into(tim_img *im, const u8 *data, size_t len,
+                          const tim_read_opts *opts);
+
+/**
+ * decode only the `w` x `h` pixels at (`x`, `y`), which must lie inside the
+ * image (TIM_ERR_ARG otherwise). jpgs skip the idct, upsampling and color
+ * conversion outside of it and stop reading below it, other formats are
+ * decoded whole and cropped.
+ */
+tim_err tim_file_read_region(tim_img *im, const char *file, int x, int y,
+                             int w, int h, const tim_read_opts *opts);
+
+/**
+ * tim_file_read_region for a file that is already in memory. jpgs with
+ * restart markers also skip the huffman decoding of intervals above it
+ */
+tim_err tim_mem_read_region(tim_img *im, const u8 *data, size_t len, int x,
+                            int y, int w, int h, const tim_read_opts *opts);
+
+/**
+ * decode at 1/8 of the size (rounded up) for thumbnails. jpgs only decode
+ * the DC coefficient of each block, progressive ones stop reading after their
+ * first DC scan. other formats are decoded whole and box filtered
+ */
+tim_err tim_file_read_preview(tim_img *im, const char *file,
+                              const tim_read_opts *opts);
+
+/** tim_file_read_preview for a file that is already in memory */
+tim_err tim_mem_read_preview(tim_img *im, const u8 *data, size_t len,
+                             const tim_read_opts *opts);
+
+/**
+ * decode the thumbnail a camera stored in the Exif (or JFXX) header of a jpg,
+ * without reading the image itself. files without one get
+ * tim_file_read_preview()
+ */
+tim_err tim_file_read_thumbnail(tim_img *im, const char *file,
+                                const tim_read_opts *opts);
+
+/** tim_file_read_thumbnail for a file that is already in memory */
+tim_err tim_mem_read_thumbnail(tim_img *im, const u8 *data, size_t len,
+                               const tim_read_opts *opts);
+
+/**
+ * decode into YCbCr planes. jpgs stop before upsampling and color conversion
+ * and keep their chroma subsampling, other files are converted to 4:4:4.
+ * `opts->channels` is ignored. free with tim_ycbcr_free()
+ */
+tim_err tim_file_read_ycbcr(tim_ycbcr *im, const char *file,
+                            const tim_read_opts *opts);
+
+/** tim_file_read_ycbcr for a file that is already in memory */
+tim_err tim_mem_read_ycbcr(tim_ycbcr *im, const u8 *data, size_t len,
+                           const tim_read_opts *opts);
+
+/** tim_resize every plane, the chroma planes keep their subsampling */
+tim_err tim_ycbcr_resize(tim_ycbcr *im, tim_ycbcr *dst, size_t new_width,
+                         size_t new_height);
+
+/**
+ * encode planes as a jpg without going through rgb, 4:2:0 chroma is used as
+ * is. the format (if any) has to be jpg
+ */
+tim_err tim_file_write_ycbcr(tim_ycbcr *im, const char *file,
+                             const tim_write_opts *opts);
+
+/** tim_file_write_ycbcr into a new buffer, free `*out` with free() */
+tim_err tim_mem_write_ycbcr(tim_ycbcr *im, u8 **out, size_t *out_len,
+                            const tim_write_opts *opts);
+
+/** free the planes */
+tim_err tim_ycbcr_free(tim_ycbcr *im);
+
+/**
+ * rotate, flip and/or crop a jpg without decoding it to pixels: its DCT
+ * blocks are moved around and entropy coded again, so nothing is lost and it
+ * is a lot faster than decode + encode. partial MCUs at the right or bottom
+ * edge that would have to move to the left or top are dropped (jpegtran's
+ * -trim). markers other than JFIF and Adobe are not copied. `dst` may be `src`
+ */
+tim_err tim_file_transform(const char *src, const char *dst,
+                           const tim_transform_opts *opts);
+
+/** tim_file_transform in memory, free `*out` with free() */
+tim_err tim_mem_transform(const u8 *data, size_t len, u8 **out,
+                          size_t *out_len, const tim_transform_opts *opts);
+
+/** write image to a file, the format is picked from the file extension */
 tim_err tim_file_write(tim_img *im, const char *file);
 
+/** write image to a file with explicit settings (NULL for defaults) */
+tim_err tim_file_write_ex(tim_img *im, const char *file,
+                          const tim_write_opts *opts);
+
+/** encode image into a newly allocated buffer. free `*out` with free() */
+tim_err tim_mem_write(tim_img *im, tim_format fmt, u8 **out, size_t *out_len);
+
+/** encode image into a newly allocated buffer with explicit settings */
+tim_err tim_mem_write_ex(tim_img *im, u8 **out, size_t *out_len,
+                         const tim_write_opts *opts);
+
+/** human readable reason of the last failure on the calling thread */
+const char *tim_last_error_detail(void);
+
+/** guess the output format from a file name (jpg when unknown) */
+tim_format tim_format_from_path(const char *file);
+
+// animations are decoded one frame at a time (gif only for now), so memory
+// stays the same for 5 or 500 frames. each frame is the fully composed canvas.
+typedef struct tim_anim tim_anim;
+
+/** open an animated image for tim_anim_next() */
+tim_err tim_anim_open(tim_anim **anim, const char *file,
+                      const tim_read_opts *opts);
+
+/** tim_anim_open for a file in memory, `data` must outlive the animation */
+tim_err tim_anim_open_mem(tim_anim **anim, const u8 *data, size_t len,
+                          const tim_read_opts *opts);
+
+/**
+ * decode the next frame into `frame` and its display time into `delay_ms`
+ * (may be NULL). returns TIM_ERR_END after the last frame. the pixels belong
+ * to `anim` and are overwritten by the next call, never tim_free() them.
+ */
+tim_err tim_anim_next(tim_anim *anim, tim_img *frame, int *delay_ms);
+
+/** close the file and free every frame buffer */
+tim_err tim_anim_close(tim_anim *anim);
+
+// background file i/o for batch jobs. input files are read into memory ahead
+// of time and encoded outputs are written out while the caller moves on.
+// uses io_uring when built with TIM_IO_URING (and the kernel supports it),
+// otherwise a small pool of threads.
+typedef struct tim_io tim_io;
+
+/** start an i/o queue with `workers` threads (0 picks a default) */
+tim_err tim_io_open(tim_io **io, size_t workers);
+
+/** start reading `file` into memory in the background */
+tim_err tim_io_prefetch(tim_io *io, const char *file);
+
+/** decode `file`, waiting for its prefetch. reads it now if never queued */
+tim_err tim_io_read(tim_io *io, tim_img *im, const char *file);
+
+/** encode `im` now and write the result to `file` in the background */
+tim_err tim_io_write(tim_io *io, tim_img *im, const char *file);
+
+/** wait for queued writes, returns the first write error since last flush */
+tim_err tim_io_flush(tim_io *io);
+
+/** flush, stop the workers and free the queue */
+tim_err tim_io_close(tim_io *io);
+
+// tim raw files hold the pixels as they are in memory after a page sized
+// header. plain ones are mapped straight into a tim_img, no decoding or
+// copying at all. tiled ones cut the image into squares, each optionally lz4
+// compressed, and are decoded tile by tile in parallel
+typedef struct {
+  // tile width and height up to 4096, 0 writes plain rows that can be mapped
+  int tile_size;
+  // lz4 compress every tile, needs tile_size
+  int lz4;
+  // threads for compressing tiles, 0 is one per cpu
+  int threads;
+} tim_raw_opts;
+
+/** write `im` as a tim raw file, NULL opts writes plain rows */
+tim_err tim_raw_write(tim_img *im, const char *file, const tim_raw_opts *opts);
+
+/** read any tim raw file into a new image, only opts->threads is used */
+tim_err tim_raw_read(tim_img *im, const char *file, const tim_read_opts *opts);
+
+/**
+ * map a plain tim raw file as `im` without reading it, files with bytes past
+ * their pixels are refused. writes to the pixels stay private to the process.
+ * release with tim_raw_unmap(), not tim_free()
+ */
+tim_err tim_raw_map(tim_img *im, const char *file);
+
+/** release an image from tim_raw_map() */
+tim_err tim_raw_unmap(tim_img *im);
+
+// decoded images kept in memory for files that are read over and over. an
+// entry is found by path and decode settings and is used as long as the
+// file's size and mtime haven't changed. the least recently used ones go
+// once the pixels take more than the byte budget. safe to share between
+// threads
+typedef struct tim_cache tim_cache;
+
+typedef enum {
+  // tim_file_read_ex()
+  TIM_CACHE_FULL,
+  // tim_file_read_preview()
+  TIM_CACHE_PREVIEW,
+  // tim_file_read_thumbnail()
+  TIM_CACHE_THUMBNAIL
+} tim_cache_decode;
+
+typedef struct {
+  // reads answered from memory and reads that had to decode
+  size_t hits, misses;
+  // entries pushed out by the budget
+  size_t evictions;
+  // images and pixel bytes held right now
+  size_t entries, bytes;
+} tim_cache_stats;
+
+/** start a cache holding up to `max_bytes` of pixels (0 picks 256 MiB) */
+tim_err tim_cache_open(tim_cache **cache, size_t max_bytes);
+
+/**
+ * point `im` at the decoded `file`, decoding it only if it isn't cached.
+ * the image is shared and must not be changed. only opts->threads doesn't
+ * count towards the key. give it back with tim_cache_release()
+ */
+tim_err tim_cache_read(tim_cache *cache, const tim_img **im, const char *file,
+                       tim_cache_decode decode, const tim_read_opts *opts);
+
+/**
+ * release an image from tim_cache_read() exactly once, evicted ones are freed
+ * here. a second release of the same handle is undefined
+ */
+tim_err tim_cache_release(tim_cache *cache, const tim_img *im);
+
+/** counters since tim_cache_open() */
+tim_err tim_cache_get_stats(tim_cache *cache, tim_cache_stats *stats);
+
+/** drop every entry, images still in use live on until released */
+tim_err tim_cache_clear(tim_cache *cache);
+
+/** clear and free the cache, fails while images are not released yet */
+tim_err tim_cache_close(tim_cache *cache);
+
 /** resize an image to the given dimensions */
 tim_err tim_resize(tim_img *im, tim_img *dst, size_t new_width,
                    size_t new_height);
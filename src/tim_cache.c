@@ -0,0 +1,385 @@
+// C99
+#define _POSIX_C_SOURCE 200809L // pthreads, stat, st_mtim
+#include <stddef.h> // NULL
+#include <stdlib.h> // malloc, calloc, free
+#include <string.h> // strcmp, strlen, strcpy
+#include <sys/stat.h> // stat
+
+#include "tim.h" // Tiny Image Manipulation
+#include "tim_internal.h"
+
+#define TIM_CACHE_DEFAULT_BYTES ((size_t)256 << 20)
+// the table doubles whenever there are more entries than buckets
+#define TIM_CACHE_MIN_BUCKETS 64
+
+typedef struct tim_cache_entry {
+  // handles point here, so it has to stay first
+  tim_img im;
+  // what was asked for
+  char *path;
+  tim_cache_decode decode;
+  int channels, flip_vertically;
+  unsigned hash;
+  // which version of the file it was decoded from
+  long long size, mtime_ns;
+  size_t bytes;
+  // handles given out and not released yet
+  size_t refs;
+  // 0 once evicted or stale, it is then freed with its last handle
+  int cached;
+  struct tim_cache_entry *next;             // hash chain
+  struct tim_cache_entry *newer, *older;    // lru list
+} tim_cache_entry;
+
+struct tim_cache {
+#if TIM_THREADS
+  pthread_mutex_t lock;
+#endif
+  tim_cache_entry **buckets;
+  size_t nbuckets;
+  tim_cache_entry *newest, *oldest;
+  size_t max_bytes;
+  // handles given out and not released yet, evicted entries included
+  size_t handles;
+  tim_cache_stats stats;
+};
+
+static const tim_read_opts tim_default_cache_read_opts = {0};
+
+static void tim_cache_lock(tim_cache *c) {
+#if TIM_THREADS
+  pthread_mutex_lock(&c->lock);
+#else
+  (void)c;
+#endif
+}
+
+static void tim_cache_unlock(tim_cache *c) {
+#if TIM_THREADS
+  pthread_mutex_unlock(&c->lock);
+#else
+  (void)c;
+#endif
+}
+
+// fnv-1a over the path and the decode settings, the file version is compared
+// separately so that a changed file finds (and drops) its stale entry
+static unsigned tim_cache_hash(const char *path, tim_cache_decode decode,
+                               int channels, int flip) {
+  unsigned h = 2166136261u;
+  for (; *path != '\0'; ++path)
+    h = (h ^ (u8)*path) * 16777619u;
+  h = (h ^ (unsigned)decode) * 16777619u;
+  h = (h ^ (unsigned)channels) * 16777619u;
+  return (h ^ (unsigned)flip) * 16777619u;
+}
+
+static tim_err tim_cache_stat(const char *file, long long *size,
+                              long long *mtime_ns) {
+  struct stat st;
+
+  if (stat(file, &st) != 0)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't stat");
+  *size = (long long)st.st_size;
+  *mtime_ns = (long long)st.st_mtime * 1000000000;
+#if defined(__APPLE__)
+  *mtime_ns += st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+  *mtime_ns += st.st_mtim.tv_nsec;
+#endif
+  return TIM_ERR_OK;
+}
+
+static void tim_cache_entry_free(tim_cache_entry *e) {
+  tim_free(&e->im);
+  free(e->path);
+  free(e);
+}
+
+// must be called with the lock held
+static tim_cache_entry *tim_cache_find(tim_cache *c, unsigned hash,
+                                       const char *path,
+                                       tim_cache_decode decode, int channels,
+                                       int flip) {
+  tim_cache_entry *e = c->buckets[hash & (c->nbuckets - 1)];
+  for (; e != NULL; e = e->next)
+    if (e->hash == hash && e->decode == decode && e->channels == channels &&
+        e->flip_vertically == flip && strcmp(e->path, path) == 0)
+      return e;
+  return NULL;
+}
+
+// must be called with the lock held
+static void tim_cache_lru_unlink(tim_cache *c, tim_cache_entry *e) {
+  if (e->newer != NULL)
+    e->newer->older = e->older;
+  else
+    c->newest = e->older;
+  if (e->older != NULL)
+    e->older->newer = e->newer;
+  else
+    c->oldest = e->newer;
+  e->newer = e->older = NULL;
+}
+
+// must be called with the lock held
+static void tim_cache_lru_push(tim_cache *c, tim_cache_entry *e) {
+  e->older = c->newest;
+  e->newer = NULL;
+  if (c->newest != NULL)
+    c->newest->newer = e;
+  else
+    c->oldest = e;
+  c->newest = e;
+}
+
+// take `e` out of the cache, must be called with the lock held. it lives on
+// until its last handle is released
+static void tim_cache_drop(tim_cache *c, tim_cache_entry *e) {
+  tim_cache_entry **p = &c->buckets[e->hash & (c->nbuckets - 1)];
+
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+  tim_cache_lru_unlink(c, e);
+  e->cached = 0;
+  c->stats.bytes -= e->bytes;
+  c->stats.entries--;
+  if (e->refs == 0)
+    tim_cache_entry_free(e);
+}
+
+// must be called with the lock held, a failed allocation keeps the old table
+static void tim_cache_grow(tim_cache *c) {
+  size_t n = c->nbuckets * 2, i;
+  tim_cache_entry **buckets = calloc(n, sizeof(*buckets)), *e, *next;
+
+  if (buckets == NULL)
+    return;
+  for (i = 0; i < c->nbuckets; ++i) {
+    for (e = c->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+    }
+  }
+  free(c->buckets);
+  c->buckets = buckets;
+  c->nbuckets = n;
+}
+
+// must be called with the lock held
+static void tim_cache_insert(tim_cache *c, tim_cache_entry *e) {
+  size_t i;
+
+  if (c->stats.entries >= c->nbuckets)
+    tim_cache_grow(c);
+  i = e->hash & (c->nbuckets - 1);
+  e->next = c->buckets[i];
+  c->buckets[i] = e;
+  tim_cache_lru_push(c, e);
+  e->cached = 1;
+  c->stats.bytes += e->bytes;
+  c->stats.entries++;
+
+  // an image larger than the whole budget goes out again right away and
+  // only lives as long as its handle
+  while (c->stats.bytes > c->max_bytes && c->oldest != NULL) {
+    tim_cache_drop(c, c->oldest);
+    c->stats.evictions++;
+  }
+}
+
+static tim_err tim_cache_decode_file(tim_img *im, const char *file,
+                                     tim_cache_decode decode,
+                                     const tim_read_opts *opts) {
+  switch (decode) {
+  case TIM_CACHE_PREVIEW:
+    return tim_file_read_preview(im, file, opts);
+  case TIM_CACHE_THUMBNAIL:
+    return tim_file_read_thumbnail(im, file, opts);
+  case TIM_CACHE_FULL:
+    break;
+  }
+  return tim_file_read_ex(im, file, opts);
+}
+
+tim_err tim_cache_open(tim_cache **cache, size_t max_bytes) {
+  tim_cache *c;
+  TIM_TRACE("tim_cache_open(%p, %ld)\n", cache, max_bytes);
+
+  if (cache == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  c = calloc(1, sizeof(tim_cache));
+  if (c == NULL)
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  c->nbuckets = TIM_CACHE_MIN_BUCKETS;
+  c->buckets = calloc(c->nbuckets, sizeof(*c->buckets));
+  if (c->buckets == NULL) {
+    free(c);
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  }
+  c->max_bytes = max_bytes ? max_bytes : TIM_CACHE_DEFAULT_BYTES;
+#if TIM_THREADS
+  pthread_mutex_init(&c->lock, NULL);
+#endif
+
+  *cache = c;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_cache_read(tim_cache *cache, const tim_img **im, const char *file,
+                       tim_cache_decode decode, const tim_read_opts *opts) {
+  tim_cache_entry *e, *found;
+  long long size = 0, mtime_ns = 0;
+  int flip;
+  unsigned hash;
+  tim_err err;
+
+  TIM_TRACE("tim_cache_read(%p, %p, %s, %d, %p)\n", cache, im, file, decode,
+            opts);
+
+  if (opts == NULL)
+    opts = &tim_default_cache_read_opts;
+
+  if (cache == NULL || im == NULL || file == NULL ||
+      decode < TIM_CACHE_FULL || decode > TIM_CACHE_THUMBNAIL ||
+      opts->channels < 0 || opts->channels > 4 || opts->threads < 0)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  err = tim_cache_stat(file, &size, &mtime_ns);
+  if (err != TIM_ERR_OK)
+    return err;
+  flip = opts->flip_vertically != 0;
+  hash = tim_cache_hash(file, decode, opts->channels, flip);
+
+  tim_cache_lock(cache);
+  found = tim_cache_find(cache, hash, file, decode, opts->channels, flip);
+  if (found != NULL && (found->size != size || found->mtime_ns != mtime_ns)) {
+    tim_cache_drop(cache, found);
+    found = NULL;
+  }
+  if (found != NULL) {
+    tim_cache_lru_unlink(cache, found);
+    tim_cache_lru_push(cache, found);
+    found->refs++;
+    cache->handles++;
+    cache->stats.hits++;
+    tim_cache_unlock(cache);
+    *im = &found->im;
+    return TIM_ERR_OK;
+  }
+  cache->stats.misses++;
+  tim_cache_unlock(cache);
+
+  // decode without the lock, other threads keep getting their hits
+  e = calloc(1, sizeof(tim_cache_entry));
+  if (e == NULL)
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  e->path = malloc(strlen(file) + 1);
+  if (e->path == NULL) {
+    free(e);
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  }
+  strcpy(e->path, file);
+  err = tim_cache_decode_file(&e->im, file, decode, opts);
+  if (err != TIM_ERR_OK) {
+    free(e->path);
+    free(e);
+    return err;
+  }
+  e->decode = decode;
+  e->channels = opts->channels;
+  e->flip_vertically = flip;
+  e->hash = hash;
+  e->size = size;
+  e->mtime_ns = mtime_ns;
+  e->bytes = TIM_STRIDE(&e->im) * (size_t)e->im.height;
+  e->refs = 1;
+
+  tim_cache_lock(cache);
+  // another thread may have decoded the same file meanwhile, keep one copy
+  found = tim_cache_find(cache, hash, file, decode, opts->channels, flip);
+  cache->handles++;
+  if (found != NULL && found->size == size && found->mtime_ns == mtime_ns) {
+    found->refs++;
+    tim_cache_unlock(cache);
+    tim_cache_entry_free(e);
+    *im = &found->im;
+    return TIM_ERR_OK;
+  }
+  if (found != NULL)
+    tim_cache_drop(cache, found);
+  tim_cache_insert(cache, e);
+  tim_cache_unlock(cache);
+
+  *im = &e->im;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_cache_release(tim_cache *cache, const tim_img *im) {
+  // the handle is the first member of its entry
+  tim_cache_entry *e = (tim_cache_entry *)im;
+  TIM_TRACE("tim_cache_release(%p, %p)\n", cache, im);
+
+  if (cache == NULL || im == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  // a handle released twice may point at freed memory already, so there is
+  // nothing here that could tell
+  tim_cache_lock(cache);
+  cache->handles--;
+  if (--e->refs == 0 && !e->cached)
+    tim_cache_entry_free(e);
+  tim_cache_unlock(cache);
+  return TIM_ERR_OK;
+}
+
+tim_err tim_cache_get_stats(tim_cache *cache, tim_cache_stats *stats) {
+  TIM_TRACE("tim_cache_get_stats(%p, %p)\n", cache, stats);
+
+  if (cache == NULL || stats == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  tim_cache_lock(cache);
+  *stats = cache->stats;
+  tim_cache_unlock(cache);
+  return TIM_ERR_OK;
+}
+
+tim_err tim_cache_clear(tim_cache *cache) {
+  TIM_TRACE("tim_cache_clear(%p)\n", cache);
+
+  if (cache == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  tim_cache_lock(cache);
+  while (cache->oldest != NULL)
+    tim_cache_drop(cache, cache->oldest);
+  tim_cache_unlock(cache);
+  return TIM_ERR_OK;
+}
+
+tim_err tim_cache_close(tim_cache *cache) {
+  TIM_TRACE("tim_cache_close(%p)\n", cache);
+
+  if (cache == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  // entries still in use would either leak or be freed under their users
+  tim_cache_lock(cache);
+  if (cache->handles > 0) {
+    tim_cache_unlock(cache);
+    return tim_set_error(TIM_ERR_ARG, "cached images are still in use");
+  }
+  tim_cache_unlock(cache);
+
+  tim_cache_clear(cache);
+#if TIM_THREADS
+  pthread_mutex_destroy(&cache->lock);
+#endif
+  free(cache->buckets);
+  free(cache);
+  return TIM_ERR_OK;
+}
@@ -0,0 +1,66 @@
+// Tiny Image Manipulation - internals shared between the implementation files
+
+#ifndef __TIM_INTERNAL_H__
+#define __TIM_INTERNAL_H__
+
+#include <stdio.h> // stderr, fprintf
+
+#include "tim.h"
+
+#define TIM_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define TIM_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define TIM_STRINGIFY_(x) #x
+#define TIM_STRINGIFY(x) TIM_STRINGIFY_(x)
+
+// bytes per row of an image
+#define TIM_STRIDE(im)                                                         \
+  ((im)->stride ? (im)->stride : (size_t)(im)->width * (im)->channels)
+
+// debugging enabled
+#if defined(DEBUG) || !defined(NDEBUG)
+  #define TIM_DEBUG 1
+#else
+  #define TIM_DEBUG 0
+#endif
+
+#if TIM_DEBUG
+  #define TIM_TRACE(...) fprintf(stderr, "[TIM] " __VA_ARGS__);
+#else
+  #define TIM_TRACE(...)
+#endif
+
+// background threads are pthreads, define TIM_NO_THREADS to run everything
+// on the calling thread instead
+#if !defined(TIM_NO_THREADS) && !defined(_WIN32)
+  #define TIM_THREADS 1
+  #include <pthread.h>
+#else
+  #define TIM_THREADS 0
+#endif
+
+// per-thread library state (error details, stb settings)
+#if !TIM_THREADS
+  #define TIM_THREAD_LOCAL
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L &&             \
+    !defined(__STDC_NO_THREADS__)
+  #define TIM_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__) || defined(__clang__)
+  #define TIM_THREAD_LOCAL __thread
+#else
+  #error "no thread-local storage on this compiler, build with -DTIM_NO_THREADS"
+#endif
+
+/** record a detail string for tim_last_error_detail() and return `err` */
+tim_err tim_set_error(tim_err err, const char *detail);
+
+/** number of online cpus, 1 without threads */
+size_t tim_cpu_count(void);
+
+/**
+ * call fn(ctx, i) for every i < n spread over up to `threads` threads (0 is
+ * one per cpu), the calling thread included. returns when all calls did
+ */
+tim_err tim_parallel_for(size_t n, size_t threads,
+                         void (*fn)(void *ctx, size_t i), void *ctx);
+
+#endif // __TIM_INTERNAL_H__
@@ -0,0 +1,669 @@
+// C99
+#define _POSIX_C_SOURCE 200809L // pthreads, open, fstat
+#define _DEFAULT_SOURCE           // syscall
+#include <stddef.h> // NULL
+#include <stdio.h>  // fopen, fread, fwrite
+#include <stdlib.h> // malloc, free
+#include <string.h> // strcmp, strlen, memcpy, memset
+
+#include "tim.h" // Tiny Image Manipulation
+#include "tim_internal.h"
+
+// io_uring is driven through the raw syscalls so there is no liburing dependency
+#if defined(TIM_IO_URING) && TIM_THREADS
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <linux/io_uring.h>
+  #include <stdint.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+  #define TIM_IO_HAVE_URING 1
+#else
+  #define TIM_IO_HAVE_URING 0
+#endif
+
+#define TIM_IO_DEFAULT_WORKERS 4
+// max reads/writes the ring keeps in flight
+#define TIM_IO_URING_DEPTH 64
+// max bytes per read/write request, larger files take several requests
+#define TIM_IO_URING_CHUNK (1u << 30)
+
+typedef enum { TIM_IO_OP_READ, TIM_IO_OP_WRITE } tim_io_op;
+
+typedef struct tim_io_job {
+  tim_io_op op;
+  char *path;
+  u8 *data;
+  size_t len;
+  tim_err err;
+  int done;
+  struct tim_io_job *next;      // queue link, then ring link under io_uring
+  struct tim_io_job *next_read; // link in the unconsumed reads list
+#if TIM_IO_HAVE_URING
+  int fd;
+  size_t progress;
+#endif
+} tim_io_job;
+
+#if TIM_IO_HAVE_URING
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned to_submit, inflight;
+  tim_io_job *jobs; // jobs with a request in the sq or in the kernel
+} tim_io_uring;
+#endif
+
+struct tim_io {
+#if TIM_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // a job was queued or the queue is closing
+  pthread_cond_t done; // a job has finished
+  pthread_t *threads;
+  size_t nthreads;
+#endif
+#if TIM_IO_HAVE_URING
+  tim_io_uring *ring; // NULL when running on the thread pool
+#endif
+  tim_io_job *head, *tail; // queued jobs nobody picked up yet
+  tim_io_job *reads;       // reads that were not consumed by tim_io_read yet
+  size_t writes_pending;
+  tim_err write_err;
+  int stop;
+};
+
+static tim_io_job *tim_io_job_new(tim_io_op op, const char *path) {
+  tim_io_job *j = calloc(1, sizeof(tim_io_job));
+  if (j == NULL)
+    return NULL;
+  j->op = op;
+  j->path = malloc(strlen(path) + 1);
+  if (j->path == NULL) {
+    free(j);
+    return NULL;
+  }
+  strcpy(j->path, path);
+  return j;
+}
+
+static void tim_io_job_free(tim_io_job *j) {
+  free(j->path);
+  free(j->data);
+  free(j);
+}
+
+#if TIM_THREADS
+// whole-file blocking read, used by the thread pool
+static tim_err tim_io_read_all(const char *path, u8 **data, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  long size;
+
+  if (f == NULL)
+    return TIM_ERR_INTERNAL;
+
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    fclose(f);
+    return TIM_ERR_INTERNAL;
+  }
+
+  *data = malloc(size ? size : 1);
+  if (*data == NULL) {
+    fclose(f);
+    return TIM_ERR_ALLOC;
+  }
+
+  *len = fread(*data, 1, size, f);
+  fclose(f);
+  return (*len == (size_t)size) ? TIM_ERR_OK : TIM_ERR_INTERNAL;
+}
+#endif
+
+static tim_err tim_io_write_all(const char *path, const u8 *data, size_t len) {
+  FILE *f = fopen(path, "wb");
+  size_t written;
+
+  if (f == NULL)
+    return TIM_ERR_INTERNAL;
+
+  written = fwrite(data, 1, len, f);
+  if (fclose(f) != 0 || written != len)
+    return TIM_ERR_INTERNAL;
+  return TIM_ERR_OK;
+}
+
+#if TIM_THREADS
+
+// must be called with io->lock held
+static void tim_io_push(tim_io *io, tim_io_job *j) {
+  j->next = NULL;
+  if (io->tail != NULL)
+    io->tail->next = j;
+  else
+    io->head = j;
+  io->tail = j;
+  pthread_cond_signal(&io->wake);
+}
+
+// must be called with io->lock held
+static tim_io_job *tim_io_pop(tim_io *io) {
+  tim_io_job *j = io->head;
+  if (j != NULL) {
+    io->head = j->next;
+    if (io->head == NULL)
+      io->tail = NULL;
+  }
+  return j;
+}
+
+// must be called with io->lock held. finished writes are released here,
+// finished reads stay around until tim_io_read takes them
+static void tim_io_finish(tim_io *io, tim_io_job *j, tim_err err) {
+  j->err = err;
+  j->done = 1;
+  if (j->op == TIM_IO_OP_WRITE) {
+    if (err != TIM_ERR_OK && io->write_err == TIM_ERR_OK)
+      io->write_err = err;
+    io->writes_pending--;
+    tim_io_job_free(j);
+  }
+  pthread_cond_broadcast(&io->done);
+}
+
+static void *tim_io_worker(void *arg) {
+  tim_io *io = arg;
+  tim_io_job *j;
+  tim_err err;
+
+  pthread_mutex_lock(&io->lock);
+  for (;;) {
+    while (io->head == NULL && !io->stop)
+      pthread_cond_wait(&io->wake, &io->lock);
+    // the queue is drained before the workers exit
+    if ((j = tim_io_pop(io)) == NULL)
+      break;
+    pthread_mutex_unlock(&io->lock);
+
+    if (j->op == TIM_IO_OP_READ)
+      err = tim_io_read_all(j->path, &j->data, &j->len);
+    else
+      err = tim_io_write_all(j->path, j->data, j->len);
+
+    pthread_mutex_lock(&io->lock);
+    tim_io_finish(io, j, err);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+#endif // TIM_THREADS
+
+#if TIM_IO_HAVE_URING
+
+static int tim_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static void tim_io_uring_free(tim_io_uring *r) {
+  if (r->sqes != NULL && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_size);
+  if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+    munmap(r->sq_ptr, r->sq_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r);
+}
+
+// returns NULL if the kernel has no (usable) io_uring
+static tim_io_uring *tim_io_uring_new(unsigned depth) {
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  tim_io_uring *r = calloc(1, sizeof(tim_io_uring));
+  u8 *sq, *cq;
+  int usable;
+
+  if (r == NULL)
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+  if (r->fd < 0) {
+    TIM_TRACE("io_uring_setup failed (%d), using threads\n", errno);
+    free(r);
+    return NULL;
+  }
+
+  // plain READ/WRITE ops appeared in linux 5.6, older rings can't be used
+  probe = calloc(1, sizeof(struct io_uring_probe) +
+                       (IORING_OP_WRITE + 1) * sizeof(struct io_uring_probe_op));
+  usable = probe != NULL &&
+           syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe,
+                   IORING_OP_WRITE + 1) >= 0 &&
+           probe->last_op >= IORING_OP_WRITE &&
+           (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+           (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (!usable) {
+    TIM_TRACE("io_uring lacks READ/WRITE ops, using threads\n");
+    tim_io_uring_free(r);
+    return NULL;
+  }
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->sq_size = r->cq_size = TIM_MAX(r->sq_size, r->cq_size);
+
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    tim_io_uring_free(r);
+    return NULL;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr = r->sq_ptr;
+  else
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, r->fd, IORING_OFF_SQES);
+  if (r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+    tim_io_uring_free(r);
+    return NULL;
+  }
+
+  sq = r->sq_ptr;
+  cq = r->cq_ptr;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return r;
+}
+
+// queue the next read/write request of `j`
+static void tim_io_uring_queue(tim_io_uring *r, tim_io_job *j) {
+  unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  size_t left = j->len - j->progress;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (j->op == TIM_IO_OP_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = j->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(j->data + j->progress);
+  sqe->len = (unsigned)TIM_MIN(left, TIM_IO_URING_CHUNK);
+  sqe->off = j->progress;
+  sqe->user_data = (uint64_t)(uintptr_t)j;
+
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->to_submit++;
+  r->inflight++;
+}
+
+// open the file and queue the first request. returns an error if the job
+// finished (or failed) right away
+static tim_err tim_io_uring_start(tim_io_uring *r, tim_io_job *j) {
+  struct stat st;
+
+  if (j->op == TIM_IO_OP_READ) {
+    j->fd = open(j->path, O_RDONLY);
+    if (j->fd < 0)
+      return TIM_ERR_INTERNAL;
+    if (fstat(j->fd, &st) != 0) {
+      close(j->fd);
+      return TIM_ERR_INTERNAL;
+    }
+    j->len = st.st_size;
+    j->data = malloc(j->len ? j->len : 1);
+    if (j->data == NULL) {
+      close(j->fd);
+      return TIM_ERR_ALLOC;
+    }
+  } else {
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (j->fd < 0)
+      return TIM_ERR_INTERNAL;
+  }
+
+  if (j->len == 0) {
+    close(j->fd);
+    return (j->op == TIM_IO_OP_READ) ? TIM_ERR_INTERNAL : TIM_ERR_OK;
+  }
+
+  j->progress = 0;
+  j->next = r->jobs;
+  r->jobs = j;
+  tim_io_uring_queue(r, j);
+  return TIM_ERR_OK;
+}
+
+// `j` has no request left in the ring
+static void tim_io_uring_forget(tim_io_uring *r, tim_io_job *j) {
+  tim_io_job **link = &r->jobs;
+  while (*link != j)
+    link = &(*link)->next;
+  *link = j->next;
+}
+
+// io_uring_enter failed for good: every job still in the ring fails. the
+// kernel may yet touch their buffers, so those are leaked rather than freed.
+// whatever is queued after that is served by the blocking thread worker
+static void *tim_io_uring_abandon(tim_io *io) {
+  tim_io_uring *r = io->ring;
+  tim_io_job *j;
+
+  TIM_TRACE("io_uring_enter failed (%d), using threads\n", errno);
+  pthread_mutex_lock(&io->lock);
+  while ((j = r->jobs) != NULL) {
+    r->jobs = j->next;
+    close(j->fd);
+    j->data = NULL;
+    tim_io_finish(io, j, TIM_ERR_INTERNAL);
+  }
+  r->inflight = r->to_submit = 0;
+  pthread_mutex_unlock(&io->lock);
+  return tim_io_worker(io);
+}
+
+// a single thread owns the ring: it pulls jobs off the queue, keeps up to
+// TIM_IO_URING_DEPTH requests in flight and resubmits short reads/writes
+static void *tim_io_uring_worker(void *arg) {
+  tim_io *io = arg;
+  tim_io_uring *r = io->ring;
+  tim_io_job *j;
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  tim_err err;
+  int res;
+
+  pthread_mutex_lock(&io->lock);
+  for (;;) {
+    while (io->head == NULL && r->inflight == 0 && !io->stop)
+      pthread_cond_wait(&io->wake, &io->lock);
+    if (io->head == NULL && r->inflight == 0)
+      break;
+
+    while (r->inflight < TIM_IO_URING_DEPTH && (j = tim_io_pop(io)) != NULL) {
+      pthread_mutex_unlock(&io->lock);
+      err = tim_io_uring_start(r, j);
+      pthread_mutex_lock(&io->lock);
+      if (err != TIM_ERR_OK || j->len == 0)
+        tim_io_finish(io, j, err);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    if (r->inflight > 0) {
+      do {
+        res = tim_io_uring_enter(r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS);
+      } while (res < 0 && errno == EINTR);
+      if (res > 0)
+        r->to_submit -= res;
+      // EAGAIN and EBUSY clear up once completions are reaped, with none to
+      // reap (or any other error) the worker would spin forever
+      if (res < 0 &&
+          ((errno != EAGAIN && errno != EBUSY) ||
+           *r->cq_head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)))
+        return tim_io_uring_abandon(io);
+    }
+
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      cqe = &r->cqes[head & *r->cq_mask];
+      j = (tim_io_job *)(uintptr_t)cqe->user_data;
+      r->inflight--;
+
+      if (cqe->res > 0) {
+        j->progress += cqe->res;
+        if (j->progress < j->len) {
+          tim_io_uring_queue(r, j);
+          continue;
+        }
+      }
+
+      close(j->fd);
+      tim_io_uring_forget(r, j);
+      pthread_mutex_lock(&io->lock);
+      tim_io_finish(io, j, (cqe->res > 0) ? TIM_ERR_OK : TIM_ERR_INTERNAL);
+      pthread_mutex_unlock(&io->lock);
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&io->lock);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+#endif // TIM_IO_HAVE_URING
+
+tim_err tim_io_open(tim_io **io, size_t workers) {
+  tim_io *q;
+  TIM_TRACE("tim_io_open(%p, %ld)\n", io, workers);
+
+  if (io == NULL)
+    return TIM_ERR_ARG;
+
+  q = calloc(1, sizeof(tim_io));
+  if (q == NULL)
+    return TIM_ERR_ALLOC;
+
+#if TIM_THREADS
+  q->nthreads = workers ? workers : TIM_IO_DEFAULT_WORKERS;
+#if TIM_IO_HAVE_URING
+  q->ring = tim_io_uring_new(TIM_IO_URING_DEPTH);
+  if (q->ring != NULL)
+    q->nthreads = 1;
+#endif
+  q->threads = calloc(q->nthreads, sizeof(pthread_t));
+  if (q->threads == NULL) {
+    free(q);
+    return TIM_ERR_ALLOC;
+  }
+
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  pthread_cond_init(&q->done, NULL);
+
+  for (workers = 0; workers < q->nthreads; ++workers) {
+    void *(*fn)(void *) = tim_io_worker;
+#if TIM_IO_HAVE_URING
+    if (q->ring != NULL)
+      fn = tim_io_uring_worker;
+#endif
+    if (pthread_create(&q->threads[workers], NULL, fn, q) != 0)
+      break;
+  }
+  q->nthreads = workers;
+  if (q->nthreads == 0) {
+    tim_io_close(q);
+    return TIM_ERR_INTERNAL;
+  }
+#else
+  (void)workers;
+#endif
+
+  *io = q;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_io_prefetch(tim_io *io, const char *file) {
+#if TIM_THREADS
+  tim_io_job *j;
+#endif
+  TIM_TRACE("tim_io_prefetch(%p, %s)\n", io, file);
+
+  if (io == NULL || file == NULL)
+    return TIM_ERR_ARG;
+
+#if TIM_THREADS
+  j = tim_io_job_new(TIM_IO_OP_READ, file);
+  if (j == NULL)
+    return TIM_ERR_ALLOC;
+
+  pthread_mutex_lock(&io->lock);
+  j->next_read = io->reads;
+  io->reads = j;
+  tim_io_push(io, j);
+  pthread_mutex_unlock(&io->lock);
+#endif
+  // without threads tim_io_read simply reads the file when asked to
+
+  return TIM_ERR_OK;
+}
+
+tim_err tim_io_read(tim_io *io, tim_img *im, const char *file) {
+  tim_io_job *j = NULL;
+#if TIM_THREADS
+  tim_io_job **link;
+#endif
+  tim_err err;
+
+  TIM_TRACE("tim_io_read(%p, %p, %s)\n", io, im, file);
+
+  if (io == NULL || im == NULL || file == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+#if TIM_THREADS
+  pthread_mutex_lock(&io->lock);
+  for (link = &io->reads; *link != NULL; link = &(*link)->next_read) {
+    if (strcmp((*link)->path, file) == 0) {
+      j = *link;
+      *link = j->next_read;
+      break;
+    }
+  }
+  while (j != NULL && !j->done)
+    pthread_cond_wait(&io->done, &io->lock);
+  pthread_mutex_unlock(&io->lock);
+#endif
+
+  if (j == NULL)
+    return tim_file_read(im, file);
+
+  err = j->err;
+  if (err == TIM_ERR_OK)
+    err = tim_mem_read(im, j->data, j->len);
+  else
+    tim_set_error(err, "could not read prefetched file");
+  tim_io_job_free(j);
+  return err;
+}
+
+tim_err tim_io_write(tim_io *io, tim_img *im, const char *file) {
+  tim_io_job *j;
+  tim_err err;
+
+  TIM_TRACE("tim_io_write(%p, %p, %s)\n", io, im, file);
+
+  if (io == NULL || im == NULL || file == NULL)
+    return TIM_ERR_ARG;
+
+  j = tim_io_job_new(TIM_IO_OP_WRITE, file);
+  if (j == NULL)
+    return TIM_ERR_ALLOC;
+
+  // encoding happens here, only the disk write is deferred
+  err = tim_mem_write(im, tim_format_from_path(file), &j->data, &j->len);
+  if (err != TIM_ERR_OK) {
+    tim_io_job_free(j);
+    return err;
+  }
+
+#if TIM_THREADS
+  pthread_mutex_lock(&io->lock);
+  io->writes_pending++;
+  tim_io_push(io, j);
+  pthread_mutex_unlock(&io->lock);
+#else
+  err = tim_io_write_all(j->path, j->data, j->len);
+  tim_io_job_free(j);
+  if (err != TIM_ERR_OK && io->write_err == TIM_ERR_OK)
+    io->write_err = err;
+#endif
+
+  return TIM_ERR_OK;
+}
+
+tim_err tim_io_flush(tim_io *io) {
+  tim_err err;
+  TIM_TRACE("tim_io_flush(%p)\n", io);
+
+  if (io == NULL)
+    return TIM_ERR_ARG;
+
+#if TIM_THREADS
+  pthread_mutex_lock(&io->lock);
+  while (io->writes_pending > 0)
+    pthread_cond_wait(&io->done, &io->lock);
+#endif
+  err = io->write_err;
+  io->write_err = TIM_ERR_OK;
+#if TIM_THREADS
+  pthread_mutex_unlock(&io->lock);
+#endif
+
+  return err;
+}
+
+tim_err tim_io_close(tim_io *io) {
+  tim_io_job *j;
+  tim_err err;
+#if TIM_THREADS
+  size_t i;
+#endif
+  TIM_TRACE("tim_io_close(%p)\n", io);
+
+  if (io == NULL)
+    return TIM_ERR_ARG;
+
+#if TIM_THREADS
+  pthread_mutex_lock(&io->lock);
+  io->stop = 1;
+  pthread_cond_broadcast(&io->wake);
+  pthread_mutex_unlock(&io->lock);
+
+  // workers drain the queue before returning
+  for (i = 0; i < io->nthreads; ++i)
+    pthread_join(io->threads[i], NULL);
+
+#if TIM_IO_HAVE_URING
+  if (io->ring != NULL)
+    tim_io_uring_free(io->ring);
+#endif
+  pthread_cond_destroy(&io->done);
+  pthread_cond_destroy(&io->wake);
+  pthread_mutex_destroy(&io->lock);
+  free(io->threads);
+#endif
+
+  // prefetched files nobody asked for
+  while ((j = io->reads) != NULL) {
+    io->reads = j->next_read;
+    tim_io_job_free(j);
+  }
+
+  err = io->write_err;
+  free(io);
+  return err;
+}
@@ -0,0 +1,91 @@
+// C99
+#define _POSIX_C_SOURCE 200809L // pthreads, sysconf
+#include <stddef.h> // NULL
+#include <stdlib.h> // malloc, free
+
+#include "tim.h" // Tiny Image Manipulation
+#include "tim_internal.h"
+
+#if TIM_THREADS
+  #include <unistd.h> // sysconf
+#endif
+
+// upper bound for one tim_parallel_for call
+#define TIM_PARALLEL_MAX_THREADS 64
+
+size_t tim_cpu_count(void) {
+#if TIM_THREADS && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (size_t)n : 1;
+#else
+  return 1;
+#endif
+}
+
+#if TIM_THREADS
+typedef struct {
+  pthread_mutex_t lock;
+  size_t next, n;
+  void (*fn)(void *ctx, size_t i);
+  void *ctx;
+} tim_parallel_job;
+
+// every thread (the caller included) takes the next index until none is left
+static void *tim_parallel_worker(void *arg) {
+  tim_parallel_job *job = arg;
+  size_t i;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->n)
+      return NULL;
+    job->fn(job->ctx, i);
+  }
+}
+#endif
+
+tim_err tim_parallel_for(size_t n, size_t threads,
+                         void (*fn)(void *ctx, size_t i), void *ctx) {
+#if TIM_THREADS
+  pthread_t tids[TIM_PARALLEL_MAX_THREADS];
+  tim_parallel_job job;
+  size_t started, t;
+#endif
+  size_t i;
+
+  TIM_TRACE("tim_parallel_for(%ld, %ld)\n", n, threads);
+
+  if (fn == NULL)
+    return TIM_ERR_ARG;
+
+  if (threads == 0)
+    threads = tim_cpu_count();
+  threads = TIM_MIN(TIM_MIN(threads, n), TIM_PARALLEL_MAX_THREADS);
+
+#if TIM_THREADS
+  if (threads > 1) {
+    job.next = 0;
+    job.n = n;
+    job.fn = fn;
+    job.ctx = ctx;
+    if (pthread_mutex_init(&job.lock, NULL) == 0) {
+      // whatever can't be started is picked up by the threads that did
+      for (started = 0; started < threads - 1; ++started)
+        if (pthread_create(&tids[started], NULL, tim_parallel_worker, &job) !=
+            0)
+          break;
+      tim_parallel_worker(&job);
+      for (t = 0; t < started; ++t)
+        pthread_join(tids[t], NULL);
+      pthread_mutex_destroy(&job.lock);
+      return TIM_ERR_OK;
+    }
+  }
+#endif
+
+  for (i = 0; i < n; ++i)
+    fn(ctx, i);
+  return TIM_ERR_OK;
+}
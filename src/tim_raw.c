@@ -0,0 +1,601 @@
+// C99
+#define _POSIX_C_SOURCE 200809L // open, fstat, mmap
+#include <limits.h> // INT_MAX
+#include <stddef.h> // NULL
+#include <stdio.h>  // fopen, fread, fwrite
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, memset, memcmp
+
+#include "tim.h" // Tiny Image Manipulation
+#include "tim_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+  #define TIM_RAW_MMAP 1
+#else
+  #define TIM_RAW_MMAP 0
+#endif
+
+// file layout, every number little endian:
+//   0  "TIMRAW\r\n"
+//   8  u32 version (1)
+//  12  u32 header size, where the pixels start (TIM_RAW_HEADER)
+//  16  u32 width, u32 height, u32 channels
+//  28  u32 tile size, 0 for plain rows
+//  32  u32 compression (TIM_RAW_NONE or TIM_RAW_LZ4), tiled files only
+//  36  u32 0
+//  40  u64 row stride, 0 for tiled files
+//  48  u64 bytes after the header
+// the header is zero padded to a page, so mapped pixels are page aligned.
+// tiled files start with a u64 offset (from the end of the header) and a u64
+// size for each tile, row by row. a tile holds its rows packed, tiles on the
+// right and bottom edges are cut to the image. a compressed tile that would
+// not get smaller is stored as is, its size tells which one it is
+#define TIM_RAW_MAGIC "TIMRAW\r\n"
+#define TIM_RAW_VERSION 1
+#define TIM_RAW_HEADER 4096
+#define TIM_RAW_NONE 0
+#define TIM_RAW_LZ4 1
+#define TIM_RAW_MAX_TILE 4096
+
+static const tim_raw_opts tim_default_raw_opts = {0};
+static const tim_read_opts tim_default_raw_read_opts = {0};
+
+typedef struct {
+  unsigned width, height, channels, tile, compression;
+  size_t stride, size;
+} tim_raw_header;
+
+static void tim_raw_put(u8 *p, unsigned long long v, int bytes) {
+  int i;
+  for (i = 0; i < bytes; ++i)
+    p[i] = (u8)(v >> (8 * i));
+}
+
+static unsigned long long tim_raw_get(const u8 *p, int bytes) {
+  unsigned long long v = 0;
+  int i;
+  for (i = 0; i < bytes; ++i)
+    v |= (unsigned long long)p[i] << (8 * i);
+  return v;
+}
+
+static size_t tim_raw_tiles(const tim_raw_header *h) {
+  return (size_t)((h->width + h->tile - 1) / h->tile) *
+         ((h->height + h->tile - 1) / h->tile);
+}
+
+static void tim_raw_tile_rect(const tim_raw_header *h, size_t i, unsigned *x,
+                              unsigned *y, unsigned *w, unsigned *th) {
+  unsigned cols = (h->width + h->tile - 1) / h->tile;
+  *x = (unsigned)(i % cols) * h->tile;
+  *y = (unsigned)(i / cols) * h->tile;
+  *w = TIM_MIN(h->tile, h->width - *x);
+  *th = TIM_MIN(h->tile, h->height - *y);
+}
+
+// every tile has to lie within the tile data after the index, and only
+// compressed files may have tiles of another size than their pixels
+static int tim_raw_index_valid(const tim_raw_header *h, const u8 *index) {
+  size_t n = tim_raw_tiles(h), data = h->size - 16 * n, i;
+  unsigned long long off, len;
+  unsigned x, y, w, th;
+
+  for (i = 0; i < n; ++i) {
+    off = tim_raw_get(index + 16 * i, 8);
+    len = tim_raw_get(index + 16 * i + 8, 8);
+    if (off > data || len > data - off)
+      return 0;
+    tim_raw_tile_rect(h, i, &x, &y, &w, &th);
+    if (h->compression == TIM_RAW_NONE &&
+        len != (unsigned long long)w * th * h->channels)
+      return 0;
+  }
+  return 1;
+}
+
+// parse and sanity check the header of a `len` byte file
+static tim_err tim_raw_parse(tim_raw_header *h, const u8 *p, size_t len) {
+  unsigned long long stride, size;
+
+  if (len < TIM_RAW_HEADER || memcmp(p, TIM_RAW_MAGIC, 8) != 0)
+    return tim_set_error(TIM_ERR_INTERNAL, "not a tim raw file");
+  if (tim_raw_get(p + 8, 4) != TIM_RAW_VERSION ||
+      tim_raw_get(p + 12, 4) != TIM_RAW_HEADER)
+    return tim_set_error(TIM_ERR_INTERNAL, "unsupported tim raw version");
+
+  h->width = (unsigned)tim_raw_get(p + 16, 4);
+  h->height = (unsigned)tim_raw_get(p + 20, 4);
+  h->channels = (unsigned)tim_raw_get(p + 24, 4);
+  h->tile = (unsigned)tim_raw_get(p + 28, 4);
+  h->compression = (unsigned)tim_raw_get(p + 32, 4);
+  stride = tim_raw_get(p + 40, 8);
+  size = tim_raw_get(p + 48, 8);
+  if (h->width == 0 || h->height == 0 || h->width > INT_MAX ||
+      h->height > INT_MAX || h->channels < 1 || h->channels > 4 ||
+      h->tile > TIM_RAW_MAX_TILE || h->compression > TIM_RAW_LZ4 ||
+      (h->tile == 0 && h->compression != TIM_RAW_NONE) ||
+      size > len - TIM_RAW_HEADER)
+    return tim_set_error(TIM_ERR_INTERNAL, "corrupt tim raw header");
+  if (h->tile == 0 && (stride < (unsigned long long)h->width * h->channels ||
+                       stride > size / h->height))
+    return tim_set_error(TIM_ERR_INTERNAL, "corrupt tim raw header");
+  if (h->tile != 0 && tim_raw_tiles(h) > size / 16)
+    return tim_set_error(TIM_ERR_INTERNAL, "corrupt tim raw header");
+  h->stride = (size_t)stride;
+  h->size = (size_t)size;
+  if (h->tile != 0 && !tim_raw_index_valid(h, p + TIM_RAW_HEADER))
+    return tim_set_error(TIM_ERR_INTERNAL, "corrupt tim raw tile index");
+  return TIM_ERR_OK;
+}
+
+// lz4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+// with a greedy single-probe matcher, about what `lz4 -1` does
+#define TIM_LZ4_HASH_BITS 12
+#define TIM_LZ4_MIN_MATCH 4
+// the last 5 bytes are literals and the last match starts 12 bytes before
+// the end at the latest
+#define TIM_LZ4_LAST_LITERALS 5
+#define TIM_LZ4_MF_LIMIT 12
+
+static size_t tim_lz4_bound(size_t n) { return n + n / 255 + 16; }
+
+static unsigned tim_lz4_read32(const u8 *p) {
+  unsigned v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static u8 *tim_lz4_length(u8 *op, size_t n) {
+  for (; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = (u8)n;
+  return op;
+}
+
+static u8 *tim_lz4_sequence(u8 *op, const u8 *lit, size_t nlit, size_t off,
+                            size_t len) {
+  u8 *token = op++;
+  *token = (u8)(TIM_MIN(nlit, 15) << 4);
+  if (nlit >= 15)
+    op = tim_lz4_length(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (len == 0)
+    return op; // the last sequence has no match
+  op[0] = (u8)off;
+  op[1] = (u8)(off >> 8);
+  op += 2;
+  len -= TIM_LZ4_MIN_MATCH;
+  *token |= (u8)TIM_MIN(len, 15);
+  if (len >= 15)
+    op = tim_lz4_length(op, len - 15);
+  return op;
+}
+
+// compress `n` bytes into `dst` (tim_lz4_bound(n) of room), returns the size
+static size_t tim_lz4_compress(const u8 *src, size_t n, u8 *dst) {
+  // positions + 1, 0 is empty
+  unsigned table[1 << TIM_LZ4_HASH_BITS] = {0};
+  size_t ip = 0, anchor = 0, misses = 0;
+  u8 *op = dst;
+
+  while (n >= TIM_LZ4_MF_LIMIT + 1 && ip + TIM_LZ4_MF_LIMIT <= n) {
+    unsigned seq = tim_lz4_read32(src + ip);
+    unsigned h = (seq * 2654435761u) >> (32 - TIM_LZ4_HASH_BITS);
+    size_t ref = table[h], len;
+
+    table[h] = (unsigned)(ip + 1);
+    if (ref == 0 || ip + 1 - ref > 65535 ||
+        tim_lz4_read32(src + ref - 1) != seq) {
+      // skip faster over data that doesn't compress
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    --ref;
+    len = TIM_LZ4_MIN_MATCH;
+    while (ip + len < n - TIM_LZ4_LAST_LITERALS && src[ref + len] == src[ip + len])
+      ++len;
+    op = tim_lz4_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+    ip += len;
+    anchor = ip;
+    misses = 0;
+  }
+  op = tim_lz4_sequence(op, src + anchor, n - anchor, 0, 0);
+  return (size_t)(op - dst);
+}
+
+// 1 if `src` decompresses to exactly `n` bytes at `dst`
+static int tim_lz4_decompress(const u8 *src, size_t len, u8 *dst, size_t n) {
+  const u8 *ip = src, *end = src + len;
+  u8 *op = dst, *oend = dst + n;
+  size_t lit, ml, off;
+  unsigned b;
+
+  while (ip < end) {
+    unsigned token = *ip++;
+    lit = token >> 4;
+    if (lit == 15) {
+      do {
+        if (ip >= end)
+          return 0;
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > (size_t)(end - ip) || lit > (size_t)(oend - op))
+      return 0;
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == end)
+      break; // last sequence, literals only
+
+    if (end - ip < 2)
+      return 0;
+    off = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if (off == 0 || off > (size_t)(op - dst))
+      return 0;
+    ml = token & 15;
+    if (ml == 15) {
+      do {
+        if (ip >= end)
+          return 0;
+        b = *ip++;
+        ml += b;
+      } while (b == 255);
+    }
+    ml += TIM_LZ4_MIN_MATCH;
+    if (ml > (size_t)(oend - op))
+      return 0;
+    if (off >= ml) {
+      memcpy(op, op - off, ml);
+      op += ml;
+    } else {
+      // overlapping copy repeats the last `off` bytes
+      for (; ml > 0; --ml, ++op)
+        *op = op[-(ptrdiff_t)off];
+    }
+  }
+  return op == oend;
+}
+
+// the whole file, mapped where possible
+static tim_err tim_raw_open(const char *file, u8 **data, size_t *len) {
+#if TIM_RAW_MMAP
+  struct stat st;
+  void *p;
+  int fd = open(file, O_RDONLY);
+
+  if (fd < 0)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't open");
+  if (fstat(fd, &st) != 0 || st.st_size < TIM_RAW_HEADER) {
+    close(fd);
+    return tim_set_error(TIM_ERR_INTERNAL, "not a tim raw file");
+  }
+  // private and writable, so a view can be changed without touching the file
+  p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+           0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't mmap");
+  *data = p;
+  *len = (size_t)st.st_size;
+  return TIM_ERR_OK;
+#else
+  FILE *f = fopen(file, "rb");
+  long size;
+
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < TIM_RAW_HEADER ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    fclose(f);
+    return tim_set_error(TIM_ERR_INTERNAL, "not a tim raw file");
+  }
+  *data = malloc((size_t)size);
+  if (*data == NULL) {
+    fclose(f);
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  }
+  if (fread(*data, 1, (size_t)size, f) != (size_t)size) {
+    free(*data);
+    fclose(f);
+    return tim_set_error(TIM_ERR_INTERNAL, "can't read");
+  }
+  fclose(f);
+  *len = (size_t)size;
+  return TIM_ERR_OK;
+#endif
+}
+
+static void tim_raw_close(u8 *data, size_t len) {
+#if TIM_RAW_MMAP
+  munmap(data, len);
+#else
+  (void)len;
+  free(data);
+#endif
+}
+
+typedef struct {
+  const tim_raw_header *h;
+  tim_img *im;
+  // tiled files: the index and the tile data after it
+  const u8 *index, *tiles;
+  // tiles being written and their sizes, a tile that couldn't be allocated
+  // stays NULL
+  u8 **out;
+  size_t *out_len;
+  // one slot per tile read, so the workers never share a flag
+  u8 *failed;
+} tim_raw_job;
+
+static void tim_raw_read_tile(void *ctx, size_t i) {
+  tim_raw_job *job = ctx;
+  const tim_raw_header *h = job->h;
+  unsigned x, y, w, th, r;
+  size_t row, raw, off, len;
+  const u8 *src;
+  u8 *tmp = NULL;
+
+  tim_raw_tile_rect(h, i, &x, &y, &w, &th);
+  row = (size_t)w * h->channels;
+  raw = row * th;
+  off = (size_t)tim_raw_get(job->index + 16 * i, 8);
+  len = (size_t)tim_raw_get(job->index + 16 * i + 8, 8);
+  // tim_raw_parse checked the index, the tile lies within the data
+  src = job->tiles + off;
+  if (len != raw) {
+    tmp = malloc(raw);
+    if (h->compression != TIM_RAW_LZ4 || tmp == NULL ||
+        !tim_lz4_decompress(src, len, tmp, raw)) {
+      free(tmp);
+      job->failed[i] = 1;
+      return;
+    }
+    src = tmp;
+  }
+  for (r = 0; r < th; ++r)
+    memcpy(job->im->pixels + (size_t)(y + r) * job->im->stride +
+               (size_t)x * h->channels,
+           src + row * r, row);
+  free(tmp);
+}
+
+static void tim_raw_write_tile(void *ctx, size_t i) {
+  tim_raw_job *job = ctx;
+  const tim_raw_header *h = job->h;
+  unsigned x, y, w, th, r;
+  size_t row, raw, len;
+  u8 *tile, *packed;
+
+  tim_raw_tile_rect(h, i, &x, &y, &w, &th);
+  row = (size_t)w * h->channels;
+  raw = row * th;
+  tile = malloc(raw);
+  if (tile == NULL)
+    return;
+  for (r = 0; r < th; ++r)
+    memcpy(tile + row * r,
+           job->im->pixels + (size_t)(y + r) * TIM_STRIDE(job->im) +
+               (size_t)x * h->channels,
+           row);
+  len = raw;
+  if (h->compression == TIM_RAW_LZ4) {
+    packed = malloc(tim_lz4_bound(raw));
+    if (packed != NULL)
+      len = tim_lz4_compress(tile, raw, packed);
+    if (packed != NULL && len < raw) {
+      free(tile);
+      tile = packed;
+    } else {
+      free(packed);
+      len = raw;
+    }
+  }
+  job->out[i] = tile;
+  job->out_len[i] = len;
+}
+
+tim_err tim_raw_write(tim_img *im, const char *file,
+                      const tim_raw_opts *opts) {
+  u8 header[TIM_RAW_HEADER] = {0}, entry[16];
+  tim_raw_header h;
+  tim_raw_job job = {0};
+  size_t i, n = 0, off = 0, row;
+  int ok = 1, failed = 0;
+  FILE *f;
+
+  TIM_TRACE("tim_raw_write(%p, %s, %p)\n", im, file, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_raw_opts;
+
+  if (im == NULL || im->pixels == NULL || file == NULL || im->width <= 0 ||
+      im->height <= 0 || im->channels < 1 || im->channels > 4 ||
+      opts->tile_size < 0 || opts->tile_size > TIM_RAW_MAX_TILE ||
+      opts->threads < 0 || (opts->lz4 && opts->tile_size == 0))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  h.width = (unsigned)im->width;
+  h.height = (unsigned)im->height;
+  h.channels = (unsigned)im->channels;
+  h.tile = (unsigned)opts->tile_size;
+  h.compression = opts->lz4 ? TIM_RAW_LZ4 : TIM_RAW_NONE;
+  row = (size_t)im->width * im->channels;
+  h.stride = h.tile == 0 ? row : 0;
+  h.size = row * h.height;
+
+  if (h.tile != 0) {
+    n = tim_raw_tiles(&h);
+    job.h = &h;
+    job.im = im;
+    job.out = calloc(n, sizeof(*job.out));
+    job.out_len = calloc(n, sizeof(*job.out_len));
+    if (job.out == NULL || job.out_len == NULL) {
+      free(job.out);
+      free(job.out_len);
+      return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+    }
+    tim_parallel_for(n, (size_t)opts->threads, tim_raw_write_tile, &job);
+    h.size = 16 * n;
+    for (i = 0; i < n; ++i) {
+      failed |= job.out[i] == NULL;
+      h.size += job.out_len[i];
+    }
+  }
+
+  memcpy(header, TIM_RAW_MAGIC, 8);
+  tim_raw_put(header + 8, TIM_RAW_VERSION, 4);
+  tim_raw_put(header + 12, TIM_RAW_HEADER, 4);
+  tim_raw_put(header + 16, h.width, 4);
+  tim_raw_put(header + 20, h.height, 4);
+  tim_raw_put(header + 24, h.channels, 4);
+  tim_raw_put(header + 28, h.tile, 4);
+  tim_raw_put(header + 32, h.compression, 4);
+  tim_raw_put(header + 40, h.stride, 8);
+  tim_raw_put(header + 48, h.size, 8);
+
+  f = failed ? NULL : fopen(file, "wb");
+  if (f != NULL) {
+    ok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    for (i = 0; ok && h.tile == 0 && i < h.height; ++i)
+      ok = fwrite(im->pixels + TIM_STRIDE(im) * i, 1, row, f) == row;
+    for (i = 0; ok && i < n; ++i) {
+      tim_raw_put(entry, off, 8);
+      tim_raw_put(entry + 8, job.out_len[i], 8);
+      off += job.out_len[i];
+      ok = fwrite(entry, 1, 16, f) == 16;
+    }
+    for (i = 0; ok && i < n; ++i)
+      ok = fwrite(job.out[i], 1, job.out_len[i], f) == job.out_len[i];
+    ok = (fclose(f) == 0) && ok;
+  }
+  for (i = 0; i < n; ++i)
+    free(job.out[i]);
+  free(job.out);
+  free(job.out_len);
+
+  if (failed)
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+  if (!ok)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't write");
+  return TIM_ERR_OK;
+}
+
+tim_err tim_raw_read(tim_img *im, const char *file,
+                     const tim_read_opts *opts) {
+  tim_raw_header h;
+  tim_raw_job job;
+  tim_err err;
+  size_t len, r, i, n;
+  int failed = 0;
+  u8 *data;
+
+  TIM_TRACE("tim_raw_read(%p, %s, %p)\n", im, file, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_raw_read_opts;
+
+  if (im == NULL || file == NULL || opts->threads < 0)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  err = tim_raw_open(file, &data, &len);
+  if (err != TIM_ERR_OK)
+    return err;
+  err = tim_raw_parse(&h, data, len);
+  if (err == TIM_ERR_OK)
+    err = tim_init(im, h.width, h.height, h.channels);
+  if (err != TIM_ERR_OK) {
+    tim_raw_close(data, len);
+    return err;
+  }
+  im->stride = (size_t)h.width * h.channels;
+
+  if (h.tile == 0) {
+    for (r = 0; r < h.height; ++r)
+      memcpy(im->pixels + im->stride * r, data + TIM_RAW_HEADER + h.stride * r,
+             im->stride);
+  } else {
+    n = tim_raw_tiles(&h);
+    job.h = &h;
+    job.im = im;
+    job.index = data + TIM_RAW_HEADER;
+    job.tiles = job.index + 16 * n;
+    job.out = NULL;
+    job.out_len = NULL;
+    job.failed = calloc(n, 1);
+    if (job.failed == NULL) {
+      tim_raw_close(data, len);
+      tim_free(im);
+      return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+    }
+    tim_parallel_for(n, (size_t)opts->threads, tim_raw_read_tile, &job);
+    for (i = 0; i < n; ++i)
+      failed |= job.failed[i];
+    free(job.failed);
+    if (failed) {
+      tim_raw_close(data, len);
+      tim_free(im);
+      return tim_set_error(TIM_ERR_INTERNAL, "corrupt tim raw tile");
+    }
+  }
+  tim_raw_close(data, len);
+  return TIM_ERR_OK;
+}
+
+tim_err tim_raw_map(tim_img *im, const char *file) {
+  tim_raw_header h;
+  tim_err err;
+  size_t len;
+  u8 *data;
+
+  TIM_TRACE("tim_raw_map(%p, %s)\n", im, file);
+
+  if (im == NULL || file == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  err = tim_raw_open(file, &data, &len);
+  if (err != TIM_ERR_OK)
+    return err;
+  err = tim_raw_parse(&h, data, len);
+  if (err == TIM_ERR_OK && h.tile != 0)
+    err = tim_set_error(TIM_ERR_ARG, "tiled tim raw files can't be mapped");
+  // tim_raw_unmap only has the header to go by, so it has to match the file
+  if (err == TIM_ERR_OK && len != TIM_RAW_HEADER + h.size)
+    err = tim_set_error(TIM_ERR_INTERNAL, "tim raw file has trailing bytes");
+  if (err != TIM_ERR_OK) {
+    tim_raw_close(data, len);
+    return err;
+  }
+
+  im->width = (int)h.width;
+  im->height = (int)h.height;
+  im->channels = (int)h.channels;
+  im->stride = h.stride;
+  im->pixels = data + TIM_RAW_HEADER;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_raw_unmap(tim_img *im) {
+  TIM_TRACE("tim_raw_unmap(%p)\n", im);
+
+  if (im == NULL || im->pixels == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  // the mapping still holds the header, and tim_raw_map made sure its data
+  // size covers the whole file
+  tim_raw_close(im->pixels - TIM_RAW_HEADER,
+                TIM_RAW_HEADER + (size_t)tim_raw_get(im->pixels - TIM_RAW_HEADER +
+                                                         48,
+                                                     8));
+  im->pixels = NULL;
+  return TIM_ERR_OK;
+}
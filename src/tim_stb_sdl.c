@@ -1,19 +1,39 @@
 // C99
+#define _POSIX_C_SOURCE 200809L // open, writev
+#include <errno.h>  // errno, EINTR
+#include <limits.h> // INT_MAX
 #include <stddef.h> // NULL
 #include <stdio.h>  // stderr, fprintf, snprintf
 #include <stdlib.h> // calloc, free
+#include <string.h> // strrchr, strcmp, memcpy
 #include <time.h> // time
 
 #include "tim.h" // Tiny Image Manipulation
+#include "tim_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+  #include <fcntl.h>
+  #include <sys/uio.h>
+  #include <unistd.h>
+  #define TIM_WRITEV 1
+#else
+  #define TIM_WRITEV 0
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+// the stbiw settings are per thread, like stbi's failure reason and flags
+#if TIM_THREADS
+  #define STBIW_THREAD_LOCAL TIM_THREAD_LOCAL
+#endif
+// let the writers hand the output over in large chunks
+#define STBIW_WRITE_BUFFER_SIZE (1 << 20)
 #include "stb_image.h"
 #include "stb_image_write.h"
 
-#define TIM_MIN(a, b) ((a) < (b) ? (a) : (b))
-#define TIM_STRINGIFY_(x) #x
-#define TIM_STRINGIFY(x) TIM_STRINGIFY_(x)
+#if TIM_THREADS && !defined(STBI_THREAD_LOCAL)
+  #error "stb_image has no thread-local state here, build with -DTIM_NO_THREADS"
+#endif
 
 // color channel offsets for RGBA
 // TODO: do i need to check for stbi order or target host being little-endian?
@@ -24,20 +44,7 @@
 
 // deref a color ptr either for assigning or reading its value
 #define TIM_PX(im, x, y, c)                                                    \
-  *(im->pixels + ((x + im->width * y) * im->channels) + c)
-
-// debugging enabled
-#if defined(DEBUG) || !defined(NDEBUG)
-  #define TIM_DEBUG 1
-#else
-  #define TIM_DEBUG 0
-#endif
-
-#if TIM_DEBUG
-  #define TIM_TRACE(...) fprintf(stderr, "[TIM] " __VA_ARGS__);
-#else
-  #define TIM_TRACE(...)
-#endif
+  *(im->pixels + (y) * TIM_STRIDE(im) + (x) * im->channels + c)
 
 // allow implementing tim_display() with -lSDL2 -lSDL2_image -DTIM_IMPL_DISPLAY
 #ifdef TIM_IMPL_DISPLAY
@@ -61,28 +68,120 @@ tim_err tim_init(tim_img *im, size_t width, size_t height, size_t channels) {
   im->width = width;
   im->height = height;
   im->channels = channels;
+  im->stride = width * channels;
   im->pixels = calloc(width * height * channels, sizeof(uint8_t));
   TIM_TRACE("allocated addr %p with %ld bytes\n", im->pixels,
             width * height * channels);
   return (im->pixels == NULL) ? TIM_ERR_ALLOC : TIM_ERR_OK;
 }
 
-tim_err tim_file_read(tim_img *im, const char *file) {
+// reason of the last failure on this thread, see tim_last_error_detail()
+static TIM_THREAD_LOCAL const char *tim_error_detail = "";
+
+tim_err tim_set_error(tim_err err, const char *detail) {
+  tim_error_detail = (detail != NULL) ? detail : "";
+  TIM_TRACE("error %d: %s\n", err, tim_error_detail);
+  return err;
+}
+
+const char *tim_last_error_detail(void) { return tim_error_detail; }
+
+// stbi keeps its failure reason per thread as well, a region outside the
+// image is only found once the header is read but is still the caller's fault
+static tim_err tim_stbi_error(void) {
+  const char *reason = stbi_failure_reason();
+  if (reason != NULL && strcmp(reason, "bad region") == 0)
+    return tim_set_error(TIM_ERR_ARG, reason);
+  return tim_set_error(TIM_ERR_INTERNAL, reason);
+}
+
+static const tim_read_opts tim_default_read_opts = {0};
+static const tim_write_opts tim_default_write_opts = {0};
+static const tim_transform_opts tim_default_transform_opts = {0};
+
+// stbi_load* report the channel count of the file, not of the buffer
+static void tim_stb_read_channels(tim_img *im, const tim_read_opts *opts) {
+  if (opts->channels != 0)
+    im->channels = opts->channels;
+  im->stride = (size_t)im->width * im->channels;
+}
+
+#if TIM_THREADS
+typedef struct {
+  void (*fn)(void *ctx, int i);
+  void *ctx;
+} tim_stb_job;
+
+static void tim_stb_job_run(void *ctx, size_t i) {
+  tim_stb_job *job = ctx;
+  job->fn(job->ctx, (int)i);
+}
+
+// stbi__context.parallel_for on top of tim_parallel_for, `user` is the opts
+static void tim_stb_parallel_for(void *user, int n, void (*fn)(void *, int),
+                                 void *ctx) {
+  const tim_read_opts *opts = user;
+  tim_stb_job job;
+
+  job.fn = fn;
+  job.ctx = ctx;
+  tim_parallel_for((size_t)n, (size_t)opts->threads, tim_stb_job_run, &job);
+}
+#endif
+
+// large jpgs decode their restart intervals (in memory only) and convert
+// their colors on several threads
+static void tim_stb_read_threads(stbi__context *s, const tim_read_opts *opts) {
+#if TIM_THREADS
+  if (opts->threads > 1 || (opts->threads == 0 && tim_cpu_count() > 1)) {
+    s->parallel_for = tim_stb_parallel_for;
+    s->parallel_user = (void *)opts;
+  }
+#else
+  (void)s;
+  (void)opts;
+#endif
+}
+
+// decode through stbi's 8-bit post-processing into a new buffer
+static tim_err tim_stb_read(tim_img *im, stbi__context *s,
+                            const tim_read_opts *opts) {
+  tim_stb_read_threads(s, opts);
+  stbi_set_flip_vertically_on_load_thread(opts->flip_vertically != 0);
+  im->pixels = stbi__load_and_postprocess_8bit(s, &im->width, &im->height,
+                                               &im->channels, opts->channels);
+  if (im->pixels == NULL)
+    return tim_stbi_error();
+  tim_stb_read_channels(im, opts);
+  return TIM_ERR_OK;
+}
+
+tim_err tim_file_read_ex(tim_img *im, const char *file,
+                         const tim_read_opts *opts) {
+  stbi__context s;
+  tim_err err;
+  FILE *f;
 #ifdef TIM_DEBUG
   time_t t_start = time(NULL);
 #endif
-  TIM_TRACE("tim_file_read(%p, %p)\n", im, file);
+  TIM_TRACE("tim_file_read_ex(%p, %p, %p)\n", im, file, opts);
 
-  if (im == NULL || file == NULL)
-    return TIM_ERR_ARG;
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
 
-  im->pixels =
-      stbi_load(file, &im->width, &im->height, &im->channels, STBI_default);
+  if (im == NULL || file == NULL || opts->channels < 0 || opts->channels > 4 ||
+      opts->threads < 0)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
 
-  if (im->pixels == NULL) {
-    TIM_TRACE("stbi_err: %s\n", stbi_failure_reason());
-    return TIM_ERR_INTERNAL;
-  }
+  f = stbi__fopen(file, "rb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+
+  stbi__start_file(&s, f);
+  err = tim_stb_read(im, &s, opts);
+  fclose(f);
+  if (err != TIM_ERR_OK)
+    return err;
 
   TIM_TRACE(
       "tim_file_read(%p, %s) => { w: %d, h: %d, ch: %d, px: %p } in %lds\n", im,
@@ -92,23 +191,1230 @@ tim_err tim_file_read(tim_img *im, const char *file) {
   return TIM_ERR_OK;
 }
 
-tim_err tim_file_write(tim_img *im, const char *file) {
+tim_err tim_file_read(tim_img *im, const char *file) {
+  return tim_file_read_ex(im, file, NULL);
+}
+
+tim_err tim_mem_read_ex(tim_img *im, const u8 *data, size_t len,
+                        const tim_read_opts *opts) {
+  stbi__context s;
+
+  TIM_TRACE("tim_mem_read_ex(%p, %p, %ld, %p)\n", im, data, len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (im == NULL || data == NULL || len == 0 || len > INT_MAX ||
+      opts->channels < 0 || opts->channels > 4 || opts->threads < 0)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi__start_mem(&s, data, (int)len);
+  return tim_stb_read(im, &s, opts);
+}
+
+tim_err tim_mem_read(tim_img *im, const u8 *data, size_t len) {
+  return tim_mem_read_ex(im, data, len, NULL);
+}
+
+tim_err tim_file_info(const char *file, int *width, int *height,
+                      int *channels) {
+  int w, h, c;
+  TIM_TRACE("tim_file_info(%s)\n", file);
+
+  if (file == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  if (!stbi_info(file, &w, &h, &c))
+    return tim_stbi_error();
+
+  if (width != NULL)
+    *width = w;
+  if (height != NULL)
+    *height = h;
+  if (channels != NULL)
+    *channels = c;
+  return TIM_ERR_OK;
+}
+
+// decode through stbi's 8-bit post-processing with the caller's buffer as
+// destination, jpeg writes its rows there directly
+static tim_err tim_stb_read_into(tim_img *im, stbi__context *s,
+                                 const tim_read_opts *opts) {
+  int x, y, comp;
+
+  s->out_buffer = im->pixels;
+  s->out_stride = (int)TIM_STRIDE(im);
+  s->out_rows = im->height;
+
+  tim_stb_read_threads(s, opts);
+  stbi_set_flip_vertically_on_load_thread(opts->flip_vertically != 0);
+  if (stbi__load_and_postprocess_8bit(s, &x, &y, &comp, im->channels) == NULL)
+    return tim_stbi_error();
+
+  im->stride = TIM_STRIDE(im);
+  im->width = x;
+  im->height = y;
+  return TIM_ERR_OK;
+}
+
+static int tim_read_into_valid(tim_img *im) {
+  return im != NULL && im->pixels != NULL && im->channels >= 1 &&
+         im->channels <= 4 && im->width > 0 && im->height > 0 &&
+         TIM_STRIDE(im) >= (size_t)im->width * im->channels &&
+         TIM_STRIDE(im) <= INT_MAX;
+}
+
+tim_err tim_file_read_into(tim_img *im, const char *file,
+                           const tim_read_opts *opts) {
+  stbi__context s;
+  tim_err err;
+  FILE *f;
+
+  TIM_TRACE("tim_file_read_into(%p, %s, %p)\n", im, file, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_into_valid(im) || file == NULL || opts->threads < 0)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  f = stbi__fopen(file, "rb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+
+  stbi__start_file(&s, f);
+  err = tim_stb_read_into(im, &s, opts);
+  fclose(f);
+  return err;
+}
+
+tim_err tim_mem_read_into(tim_img *im, const u8 *data, size_t len,
+                          const tim_read_opts *opts) {
+  stbi__context s;
+
+  TIM_TRACE("tim_mem_read_into(%p, %p, %ld, %p)\n", im, data, len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_into_valid(im) || data == NULL || len == 0 || len > INT_MAX ||
+      opts->threads < 0)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi__start_mem(&s, data, (int)len);
+  return tim_stb_read_into(im, &s, opts);
+}
+
+static int tim_read_region_valid(tim_img *im, const tim_read_opts *opts, int x,
+                                 int y, int w, int h) {
+  return im != NULL && opts->channels >= 0 && opts->channels <= 4 &&
+         opts->threads >= 0 && x >= 0 && y >= 0 && w > 0 && h > 0;
+}
+
+// jpgs only decode the region, stb crops everything else after decoding
+static void tim_stb_read_region(stbi__context *s, int x, int y, int w, int h) {
+  s->roi_x = x;
+  s->roi_y = y;
+  s->roi_w = w;
+  s->roi_h = h;
+}
+
+tim_err tim_file_read_region(tim_img *im, const char *file, int x, int y,
+                             int w, int h, const tim_read_opts *opts) {
+  stbi__context s;
+  tim_err err;
+  FILE *f;
+
+  TIM_TRACE("tim_file_read_region(%p, %s, %d, %d, %d, %d, %p)\n", im, file, x,
+            y, w, h, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_region_valid(im, opts, x, y, w, h) || file == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  f = stbi__fopen(file, "rb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+
+  stbi__start_file(&s, f);
+  tim_stb_read_region(&s, x, y, w, h);
+  err = tim_stb_read(im, &s, opts);
+  fclose(f);
+  return err;
+}
+
+tim_err tim_mem_read_region(tim_img *im, const u8 *data, size_t len, int x,
+                            int y, int w, int h, const tim_read_opts *opts) {
+  stbi__context s;
+
+  TIM_TRACE("tim_mem_read_region(%p, %p, %ld, %d, %d, %d, %d, %p)\n", im, data,
+            len, x, y, w, h, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_region_valid(im, opts, x, y, w, h) || data == NULL ||
+      len == 0 || len > INT_MAX)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi__start_mem(&s, data, (int)len);
+  tim_stb_read_region(&s, x, y, w, h);
+  return tim_stb_read(im, &s, opts);
+}
+
+static int tim_read_opts_valid(tim_img *im, const tim_read_opts *opts) {
+  return im != NULL && opts->channels >= 0 && opts->channels <= 4 &&
+         opts->threads >= 0;
+}
+
+// jpgs are built from their DC coefficients, stb box filters everything else
+tim_err tim_file_read_preview(tim_img *im, const char *file,
+                              const tim_read_opts *opts) {
+  stbi__context s;
+  tim_err err;
+  FILE *f;
+
+  TIM_TRACE("tim_file_read_preview(%p, %s, %p)\n", im, file, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_opts_valid(im, opts) || file == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  f = stbi__fopen(file, "rb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+
+  stbi__start_file(&s, f);
+  s.dc_only = 1;
+  err = tim_stb_read(im, &s, opts);
+  fclose(f);
+  return err;
+}
+
+tim_err tim_mem_read_preview(tim_img *im, const u8 *data, size_t len,
+                             const tim_read_opts *opts) {
+  stbi__context s;
+
+  TIM_TRACE("tim_mem_read_preview(%p, %p, %ld, %p)\n", im, data, len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_opts_valid(im, opts) || data == NULL || len == 0 ||
+      len > INT_MAX)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi__start_mem(&s, data, (int)len);
+  s.dc_only = 1;
+  return tim_stb_read(im, &s, opts);
+}
+
+// decode the Exif or JFXX thumbnail of a jpg, -1 if it has none (or a broken
+// one) and `s` has to be started over for the preview
+static int tim_stb_read_thumbnail(tim_img *im, stbi__context *s,
+                                  const tim_read_opts *opts) {
+  stbi__context t;
+  tim_err err;
+  u8 *thumb;
+  int len;
+
+  thumb = stbi__jpeg_thumbnail(s, &len);
+  if (thumb == NULL)
+    return -1;
+  stbi__start_mem(&t, thumb, len);
+  err = tim_stb_read(im, &t, opts);
+  free(thumb);
+  return err == TIM_ERR_OK ? 1 : -1;
+}
+
+tim_err tim_file_read_thumbnail(tim_img *im, const char *file,
+                                const tim_read_opts *opts) {
+  stbi__context s;
+  tim_err err = TIM_ERR_OK;
+  FILE *f;
+
+  TIM_TRACE("tim_file_read_thumbnail(%p, %s, %p)\n", im, file, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_opts_valid(im, opts) || file == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  f = stbi__fopen(file, "rb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+
+  stbi__start_file(&s, f);
+  if (tim_stb_read_thumbnail(im, &s, opts) < 0) {
+    if (fseek(f, 0, SEEK_SET) == 0) {
+      stbi__start_file(&s, f);
+      s.dc_only = 1;
+      err = tim_stb_read(im, &s, opts);
+    } else {
+      err = tim_set_error(TIM_ERR_INTERNAL, "can't seek");
+    }
+  }
+  fclose(f);
+  return err;
+}
+
+tim_err tim_mem_read_thumbnail(tim_img *im, const u8 *data, size_t len,
+                               const tim_read_opts *opts) {
+  stbi__context s;
+
+  TIM_TRACE("tim_mem_read_thumbnail(%p, %p, %ld, %p)\n", im, data, len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_opts_valid(im, opts) || data == NULL || len == 0 ||
+      len > INT_MAX)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi__start_mem(&s, data, (int)len);
+  if (tim_stb_read_thumbnail(im, &s, opts) > 0)
+    return TIM_ERR_OK;
+  stbi__start_mem(&s, data, (int)len);
+  s.dc_only = 1;
+  return tim_stb_read(im, &s, opts);
+}
+
+// YCbCr jpgs hand over their components as they are stored, anything else is
+// decoded to rgb and converted with full chroma resolution
+
+static void tim_ycbcr_plane(tim_img *plane, u8 *pixels, int w, int h) {
+  plane->width = w;
+  plane->height = h;
+  plane->channels = 1;
+  plane->stride = (size_t)w;
+  plane->pixels = pixels;
+}
+
+// 1 on success, 0 on failure and -1 for files that aren't planar YCbCr jpgs
+static int tim_stb_read_planes(tim_ycbcr *im, stbi__context *s,
+                               const tim_read_opts *opts) {
+  u8 *planes[3];
+  int w, h, cx, cy, r;
+
+  tim_stb_read_threads(s, opts);
+  if (!stbi__jpeg_test(s))
+    return -1;
+  r = stbi__jpeg_load_planes(s, planes, &w, &h, &cx, &cy);
+  if (r <= 0)
+    return r;
+
+  tim_ycbcr_plane(&im->y, planes[0], w, h);
+  tim_ycbcr_plane(&im->cb, planes[1], (w + cx - 1) / cx, (h + cy - 1) / cy);
+  tim_ycbcr_plane(&im->cr, planes[2], (w + cx - 1) / cx, (h + cy - 1) / cy);
+  im->chroma_x = cx;
+  im->chroma_y = cy;
+  if (opts->flip_vertically) {
+    stbi__vertical_flip(im->y.pixels, im->y.width, im->y.height, 1);
+    stbi__vertical_flip(im->cb.pixels, im->cb.width, im->cb.height, 1);
+    stbi__vertical_flip(im->cr.pixels, im->cr.width, im->cr.height, 1);
+  }
+  return 1;
+}
+
+static u8 tim_ycbcr_u8(float v) { return (u8)(v < 255.0f ? v : 255.0f); }
+
+// full range BT.601, the same as jfif
+static tim_err tim_stb_read_ycbcr_rgb(tim_ycbcr *im, stbi__context *s,
+                                      const tim_read_opts *opts) {
+  tim_read_opts rgb_opts = *opts;
+  tim_img rgb;
+  tim_err err;
+  size_t i, n;
+  const u8 *p;
+
+  rgb_opts.channels = 3;
+  err = tim_stb_read(&rgb, s, &rgb_opts);
+  if (err != TIM_ERR_OK)
+    return err;
+
+  im->y.pixels = im->cb.pixels = im->cr.pixels = NULL;
+  if (tim_init(&im->y, rgb.width, rgb.height, 1) != TIM_ERR_OK ||
+      tim_init(&im->cb, rgb.width, rgb.height, 1) != TIM_ERR_OK ||
+      tim_init(&im->cr, rgb.width, rgb.height, 1) != TIM_ERR_OK) {
+    free(im->y.pixels);
+    free(im->cb.pixels);
+    free(im->cr.pixels);
+    tim_free(&rgb);
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  }
+  im->chroma_x = im->chroma_y = 1;
+
+  n = (size_t)rgb.width * rgb.height;
+  for (i = 0, p = rgb.pixels; i < n; ++i, p += 3) {
+    float r = p[0], g = p[1], b = p[2];
+    im->y.pixels[i] = tim_ycbcr_u8(0.299f * r + 0.587f * g + 0.114f * b + 0.5f);
+    im->cb.pixels[i] =
+        tim_ycbcr_u8(-0.168736f * r - 0.331264f * g + 0.5f * b + 128.5f);
+    im->cr.pixels[i] =
+        tim_ycbcr_u8(0.5f * r - 0.418688f * g - 0.081312f * b + 128.5f);
+  }
+  tim_free(&rgb);
+  return TIM_ERR_OK;
+}
+
+static int tim_read_ycbcr_valid(tim_ycbcr *im, const tim_read_opts *opts) {
+  return im != NULL && opts->threads >= 0;
+}
+
+tim_err tim_file_read_ycbcr(tim_ycbcr *im, const char *file,
+                            const tim_read_opts *opts) {
+  stbi__context s;
+  tim_err err = TIM_ERR_OK;
+  FILE *f;
+  int r;
+
+  TIM_TRACE("tim_file_read_ycbcr(%p, %s, %p)\n", im, file, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_ycbcr_valid(im, opts) || file == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  f = stbi__fopen(file, "rb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+
+  stbi__start_file(&s, f);
+  r = tim_stb_read_planes(im, &s, opts);
+  if (r == 0) {
+    err = tim_stbi_error();
+  } else if (r < 0) {
+    if (fseek(f, 0, SEEK_SET) == 0) {
+      stbi__start_file(&s, f);
+      err = tim_stb_read_ycbcr_rgb(im, &s, opts);
+    } else {
+      err = tim_set_error(TIM_ERR_INTERNAL, "can't seek");
+    }
+  }
+  fclose(f);
+  return err;
+}
+
+tim_err tim_mem_read_ycbcr(tim_ycbcr *im, const u8 *data, size_t len,
+                           const tim_read_opts *opts) {
+  stbi__context s;
+  int r;
+
+  TIM_TRACE("tim_mem_read_ycbcr(%p, %p, %ld, %p)\n", im, data, len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+
+  if (!tim_read_ycbcr_valid(im, opts) || data == NULL || len == 0 ||
+      len > INT_MAX)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi__start_mem(&s, data, (int)len);
+  r = tim_stb_read_planes(im, &s, opts);
+  if (r > 0)
+    return TIM_ERR_OK;
+  if (r == 0)
+    return tim_stbi_error();
+  stbi__start_mem(&s, data, (int)len);
+  return tim_stb_read_ycbcr_rgb(im, &s, opts);
+}
+
+// frame by frame gif decoding on top of stbi__gif_load_next. stb only ever
+// composes into g.out, so besides that we keep the frame before it (for
+// "restore to previous" disposal) and one converted frame for the caller
+struct tim_anim {
+  stbi__context s;
+  stbi__gif g;
+  FILE *f;
+  tim_read_opts opts;
+  int frames;
+  // composed frame before g.out and the one before that, swapped every frame
+  u8 *back, *spare;
+  // g.out converted to opts.channels and/or flipped
+  u8 *frame;
+};
+
+static tim_err tim_anim_start(tim_anim **anim, tim_anim *a,
+                              const tim_read_opts *opts) {
+  if (opts == NULL)
+    opts = &tim_default_read_opts;
+  a->opts = *opts;
+
+  if (!stbi__gif_test(&a->s)) {
+    tim_anim_close(a);
+    return tim_set_error(TIM_ERR_INTERNAL, "not a gif");
+  }
+
+  *anim = a;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_anim_open(tim_anim **anim, const char *file,
+                      const tim_read_opts *opts) {
+  tim_anim *a;
+  TIM_TRACE("tim_anim_open(%p, %s, %p)\n", anim, file, opts);
+
+  if (anim == NULL || file == NULL ||
+      (opts != NULL && (opts->channels < 0 || opts->channels > 4)))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  // stbi__gif holds the whole lzw table, keep it off the stack
+  a = calloc(1, sizeof(*a));
+  if (a == NULL)
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+
+  a->f = stbi__fopen(file, "rb");
+  if (a->f == NULL) {
+    free(a);
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+  }
+
+  stbi__start_file(&a->s, a->f);
+  return tim_anim_start(anim, a, opts);
+}
+
+tim_err tim_anim_open_mem(tim_anim **anim, const u8 *data, size_t len,
+                          const tim_read_opts *opts) {
+  tim_anim *a;
+  TIM_TRACE("tim_anim_open_mem(%p, %p, %ld, %p)\n", anim, data, len, opts);
+
+  if (anim == NULL || data == NULL || len == 0 || len > INT_MAX ||
+      (opts != NULL && (opts->channels < 0 || opts->channels > 4)))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  a = calloc(1, sizeof(*a));
+  if (a == NULL)
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+
+  stbi__start_mem(&a->s, data, (int)len);
+  return tim_anim_start(anim, a, opts);
+}
+
+// copy g.out into a->frame with the requested channels and row order
+static void tim_anim_convert(tim_anim *a, int channels) {
+  const stbi_uc *src;
+  u8 *dst;
+  int x, y;
+
+  for (y = 0; y < a->g.h; ++y) {
+    src = a->g.out + (size_t)4 * a->g.w * y;
+    dst = a->frame + (size_t)channels * a->g.w *
+                         (a->opts.flip_vertically ? a->g.h - 1 - y : y);
+    switch (channels) {
+    case 1:
+      for (x = 0; x < a->g.w; ++x, src += 4)
+        *dst++ = stbi__compute_y(src[0], src[1], src[2]);
+      break;
+    case 2:
+      for (x = 0; x < a->g.w; ++x, src += 4) {
+        *dst++ = stbi__compute_y(src[0], src[1], src[2]);
+        *dst++ = src[3];
+      }
+      break;
+    case 3:
+      for (x = 0; x < a->g.w; ++x, src += 4) {
+        *dst++ = src[0];
+        *dst++ = src[1];
+        *dst++ = src[2];
+      }
+      break;
+    default:
+      memcpy(dst, src, (size_t)4 * a->g.w);
+      break;
+    }
+  }
+}
+
+tim_err tim_anim_next(tim_anim *anim, tim_img *frame, int *delay_ms) {
+  size_t size;
+  stbi_uc *u;
+  u8 *tmp;
+  int comp, channels;
+
+  TIM_TRACE("tim_anim_next(%p, %p, %p)\n", anim, frame, delay_ms);
+
+  if (anim == NULL || frame == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  size = (size_t)4 * anim->g.w * anim->g.h;
+
+  // remember the frame we are about to draw over, it becomes the disposal
+  // target of the next one
+  if (anim->frames > 0) {
+    if (anim->spare == NULL && (anim->spare = malloc(size)) == NULL)
+      return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+    memcpy(anim->spare, anim->g.out, size);
+  }
+
+  u = stbi__gif_load_next(&anim->s, &anim->g, &comp, 4,
+                          anim->frames > 1 ? anim->back : NULL);
+  if (u == (stbi_uc *)&anim->s)
+    return tim_set_error(TIM_ERR_END, "no more frames");
+  if (u == NULL)
+    return tim_stbi_error();
+
+  if (anim->frames > 0) {
+    tmp = anim->back;
+    anim->back = anim->spare;
+    anim->spare = tmp;
+  }
+  ++anim->frames;
+
+  channels = anim->opts.channels ? anim->opts.channels : 4;
+  frame->width = anim->g.w;
+  frame->height = anim->g.h;
+  frame->channels = channels;
+  frame->stride = (size_t)channels * anim->g.w;
+  frame->pixels = anim->g.out;
+
+  if (channels != 4 || anim->opts.flip_vertically) {
+    if (anim->frame == NULL &&
+        (anim->frame = malloc((size_t)channels * anim->g.w * anim->g.h)) ==
+            NULL)
+      return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+    tim_anim_convert(anim, channels);
+    frame->pixels = anim->frame;
+  }
+
+  if (delay_ms != NULL)
+    *delay_ms = anim->g.delay;
+
+  TIM_TRACE("tim_anim_next(%p) => frame %d, %dx%d, delay %d\n", anim,
+            anim->frames, frame->width, frame->height, anim->g.delay);
+  return TIM_ERR_OK;
+}
+
+tim_err tim_anim_close(tim_anim *anim) {
+  TIM_TRACE("tim_anim_close(%p)\n", anim);
+
+  if (anim == NULL)
+    return TIM_ERR_ARG;
+
+  if (anim->f != NULL)
+    fclose(anim->f);
+  STBI_FREE(anim->g.out);
+  STBI_FREE(anim->g.background);
+  STBI_FREE(anim->g.history);
+  free(anim->back);
+  free(anim->spare);
+  free(anim->frame);
+  free(anim);
+  return TIM_ERR_OK;
+}
+
+// growable output buffer for tim_mem_write
+typedef struct {
+  u8 *data;
+  size_t len, cap;
+  int failed;
+} tim_mem_writer;
+
+static void tim_mem_write_func(void *context, void *data, int size) {
+  tim_mem_writer *w = context;
+  size_t cap;
+  u8 *grown;
+
+  if (w->failed || size <= 0)
+    return;
+
+  if (w->len + size > w->cap) {
+    cap = (w->cap == 0) ? (1 << 16) : w->cap;
+    while (cap < w->len + size)
+      cap *= 2;
+    grown = realloc(w->data, cap);
+    if (grown == NULL) {
+      w->failed = 1;
+      return;
+    }
+    w->data = grown;
+    w->cap = cap;
+  }
+
+  memcpy(w->data + w->len, data, size);
+  w->len += size;
+}
+
+static void tim_file_write_func(void *context, void *data, int size) {
+  fwrite(data, 1, size, (FILE *)context);
+}
+
+// close a file the encoder wrote to, 0 if a write or the close failed. the
+// file is closed either way
+static int tim_close_written(FILE *f) {
+  int werr = ferror(f);
+  return fclose(f) == 0 && !werr;
+}
+
+tim_format tim_format_from_path(const char *file) {
+  const char *ext = (file == NULL) ? NULL : strrchr(file, '.');
+  char lower[5] = {0};
+  size_t i;
+
+  if (ext == NULL || strlen(ext + 1) >= sizeof(lower))
+    return TIM_FORMAT_JPG;
+
+  for (i = 0; ext[i + 1] != '\0'; ++i)
+    lower[i] = (ext[i + 1] >= 'A' && ext[i + 1] <= 'Z') ? ext[i + 1] + 32
+                                                          : ext[i + 1];
+
+  if (strcmp(lower, "png") == 0)
+    return TIM_FORMAT_PNG;
+  if (strcmp(lower, "bmp") == 0)
+    return TIM_FORMAT_BMP;
+  if (strcmp(lower, "tga") == 0)
+    return TIM_FORMAT_TGA;
+  if (strcmp(lower, "qoi") == 0)
+    return TIM_FORMAT_QOI;
+  if (strcmp(lower, "ppm") == 0 || strcmp(lower, "pgm") == 0 ||
+      strcmp(lower, "pam") == 0 || strcmp(lower, "pnm") == 0)
+    return TIM_FORMAT_PNM;
+  return TIM_FORMAT_JPG;
+}
+
+// large jpgs are cut into stripes of whole MCU rows. each stripe is one
+// restart interval, so they are encoded independently (on their own
+// threads) and joined with RSTn markers
+#define TIM_JPG_PARALLEL_MIN_PIXELS (1 << 20)
+#define TIM_JPG_STRIPE_HEIGHT 128
+
+typedef struct {
+  stbiw__jpg *j;
+  int stripe_rows; // MCU rows per stripe
+  tim_mem_writer *out;
+  // optimized huffman tables: quantized blocks of the whole image and the
+  // symbol counts of every stripe, kept between the two passes
+  short *blocks;
+  unsigned int (*freq)[4][256];
+} tim_jpg_stripes;
+
+// quantized blocks of stripe `i` and how many there are
+static short *tim_jpg_stripe_blocks(tim_jpg_stripes *st, size_t i,
+                                    size_t *count) {
+  int y0 = (int)i * st->stripe_rows;
+
+  *count = stbiw__jpg_count_mcu_blocks(st->j, y0, y0 + st->stripe_rows);
+  return st->blocks + stbiw__jpg_count_mcu_blocks(st->j, 0, y0) * 64;
+}
+
+static void tim_jpg_count_stripe(void *ctx, size_t i) {
+  tim_jpg_stripes *st = ctx;
+  size_t count;
+  short *blocks = tim_jpg_stripe_blocks(st, i, &count);
+
+  stbiw__jpg_transform_mcu_rows(st->j, (int)i * st->stripe_rows,
+                                (int)(i + 1) * st->stripe_rows, blocks);
+  stbiw__jpg_count_blocks(st->j, blocks, count, st->freq[i]);
+}
+
+static void tim_jpg_encode_stripe(void *ctx, size_t i) {
+  tim_jpg_stripes *st = ctx;
+  stbi__write_context s = {0};
+  size_t count;
+  short *blocks;
+
+  stbi__start_write_callbacks(&s, tim_mem_write_func, &st->out[i]);
+  if (st->blocks != NULL) {
+    blocks = tim_jpg_stripe_blocks(st, i, &count);
+    stbiw__jpg_write_blocks(&s, st->j, blocks, count);
+  } else {
+    stbiw__jpg_write_mcu_rows(&s, st->j, (int)i * st->stripe_rows,
+                              (int)(i + 1) * st->stripe_rows);
+  }
+  stbi__end_write_callbacks(&s);
+}
+
+// count symbols of all stripes and switch `st->j` to tables built from them.
+// keeps the standard tables if the image doesn't fit in memory twice
+static void tim_jpg_optimize(tim_jpg_stripes *st, size_t n, size_t threads,
+                             int mcu_rows) {
+  size_t i, t, c;
+
+  st->blocks = malloc(stbiw__jpg_count_mcu_blocks(st->j, 0, mcu_rows) * 64 *
+                      sizeof(short));
+  st->freq = calloc(n, sizeof(*st->freq));
+  if (st->blocks == NULL || st->freq == NULL) {
+    free(st->blocks);
+    st->blocks = NULL;
+    free(st->freq);
+    return;
+  }
+
+  tim_parallel_for(n, threads, tim_jpg_count_stripe, st);
+  for (i = 1; i < n; ++i)
+    for (t = 0; t < 4; ++t)
+      for (c = 0; c < 256; ++c)
+        st->freq[0][t][c] += st->freq[i][t][c];
+  stbiw__jpg_optimize_tables(st->j, st->freq[0]);
+  free(st->freq);
+}
+
+// stbi_write_jpg_core for an initialized encoder: spreads large images over
+// `threads` threads and can build huffman tables for the image
+static int tim_jpg_write(stbi_write_func *func, void *context, stbiw__jpg *j,
+                         size_t threads, int optimize) {
+  stbi__write_context s = {0};
+  tim_jpg_stripes st = {0};
+  size_t n = 1, i;
+  int mcu, mcu_w, mcu_rows, mcu_cols, result = 1;
+
+  mcu = stbiw__jpg_mcu_size(j);
+  mcu_w = stbiw__jpg_mcu_width(j);
+  mcu_rows = (j->height + mcu - 1) / mcu;
+  mcu_cols = (j->width + mcu_w - 1) / mcu_w;
+  // the restart interval is a 16 bit count of MCUs
+  st.stripe_rows = TIM_MIN(TIM_JPG_STRIPE_HEIGHT / mcu, 65535 / mcu_cols);
+  st.j = j;
+
+  // restart markers only pay off when the stripes really run in parallel
+  if (threads == 0)
+    threads = tim_cpu_count();
+  if (threads > 1 &&
+      (size_t)j->width * j->height >= TIM_JPG_PARALLEL_MIN_PIXELS)
+    n = (mcu_rows + st.stripe_rows - 1) / st.stripe_rows;
+  if (n == 1)
+    st.stripe_rows = mcu_rows;
+
+  if (optimize)
+    tim_jpg_optimize(&st, n, threads, mcu_rows);
+
+  if (n > 1) {
+    st.out = calloc(n, sizeof(*st.out));
+    if (st.out == NULL) {
+      free(st.blocks);
+      return 0;
+    }
+    tim_parallel_for(n, threads, tim_jpg_encode_stripe, &st);
+    for (i = 0; i < n; ++i)
+      if (st.out[i].failed)
+        result = 0;
+  }
+
+  if (result) {
+    stbi__start_write_callbacks(&s, func, context);
+    stbiw__jpg_write_headers(&s, j, n > 1 ? st.stripe_rows * mcu_cols : 0);
+    if (n > 1) {
+      for (i = 0; i < n; ++i) {
+        stbiw__write(&s, st.out[i].data, (int)st.out[i].len);
+        if (i + 1 < n) {
+          stbiw__putc(&s, 0xFF);
+          stbiw__putc(&s, 0xD0 + (i & 7)); // RSTn
+        }
+      }
+    } else if (st.blocks != NULL) {
+      stbiw__jpg_write_blocks(&s, j, st.blocks,
+                              stbiw__jpg_count_mcu_blocks(j, 0, mcu_rows));
+    } else {
+      stbiw__jpg_write_mcu_rows(&s, j, 0, mcu_rows);
+    }
+    // EOI
+    stbiw__putc(&s, 0xFF);
+    stbiw__putc(&s, 0xD9);
+    stbi__end_write_callbacks(&s);
+  }
+
+  if (st.out != NULL) {
+    for (i = 0; i < n; ++i)
+      free(st.out[i].data);
+    free(st.out);
+  }
+  free(st.blocks);
+  return result;
+}
+
+// stbi_write_jpg_core that takes strides
+static int tim_stb_write_jpg(stbi_write_func *func, void *context,
+                             tim_img *im, int quality, size_t threads,
+                             int optimize) {
+  stbiw__jpg j;
+
+  if (!stbiw__jpg_init(&j, im->width, im->height, im->channels, im->pixels,
+                       (int)TIM_STRIDE(im), quality))
+    return 0;
+  return tim_jpg_write(func, context, &j, threads, optimize);
+}
+
+// large pngs are deflated the way pigz does it: the filtered rows are cut into
+// chunks compressed on their own threads, each with the 32k before it as a
+// preset dictionary and ending in a sync flush, so the pieces form one zlib
+// stream. every chunk goes out as its own IDAT
+#define TIM_PNG_CHUNK_SIZE (1 << 18)
+
+typedef struct {
+  u8 *pixels;
+  int stride, width, height, channels, filter, fast, level, flip;
+  int chunk_rows;
+  size_t n;
+  u8 *filt;
+  // per chunk: IDAT (stb stretchy buffer, NULL if out of memory) and adler32
+  unsigned char **idat;
+  unsigned int *adler;
+} tim_png_chunks;
+
+static void tim_png_filter_chunk(void *ctx, size_t i) {
+  tim_png_chunks *pc = ctx;
+  size_t row = (size_t)pc->width * pc->channels + 1;
+  int y0 = (int)i * pc->chunk_rows;
+  int y1 = TIM_MIN(y0 + pc->chunk_rows, pc->height);
+  int y;
+  u8 *out;
+
+  // the stbiw settings are thread-local
+  stbi_flip_vertically_on_write(pc->flip);
+  for (y = y0; y < y1; ++y) {
+    // the row itself is the scratch buffer for trying out filters
+    out = pc->filt + row * y;
+    stbiw__png_filter_row(pc->pixels, pc->stride, pc->width, pc->height, y,
+                          pc->channels, pc->filter, pc->fast,
+                          (signed char *)out + 1, out);
+  }
+}
+
+// fill in length and tag of an IDAT started with 8 placeholder bytes and
+// append its crc
+static void tim_png_close_idat(unsigned char **idat) {
+  unsigned char *o = *idat;
+  int len = stbiw__sbn(*idat) - 8;
+  unsigned int crc;
+
+  stbiw__wp32(o, len);
+  stbiw__wptag(o, "IDAT");
+  crc = stbiw__crc32(*idat + 4, len + 4);
+  stbiw__sbpush(*idat, STBIW_UCHAR(crc >> 24));
+  stbiw__sbpush(*idat, STBIW_UCHAR(crc >> 16));
+  stbiw__sbpush(*idat, STBIW_UCHAR(crc >> 8));
+  stbiw__sbpush(*idat, STBIW_UCHAR(crc));
+}
+
+// byte range of chunk `i` in the filtered data
+static void tim_png_chunk_range(tim_png_chunks *pc, size_t i, size_t *start,
+                                size_t *end) {
+  size_t row = (size_t)pc->width * pc->channels + 1;
+
+  *start = row * pc->chunk_rows * i;
+  *end = TIM_MIN(*start + row * pc->chunk_rows, row * pc->height);
+}
+
+static void tim_png_deflate_chunk(void *ctx, size_t i) {
+  tim_png_chunks *pc = ctx;
+  size_t start, end, dict;
+  unsigned char *out = NULL;
+  int k;
+
+  tim_png_chunk_range(pc, i, &start, &end);
+  dict = TIM_MIN(start, 32768);
+  for (k = 0; k < 8; ++k)
+    stbiw__sbpush(out, 0);
+  if (i == 0) {
+    stbiw__sbpush(out, 0x78); // DEFLATE 32K window
+    stbiw__sbpush(out, 0x5e); // FLEVEL = 1
+  }
+  out = stbiw__zlib_deflate_block(out, pc->filt + start - dict, (int)dict,
+                                  (int)(dict + end - start), pc->level,
+                                  i + 1 == pc->n);
+  if (out == NULL)
+    return;
+  pc->adler[i] = stbiw__adler32(pc->filt + start, (int)(end - start));
+  // the last one still needs the adler32 of the whole stream
+  if (i + 1 < pc->n)
+    tim_png_close_idat(&out);
+  pc->idat[i] = out;
+}
+
+// adler32 of A followed by B, given adler32(A), adler32(B) and B's length
+static unsigned int tim_adler32_combine(unsigned int adler1,
+                                        unsigned int adler2, size_t len2) {
+  unsigned int rem = (unsigned int)(len2 % 65521);
+  unsigned int s1 = adler1 & 0xffff;
+  unsigned int s2 = rem * s1 % 65521; // fits, both are below 2^16
+
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+  if (s1 >= 65521)
+    s1 -= 65521;
+  if (s1 >= 65521)
+    s1 -= 65521;
+  if (s2 >= 65521 * 2)
+    s2 -= 65521 * 2;
+  if (s2 >= 65521)
+    s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+
+// compress the filtered data, then write all chunks. 0 if out of memory
+static int tim_png_write_chunks(stbi_write_func *func, void *context,
+                                tim_png_chunks *pc, size_t threads) {
+  unsigned char **last = &pc->idat[pc->n - 1];
+  u8 head[8 + 12 + 13], tail[12];
+  size_t i, start, end;
+  unsigned int adler;
+
+  tim_parallel_for(pc->n, threads, tim_png_deflate_chunk, pc);
+  for (i = 0; i < pc->n; ++i)
+    if (pc->idat[i] == NULL)
+      return 0;
+
+  adler = pc->adler[0];
+  for (i = 1; i < pc->n; ++i) {
+    tim_png_chunk_range(pc, i, &start, &end);
+    adler = tim_adler32_combine(adler, pc->adler[i], end - start);
+  }
+  stbiw__sbpush(*last, STBIW_UCHAR(adler >> 24));
+  stbiw__sbpush(*last, STBIW_UCHAR(adler >> 16));
+  stbiw__sbpush(*last, STBIW_UCHAR(adler >> 8));
+  stbiw__sbpush(*last, STBIW_UCHAR(adler));
+  tim_png_close_idat(last);
+
+  stbiw__png_write_ihdr(head, pc->width, pc->height, pc->channels);
+  func(context, head, sizeof(head));
+  for (i = 0; i < pc->n; ++i)
+    func(context, pc->idat[i], stbiw__sbn(pc->idat[i]));
+  stbiw__png_write_iend(tail);
+  func(context, tail, sizeof(tail));
+  return 1;
+}
+
+// stbi_write_png_to_func that takes strides and spreads images of more than
+// one chunk over `threads` threads
+static int tim_stb_write_png(stbi_write_func *func, void *context,
+                             tim_img *im, size_t threads) {
+  tim_png_chunks pc = {0};
+  size_t row = (size_t)im->width * im->channels + 1, i;
+  int result = 0;
+
+  pc.chunk_rows = (int)TIM_MAX(TIM_PNG_CHUNK_SIZE / row, 1);
+  pc.n = (im->height + pc.chunk_rows - 1) / pc.chunk_rows;
+  // the chunked stream is only worth it when the chunks really run in parallel
+  if (threads == 0)
+    threads = tim_cpu_count();
+  if (threads <= 1 || pc.n <= 1)
+    return stbi_write_png_to_func(func, context, im->width, im->height,
+                                  im->channels, im->pixels,
+                                  (int)TIM_STRIDE(im));
+
+  pc.pixels = im->pixels;
+  pc.stride = (int)TIM_STRIDE(im);
+  pc.width = im->width;
+  pc.height = im->height;
+  pc.channels = im->channels;
+  pc.filter = (stbi_write_force_png_filter >= 5) ? -1
+                                                  : stbi_write_force_png_filter;
+  pc.fast = stbi_write_png_fast_filter;
+  pc.level = stbi_write_png_compression_level;
+  pc.flip = stbi__flip_vertically_on_write;
+  pc.filt = malloc(row * im->height);
+  pc.idat = calloc(pc.n, sizeof(*pc.idat));
+  pc.adler = malloc(pc.n * sizeof(*pc.adler));
+
+  if (pc.filt != NULL && pc.idat != NULL && pc.adler != NULL) {
+    tim_parallel_for(pc.n, threads, tim_png_filter_chunk, &pc);
+    result = tim_png_write_chunks(func, context, &pc, threads);
+  }
+
+  if (pc.idat != NULL)
+    for (i = 0; i < pc.n; ++i)
+      (void)stbiw__sbfree(pc.idat[i]);
+  free(pc.idat);
+  free(pc.adler);
+  free(pc.filt);
+  return result;
+}
+
+// encode through the stbi `_to_func` writers, returns stbi's result.
+// the stbiw settings are thread-local in this build, they are set from
+// `opts` for the duration of the call and restored afterwards
+static int tim_stb_write(stbi_write_func *func, void *context, tim_img *im,
+                         tim_format fmt, const tim_write_opts *opts) {
+  int saved_level = stbi_write_png_compression_level;
+  int saved_filter = stbi_write_force_png_filter;
+  int saved_fast = stbi_write_png_fast_filter;
+  int saved_rle = stbi_write_tga_with_rle;
+  size_t row = (size_t)im->width * im->channels;
+  u8 *pixels = im->pixels;
+  int result = 0, y;
+
+  // the bmp and tga writers don't understand strides, they get a packed copy
+  if (TIM_STRIDE(im) != row &&
+      (fmt == TIM_FORMAT_BMP || fmt == TIM_FORMAT_TGA)) {
+    pixels = malloc(row * im->height);
+    if (pixels == NULL)
+      return 0;
+    for (y = 0; y < im->height; ++y)
+      memcpy(pixels + row * y, im->pixels + TIM_STRIDE(im) * y, row);
+  }
+
+  if (opts->png_compression_level > 0)
+    stbi_write_png_compression_level = opts->png_compression_level;
+  stbi_write_png_fast_filter = opts->png_filter == TIM_PNG_FILTER_FAST;
+  stbi_write_force_png_filter =
+      stbi_write_png_fast_filter ? -1 : (int)opts->png_filter - 1;
+  stbi_write_tga_with_rle = !opts->tga_raw;
+  stbi_flip_vertically_on_write(opts->flip_vertically != 0);
+
+  switch (fmt) {
+  case TIM_FORMAT_PNG:
+    result = tim_stb_write_png(func, context, im, (size_t)opts->threads);
+    break;
+  case TIM_FORMAT_BMP:
+    result = stbi_write_bmp_to_func(func, context, im->width, im->height,
+                                    im->channels, pixels);
+    break;
+  case TIM_FORMAT_TGA:
+    result = stbi_write_tga_to_func(func, context, im->width, im->height,
+                                    im->channels, pixels);
+    break;
+  case TIM_FORMAT_QOI:
+    result = stbi_write_qoi_to_func(func, context, im->width, im->height,
+                                    im->channels, im->pixels,
+                                    (int)TIM_STRIDE(im));
+    break;
+  case TIM_FORMAT_PNM:
+    result = stbi_write_pnm_to_func(func, context, im->width, im->height,
+                                    im->channels, im->pixels,
+                                    (int)TIM_STRIDE(im));
+    break;
+  case TIM_FORMAT_AUTO:
+  case TIM_FORMAT_JPG:
+    // jpg 100 unless asked otherwise
+    result = tim_stb_write_jpg(func, context, im,
+                               opts->quality ? opts->quality : 100,
+                               (size_t)opts->threads,
+                               opts->jpg_optimize_huffman);
+    break;
+  }
+
+  if (pixels != im->pixels)
+    free(pixels);
+
+  stbi_write_png_compression_level = saved_level;
+  stbi_write_force_png_filter = saved_filter;
+  stbi_write_png_fast_filter = saved_fast;
+  stbi_write_tga_with_rle = saved_rle;
+  stbi_flip_vertically_on_write(0);
+  return result;
+}
+
+static int tim_write_opts_valid(const tim_write_opts *opts) {
+  return opts->quality >= 0 && opts->quality <= 100 && opts->threads >= 0 &&
+         opts->png_filter >= TIM_PNG_FILTER_AUTO &&
+         opts->png_filter <= TIM_PNG_FILTER_FAST;
+}
+
+#if TIM_WRITEV
+// most iovecs one writev takes, posix only promises 16
+#ifdef IOV_MAX
+  #define TIM_IOV_MAX IOV_MAX
+#else
+  #define TIM_IOV_MAX 16
+#endif
+
+// writev may stop short (signals, 2 GiB per call on linux), carry on from
+// where it stopped
+static int tim_writev_all(int fd, struct iovec *iov, size_t n) {
+  ssize_t done;
+
+  while (n > 0) {
+    done = writev(fd, iov, (int)TIM_MIN(n, TIM_IOV_MAX));
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done <= 0)
+      return 0;
+    for (; n > 0 && (size_t)done >= iov->iov_len; --n, ++iov)
+      done -= (ssize_t)iov->iov_len;
+    if (n > 0) {
+      iov->iov_base = (u8 *)iov->iov_base + done;
+      iov->iov_len -= (size_t)done;
+    }
+  }
+  return 1;
+}
+
+// pnm files are the header plus the rows as they are in memory, so they go
+// to the kernel straight from the image in one writev (a few for padded or
+// flipped rows) instead of through a stdio buffer
+static tim_err tim_file_write_pnm(tim_img *im, const char *file,
+                                  const tim_write_opts *opts) {
+  char header[STBIW__PNM_HEADER_MAX];
+  size_t row = (size_t)im->width * im->channels, n, y, src;
+  int flip = opts->flip_vertically != 0, fd, ok, len;
+  struct iovec *iov;
+
+  len = stbiw__pnm_header(header, im->width, im->height, im->channels);
+  if (len == 0 || im->width <= 0 || im->height <= 0)
+    return tim_set_error(TIM_ERR_INTERNAL, "encoder failed");
+
+  n = (TIM_STRIDE(im) == row && !flip) ? 2 : 1 + (size_t)im->height;
+  iov = malloc(n * sizeof(*iov));
+  if (iov == NULL)
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  iov[0].iov_base = header;
+  iov[0].iov_len = (size_t)len;
+  if (n == 2) {
+    iov[1].iov_base = im->pixels;
+    iov[1].iov_len = row * im->height;
+  } else {
+    for (y = 0; y < (size_t)im->height; ++y) {
+      src = flip ? (size_t)im->height - 1 - y : y;
+      iov[1 + y].iov_base = im->pixels + TIM_STRIDE(im) * src;
+      iov[1 + y].iov_len = row;
+    }
+  }
+
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    free(iov);
+    return tim_set_error(TIM_ERR_INTERNAL, "could not open file for writing");
+  }
+  ok = tim_writev_all(fd, iov, n);
+  ok = (close(fd) == 0) && ok;
+  free(iov);
+  if (!ok)
+    return tim_set_error(TIM_ERR_INTERNAL, "could not write file");
+  return TIM_ERR_OK;
+}
+#endif
+
+tim_err tim_file_write_ex(tim_img *im, const char *file,
+                          const tim_write_opts *opts) {
   int stbi_result;
+  tim_format fmt;
+  FILE *f;
 #ifdef TIM_DEBUG
   time_t t_start = time(NULL);
 #endif
 
-  TIM_TRACE("tim_file_write(%p, %p)\n", im, file);
+  TIM_TRACE("tim_file_write_ex(%p, %p, %p)\n", im, file, opts);
 
-  if (im == NULL || im->pixels == NULL || file == NULL)
-    return TIM_ERR_ARG;
+  if (opts == NULL)
+    opts = &tim_default_write_opts;
 
-  // ignore input file format and save as jpg 100
-  stbi_result = stbi_write_jpg(file, im->width, im->height, im->channels,
-                               im->pixels, 100);
-  if (stbi_result <= 0) {
-    TIM_TRACE("stbi_err: %s\n", stbi_failure_reason());
-    return TIM_ERR_INTERNAL;
+  if (im == NULL || im->pixels == NULL || file == NULL ||
+      !tim_write_opts_valid(opts))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  fmt = (opts->format == TIM_FORMAT_AUTO) ? tim_format_from_path(file)
+                                          : opts->format;
+
+#if TIM_WRITEV
+  if (fmt == TIM_FORMAT_PNM)
+    return tim_file_write_pnm(im, file, opts);
+#endif
+
+  f = fopen(file, "wb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "could not open file for writing");
+
+  stbi_result = tim_stb_write(tim_file_write_func, f, im, fmt, opts);
+  if (stbi_result > 0 && !tim_close_written(f)) {
+    return tim_set_error(TIM_ERR_INTERNAL, "could not write file");
+  } else if (stbi_result <= 0) {
+    fclose(f);
+    return tim_set_error(TIM_ERR_INTERNAL, "encoder failed");
   }
 
   TIM_TRACE("tim_file_write(%p, %s) took %ld seconds, stbi_result = %d\n", im,
@@ -117,6 +1423,421 @@ tim_err tim_file_write(tim_img *im, const char *file) {
   return TIM_ERR_OK;
 }
 
+tim_err tim_file_write(tim_img *im, const char *file) {
+  return tim_file_write_ex(im, file, NULL);
+}
+
+tim_err tim_mem_write_ex(tim_img *im, u8 **out, size_t *out_len,
+                         const tim_write_opts *opts) {
+  tim_mem_writer w = {0};
+  int stbi_result;
+
+  TIM_TRACE("tim_mem_write_ex(%p, %p, %p, %p)\n", im, out, out_len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_write_opts;
+
+  if (im == NULL || im->pixels == NULL || out == NULL || out_len == NULL ||
+      !tim_write_opts_valid(opts))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi_result = tim_stb_write(tim_mem_write_func, &w, im, opts->format, opts);
+  if (w.failed) {
+    free(w.data);
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  }
+  if (stbi_result <= 0) {
+    free(w.data);
+    return tim_set_error(TIM_ERR_INTERNAL, "encoder failed");
+  }
+
+  *out = w.data;
+  *out_len = w.len;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_mem_write(tim_img *im, tim_format fmt, u8 **out, size_t *out_len) {
+  tim_write_opts opts = {0};
+  opts.format = fmt;
+  return tim_mem_write_ex(im, out, out_len, &opts);
+}
+
+static int tim_ycbcr_valid(const tim_ycbcr *im) {
+  return im != NULL && im->y.pixels != NULL && im->cb.pixels != NULL &&
+         im->cr.pixels != NULL && im->y.channels == 1 && im->cb.channels == 1 &&
+         im->cr.channels == 1 && im->chroma_x >= 1 && im->chroma_x <= 2 &&
+         im->chroma_y >= 1 && im->chroma_y <= 2 &&
+         im->cb.width == (im->y.width + im->chroma_x - 1) / im->chroma_x &&
+         im->cb.height == (im->y.height + im->chroma_y - 1) / im->chroma_y &&
+         im->cr.width == im->cb.width && im->cr.height == im->cb.height;
+}
+
+// the jpg encoder reads the planes as they are, 4:2:0 chroma is not touched
+static int tim_stb_write_ycbcr(stbi_write_func *func, void *context,
+                               tim_ycbcr *im, const tim_write_opts *opts) {
+  const unsigned char *planes[3];
+  int strides[3], result;
+  stbiw__jpg j;
+
+  planes[0] = im->y.pixels;
+  planes[1] = im->cb.pixels;
+  planes[2] = im->cr.pixels;
+  strides[0] = (int)TIM_STRIDE(&im->y);
+  strides[1] = (int)TIM_STRIDE(&im->cb);
+  strides[2] = (int)TIM_STRIDE(&im->cr);
+
+  stbi_flip_vertically_on_write(opts->flip_vertically != 0);
+  result = stbiw__jpg_init_ycbcr(&j, im->y.width, im->y.height, planes, strides,
+                                 im->chroma_x, im->chroma_y,
+                                 opts->quality ? opts->quality : 100);
+  stbi_flip_vertically_on_write(0);
+  if (!result)
+    return 0;
+  return tim_jpg_write(func, context, &j, (size_t)opts->threads,
+                       opts->jpg_optimize_huffman);
+}
+
+tim_err tim_file_write_ycbcr(tim_ycbcr *im, const char *file,
+                             const tim_write_opts *opts) {
+  tim_format fmt;
+  int stbi_result;
+  FILE *f;
+
+  TIM_TRACE("tim_file_write_ycbcr(%p, %p, %p)\n", im, file, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_write_opts;
+
+  fmt = (opts->format == TIM_FORMAT_AUTO && file != NULL)
+            ? tim_format_from_path(file)
+            : opts->format;
+  if (!tim_ycbcr_valid(im) || file == NULL || !tim_write_opts_valid(opts) ||
+      fmt != TIM_FORMAT_JPG)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  f = fopen(file, "wb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "could not open file for writing");
+
+  stbi_result = tim_stb_write_ycbcr(tim_file_write_func, f, im, opts);
+  if (stbi_result > 0 && !tim_close_written(f)) {
+    return tim_set_error(TIM_ERR_INTERNAL, "could not write file");
+  } else if (stbi_result <= 0) {
+    fclose(f);
+    return tim_set_error(TIM_ERR_INTERNAL, "encoder failed");
+  }
+  return TIM_ERR_OK;
+}
+
+tim_err tim_mem_write_ycbcr(tim_ycbcr *im, u8 **out, size_t *out_len,
+                            const tim_write_opts *opts) {
+  tim_mem_writer w = {0};
+  int stbi_result;
+
+  TIM_TRACE("tim_mem_write_ycbcr(%p, %p, %p, %p)\n", im, out, out_len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_write_opts;
+
+  if (!tim_ycbcr_valid(im) || out == NULL || out_len == NULL ||
+      !tim_write_opts_valid(opts) ||
+      (opts->format != TIM_FORMAT_AUTO && opts->format != TIM_FORMAT_JPG))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi_result = tim_stb_write_ycbcr(tim_mem_write_func, &w, im, opts);
+  if (w.failed) {
+    free(w.data);
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  }
+  if (stbi_result <= 0) {
+    free(w.data);
+    return tim_set_error(TIM_ERR_INTERNAL, "encoder failed");
+  }
+
+  *out = w.data;
+  *out_len = w.len;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_ycbcr_resize(tim_ycbcr *im, tim_ycbcr *dst, size_t new_width,
+                         size_t new_height) {
+  tim_err err;
+
+  TIM_TRACE("tim_ycbcr_resize(%p, %p, %ld, %ld)\n", im, dst, new_width,
+            new_height);
+
+  if (!tim_ycbcr_valid(im) || dst == NULL)
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  new_width = (new_width == 0) ? (size_t)im->y.width : new_width;
+  new_height = (new_height == 0) ? (size_t)im->y.height : new_height;
+
+  // chroma stays subsampled by the same factors
+  err = tim_resize(&im->y, &dst->y, new_width, new_height);
+  if (err != TIM_ERR_OK)
+    return err;
+  err = tim_resize(&im->cb, &dst->cb,
+                   (new_width + im->chroma_x - 1) / im->chroma_x,
+                   (new_height + im->chroma_y - 1) / im->chroma_y);
+  if (err != TIM_ERR_OK) {
+    tim_free(&dst->y);
+    return err;
+  }
+  err = tim_resize(&im->cr, &dst->cr, dst->cb.width, dst->cb.height);
+  if (err != TIM_ERR_OK) {
+    tim_free(&dst->y);
+    tim_free(&dst->cb);
+    return err;
+  }
+  dst->chroma_x = im->chroma_x;
+  dst->chroma_y = im->chroma_y;
+  return TIM_ERR_OK;
+}
+
+tim_err tim_ycbcr_free(tim_ycbcr *im) {
+  TIM_TRACE("tim_ycbcr_free(%p)\n", im);
+  if (im == NULL || im->y.pixels == NULL)
+    return TIM_ERR_ARG;
+  tim_free(&im->y);
+  if (im->cb.pixels != NULL)
+    tim_free(&im->cb);
+  if (im->cr.pixels != NULL)
+    tim_free(&im->cr);
+  im->chroma_x = im->chroma_y = 0;
+  return TIM_ERR_OK;
+}
+
+// lossless jpg transforms move the quantized DCT blocks around and entropy
+// code them again. mirroring an axis negates the odd frequencies along it,
+// transposing swaps the axes of every block (and the sampling factors)
+
+// per tim_transform: source x mirrored, source y mirrored, axes swapped
+static const u8 tim_transform_axes[][3] = {
+    {0, 0, 0}, {1, 0, 0}, {0, 1, 0}, {0, 1, 1},
+    {1, 1, 0}, {1, 0, 1}, {0, 0, 1}, {1, 1, 1},
+};
+
+typedef struct {
+  stbiw__jpg_coeffs c;
+  short *coeff[4];
+} tim_jpg_coeffs;
+
+static void tim_transform_block(short *dst, const short *src, const u8 *axes) {
+  int u, v, a, b;
+  short x;
+
+  for (u = 0; u < 8; ++u) {
+    for (v = 0; v < 8; ++v) {
+      // row (vertical frequency) and column of the source coefficient
+      a = axes[2] ? v : u;
+      b = axes[2] ? u : v;
+      x = src[a * 8 + b];
+      dst[u * 8 + v] = ((axes[0] && (b & 1)) != (axes[1] && (a & 1))) ? -x : x;
+    }
+  }
+}
+
+static int tim_transform_opts_valid(const tim_transform_opts *opts) {
+  return opts->transform >= TIM_TRANSFORM_NONE &&
+         opts->transform <= TIM_TRANSFORM_TRANSVERSE && opts->crop_x >= 0 &&
+         opts->crop_y >= 0 && opts->crop_w >= 0 && opts->crop_h >= 0 &&
+         (opts->crop_w == 0) == (opts->crop_h == 0);
+}
+
+static void tim_jpg_coeffs_free(tim_jpg_coeffs *t) {
+  int i;
+  for (i = 0; i < 4; ++i)
+    free(t->coeff[i]);
+}
+
+// decode the coefficients of `s` and transform and crop them into `t`
+static tim_err tim_stb_transform(tim_jpg_coeffs *t, stbi__context *s,
+                                 const tim_transform_opts *opts) {
+  const u8 *axes = tim_transform_axes[opts->transform];
+  stbiw__jpg_coeffs *c = &t->c;
+  int w, h, mw, mh, dmw, dmh, ax = 0, ay = 0, i, k, x, y, sx, sy;
+  int n, bw, bh, cw, ch, ox, oy, hs, vs;
+  stbi__jpeg *z;
+
+  memset(t, 0, sizeof(*t));
+  z = stbi__jpeg_load_coeffs(s);
+  if (z == NULL)
+    return tim_stbi_error();
+
+  // a single component isn't interleaved, its MCU is one block
+  n = s->img_n;
+  mw = n == 1 ? 8 : z->img_mcu_w;
+  mh = n == 1 ? 8 : z->img_mcu_h;
+  // partial MCUs can't move, drop them from edges that get mirrored
+  w = axes[0] ? (int)s->img_x / mw * mw : (int)s->img_x;
+  h = axes[1] ? (int)s->img_y / mh * mh : (int)s->img_y;
+  c->width = axes[2] ? h : w;
+  c->height = axes[2] ? w : h;
+  dmw = axes[2] ? mh : mw;
+  dmh = axes[2] ? mw : mh;
+  if (w == 0 || h == 0) {
+    stbi__jpeg_free_coeffs(z);
+    return tim_set_error(TIM_ERR_ARG, "image smaller than an MCU");
+  }
+
+  if (opts->crop_w != 0) {
+    if (opts->crop_x + opts->crop_w > c->width ||
+        opts->crop_y + opts->crop_h > c->height) {
+      stbi__jpeg_free_coeffs(z);
+      return tim_set_error(TIM_ERR_ARG, "crop outside the image");
+    }
+    ax = opts->crop_x / dmw * dmw;
+    ay = opts->crop_y / dmh * dmh;
+    c->width = opts->crop_x + opts->crop_w - ax;
+    c->height = opts->crop_y + opts->crop_h - ay;
+  }
+
+  c->ncomp = n;
+  c->jfif = z->jfif;
+  c->adobe = z->app14_color_transform;
+  // the quantization tables are transposed along with the blocks
+  for (i = 0; i < 4; ++i)
+    for (k = 0; k < 64; ++k)
+      c->quant[i][k] = z->dequant[i][axes[2] ? (k & 7) * 8 + (k >> 3) : k];
+
+  for (i = 0; i < n; ++i) {
+    hs = n == 1 ? 1 : z->img_comp[i].h;
+    vs = n == 1 ? 1 : z->img_comp[i].v;
+    c->id[i] = z->img_comp[i].id;
+    c->tq[i] = z->img_comp[i].tq;
+    c->h[i] = axes[2] ? vs : hs;
+    c->v[i] = axes[2] ? hs : vs;
+    // source blocks in the trimmed image (whole ones along mirrored axes)
+    bw = (w * hs / (mw / 8) + 7) / 8;
+    bh = (h * vs / (mh / 8) + 7) / 8;
+    // destination blocks, whole MCUs of them, and where the crop starts
+    cw = (c->width + dmw - 1) / dmw * c->h[i];
+    ch = (c->height + dmh - 1) / dmh * c->v[i];
+    ox = ax / dmw * c->h[i];
+    oy = ay / dmh * c->v[i];
+
+    t->coeff[i] = malloc((size_t)cw * ch * 64 * sizeof(short));
+    if (t->coeff[i] == NULL) {
+      stbi__jpeg_free_coeffs(z);
+      tim_jpg_coeffs_free(t);
+      return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+    }
+    for (y = 0; y < ch; ++y) {
+      for (x = 0; x < cw; ++x) {
+        sx = axes[2] ? y + oy : x + ox;
+        sy = axes[2] ? x + ox : y + oy;
+        sx = axes[0] ? bw - 1 - sx : sx;
+        sy = axes[1] ? bh - 1 - sy : sy;
+        // padding blocks past the source's own padding repeat the edge
+        sx = TIM_MAX(0, TIM_MIN(sx, z->img_comp[i].coeff_w - 1));
+        sy = TIM_MAX(0, TIM_MIN(sy, z->img_comp[i].coeff_h - 1));
+        tim_transform_block(
+            t->coeff[i] + ((size_t)y * cw + x) * 64,
+            z->img_comp[i].coeff +
+                ((size_t)sy * z->img_comp[i].coeff_w + sx) * 64,
+            axes);
+      }
+    }
+    c->coeff[i] = t->coeff[i];
+    c->coeff_w[i] = cw;
+  }
+
+  stbi__jpeg_free_coeffs(z);
+  return TIM_ERR_OK;
+}
+
+static int tim_jpg_coeffs_write(stbi_write_func *func, void *context,
+                                tim_jpg_coeffs *t) {
+  stbi__write_context s = {0};
+  int result;
+
+  stbi__start_write_callbacks(&s, func, context);
+  result = stbiw__jpg_write_coeffs(&s, &t->c);
+  stbi__end_write_callbacks(&s);
+  return result;
+}
+
+tim_err tim_file_transform(const char *src, const char *dst,
+                           const tim_transform_opts *opts) {
+  stbi__context s;
+  tim_jpg_coeffs t;
+  tim_err err;
+  int result;
+  FILE *f;
+
+  TIM_TRACE("tim_file_transform(%s, %s, %p)\n", src, dst, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_transform_opts;
+
+  if (src == NULL || dst == NULL || !tim_transform_opts_valid(opts))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  f = stbi__fopen(src, "rb");
+  if (f == NULL)
+    return tim_set_error(TIM_ERR_INTERNAL, "can't fopen");
+  stbi__start_file(&s, f);
+  err = tim_stb_transform(&t, &s, opts);
+  fclose(f);
+  if (err != TIM_ERR_OK)
+    return err;
+
+  // only opened now, so `dst` may be `src`
+  f = fopen(dst, "wb");
+  if (f == NULL) {
+    tim_jpg_coeffs_free(&t);
+    return tim_set_error(TIM_ERR_INTERNAL, "could not open file for writing");
+  }
+  result = tim_jpg_coeffs_write(tim_file_write_func, f, &t);
+  tim_jpg_coeffs_free(&t);
+  if (result > 0 && !tim_close_written(f)) {
+    return tim_set_error(TIM_ERR_INTERNAL, "could not write file");
+  } else if (result <= 0) {
+    fclose(f);
+    return tim_set_error(TIM_ERR_INTERNAL, "encoder failed");
+  }
+  return TIM_ERR_OK;
+}
+
+tim_err tim_mem_transform(const u8 *data, size_t len, u8 **out,
+                          size_t *out_len, const tim_transform_opts *opts) {
+  tim_mem_writer w = {0};
+  stbi__context s;
+  tim_jpg_coeffs t;
+  tim_err err;
+  int result;
+
+  TIM_TRACE("tim_mem_transform(%p, %ld, %p, %p, %p)\n", data, len, out,
+            out_len, opts);
+
+  if (opts == NULL)
+    opts = &tim_default_transform_opts;
+
+  if (data == NULL || len == 0 || len > INT_MAX || out == NULL ||
+      out_len == NULL || !tim_transform_opts_valid(opts))
+    return tim_set_error(TIM_ERR_ARG, "invalid arguments");
+
+  stbi__start_mem(&s, data, (int)len);
+  err = tim_stb_transform(&t, &s, opts);
+  if (err != TIM_ERR_OK)
+    return err;
+
+  result = tim_jpg_coeffs_write(tim_mem_write_func, &w, &t);
+  tim_jpg_coeffs_free(&t);
+  if (w.failed) {
+    free(w.data);
+    return tim_set_error(TIM_ERR_ALLOC, "out of memory");
+  }
+  if (result <= 0) {
+    free(w.data);
+    return tim_set_error(TIM_ERR_INTERNAL, "encoder failed");
+  }
+
+  *out = w.data;
+  *out_len = w.len;
+  return TIM_ERR_OK;
+}
+
 tim_err tim_pixel_get(tim_img *im, size_t x, size_t y, tim_pixel *dst) {
   TIM_TRACE("tim_pixel_get(%p, %ld, %ld, %p)\n", im, x, y, dst);
 
@@ -159,6 +1880,7 @@ tim_err tim_free(tim_img *im) {
   im->height = 0;
   im->width = 0;
   im->channels = 0;
+  im->stride = 0;
   im->pixels = NULL;
   return TIM_ERR_OK;
 }
@@ -311,7 +2033,7 @@ tim_err tim_display(tim_img *im) {
   TIM_SDL_NullCheckERR(surface = SDL_CreateRGBSurfaceFrom(
                            im->pixels, im->width, im->height,
                            im->channels * 8, // 8 bits per channel for RGB(A)
-                           im->width * 3,    // pitch
+                           (int)TIM_STRIDE(im), // pitch
                            // ? stbi gives RGB(A) ordered buffer
                            0x0000FF, // R
                            0x00FF00, // G